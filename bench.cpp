@@ -0,0 +1,270 @@
+/*
+  (C) Nathan Geffen 2013 under GPL version 3.0.
+
+  See COPYING for license.
+
+  # Benchmarks for the cumulative probability array library.
+
+  Usage: cpa_bench [size ...]
+
+  For each size (default 1e6 and 1e7; pass 100000000 for 1e8 if the machine
+  has the memory) a CPA is built in each storage mode with the same
+  weights, and searched with the same keys. The output is one line per
+  size and mode. Modes ending in -b use cpa_binary_search_batch instead
+  of calling cpa_binary_search for each key, and ending in -e search an
+  Eytzinger index built with cpa_build_index. The alias line times draws with
+  replacement from an alias table built from the same weights. Lines 
+  ending in -app and -blk time building the array, in ns per entry, with
+  cpa_append and with cpa_append_weights.
+
+  Lines starting with tmpl time cpa::Sampler from cpa_sampler.h, which 
+  stores 32 bit indices, with double (tmpl-d) and 32 bit integer 
+  (tmpl-u32) weights.
+
+  Then small CPAs are searched with cpa_linear_search (-lin) and
+  cpa_binary_search (-bin), to find the size up to which the linear search
+  is faster, which is what CPA_LINEAR_THRESHOLD should be.
+
+  entries/line is the number of entries whose searched fields share a 
+  64 byte cache line, i.e. the number of probes that can hit a cache line
+  once it has been loaded. A CPA_AOS probe may also straddle two lines,
+  because malloc does not align the entries to a cache line.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cpa.h"
+#include "cpa_alias.h"
+#include "cpa_sampler.h"
+#include "randomc.h"
+
+static const size_t MAX_SEARCHES = 1000000;
+static const size_t BATCH_SIZE = 1024;
+static const int MAX_WEIGHT = 10;
+
+double elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9 +
+    (end->tv_nsec - start->tv_nsec);
+}
+
+void bench_search(const size_t size, const int mode, const char *name,
+                  const bool batch, const bool indexed = false)
+{
+  TRandomMersenne rng(31279);
+  struct timespec start, end;
+  size_t i, j, searches = size / 2 < MAX_SEARCHES ? size / 2 : MAX_SEARCHES;
+  size_t not_found = 0;
+  double keys[BATCH_SIZE];
+  void *out[BATCH_SIZE];
+  Cpa *cpa = cpa_new_mode(size, NULL, NULL, mode);
+
+  if (cpa->error) {
+    printf("%zu\t%s\tcould not allocate\n", size, name);
+    cpa_free(cpa);
+    return;
+  }
+  for (i = 0; i < size; ++i)
+    cpa_append(cpa, (void *) (i + 1), (double) rng.IRandom(1, MAX_WEIGHT));
+  if (indexed && cpa_build_index(cpa)) {
+    printf("%zu\t%s\tcould not allocate\n", size, name);
+    cpa_free(cpa);
+    return;
+  }
+  searches -= searches % BATCH_SIZE;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < searches; i += BATCH_SIZE) {
+    /* Weights are at most MAX_WEIGHT, so these keys are still in range
+       after the searches for the earlier keys in the batch. */
+    for (j = 0; j < BATCH_SIZE; ++j)
+      keys[j] = rng.Random() * 
+        (cpa->cumulative_weight - BATCH_SIZE * MAX_WEIGHT);
+    if (batch) {
+      cpa_binary_search_batch(cpa, keys, BATCH_SIZE, out);
+    } else {
+      for (j = 0; j < BATCH_SIZE; ++j) 
+        out[j] = cpa_binary_search(cpa, keys[j]);
+    }
+    for (j = 0; j < BATCH_SIZE; ++j) if (!out[j]) ++not_found;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("%zu\t%s\t%.2f\t\t%.1f\t\t%zu\n", size, name,
+         mode == CPA_SOA ? (double) CPA_CACHE_LINE / sizeof(Cpa_node)
+         : mode == CPA_FENWICK ? (double) CPA_CACHE_LINE / sizeof(double)
+         : (double) CPA_CACHE_LINE / sizeof(Cpa_entry),
+         elapsed_ns(&start, &end) / searches, not_found);
+  cpa_free(cpa);
+}
+
+template <class WeightT>
+void bench_sampler(const size_t size, const char *name)
+{
+  typedef cpa::Sampler<uint32_t, WeightT> Sampler;
+  TRandomMersenne rng(31279);
+  struct timespec start, end;
+  size_t i, j, searches = size / 2 < MAX_SEARCHES ? size / 2 : MAX_SEARCHES;
+  size_t not_found = 0;
+  WeightT keys[BATCH_SIZE];
+  Sampler sampler(size);
+
+  for (i = 0; i < size; ++i)
+    sampler.append((uint32_t) i, (WeightT) rng.IRandom(1, MAX_WEIGHT));
+  searches -= searches % BATCH_SIZE;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i < searches; i += BATCH_SIZE) {
+    for (j = 0; j < BATCH_SIZE; ++j)
+      keys[j] = (WeightT) (rng.Random() * 
+        (sampler.cumulative_weight() - BATCH_SIZE * MAX_WEIGHT));
+    for (j = 0; j < BATCH_SIZE; ++j) 
+      if (sampler.find(keys[j]) == Sampler::npos) ++not_found;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("%zu\t%s\t%.2f\t\t%.1f\t\t%zu\n", size, name,
+         (double) CPA_CACHE_LINE / sizeof(typename Sampler::Node),
+         elapsed_ns(&start, &end) / searches, not_found);
+}
+
+/*
+  Times searches of a small CPA, which is half drained and reset over and
+  over, with the given search function. The time includes the resets, 
+  which take about as long for both searches. Used to tune
+  CPA_LINEAR_THRESHOLD.
+*/
+
+void bench_small(const size_t size, const int mode, const char *name,
+                 void *(*search)(Cpa *, const double))
+{
+  TRandomMersenne rng(31279);
+  struct timespec start, end;
+  size_t i, j, searches = 0, not_found = 0;
+  double *keys = (double *) malloc(sizeof(double) * MAX_SEARCHES);
+  Cpa *cpa = cpa_new_mode(size, NULL, NULL, mode);
+
+  for (i = 0; i < size; ++i)
+    cpa_append(cpa, (void *) (i + 1), (double) rng.IRandom(1, MAX_WEIGHT));
+  /* Each key is in range of what's left after the searches before it */
+  for (i = 0; i + size / 2 <= MAX_SEARCHES; i += size / 2)
+    for (j = 0; j < size / 2; ++j) 
+      keys[i + j] = rng.Random() * (cpa->cumulative_weight - j * MAX_WEIGHT);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i = 0; i + size / 2 <= MAX_SEARCHES; i += size / 2) {
+    for (j = 0; j < size / 2; ++j) 
+      if (!search(cpa, keys[i + j])) ++not_found;
+    cpa_reset(cpa);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  searches = i;
+  printf("%zu\t%s\t\t\t%.1f\t\t%zu\n", size, name, 
+         elapsed_ns(&start, &end) / searches, not_found);
+  cpa_free(cpa);
+  free(keys);
+}
+
+void bench_alias(const size_t size)
+{
+  TRandomMersenne rng(31279);
+  struct timespec start, end;
+  size_t i, draws = size < MAX_SEARCHES ? size : MAX_SEARCHES;
+  size_t not_found = 0;
+  Cpa *cpa = cpa_new_mode(size, NULL, NULL, CPA_FENWICK);
+  Cpa_alias *alias;
+  double *u = (double *) malloc(sizeof(double) * draws);
+  void **out = (void **) malloc(sizeof(void *) * draws);
+
+  for (i = 0; i < size; ++i)
+    cpa_append(cpa, (void *) (i + 1), (double) rng.IRandom(1, MAX_WEIGHT));
+  alias = cpa_alias_new_from_cpa(cpa);
+  cpa_free(cpa);
+  if (alias->error || !u || !out) {
+    printf("%zu	alias	could not allocate\n", size);
+  } else {
+    for (i = 0; i < draws; ++i) u[i] = rng.Random();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cpa_alias_draw_batch(alias, u, draws, out);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    for (i = 0; i < draws; ++i) if (!out[i]) ++not_found;
+    printf("%zu	alias	%.2f\t\t%.1f\t\t%zu\n", size,
+           (double) CPA_CACHE_LINE / sizeof(Cpa_alias_entry),
+           elapsed_ns(&start, &end) / draws, not_found);
+  }
+  cpa_alias_free(alias);
+  free(u);
+  free(out);
+}
+
+/*
+  Times building an array of the given size with cpa_append and with 
+  cpa_append_weights. Both build it in the same storage, which has been
+  written to first, so that page faults aren't timed.
+*/
+
+void bench_build(const size_t size, const int mode, const char *name)
+{
+  TRandomMersenne rng(31279);
+  struct timespec start, end;
+  size_t i;
+  Cpa cpa;
+  double *weights = (double *) malloc(sizeof(double) * size);
+  void **data = (void **) malloc(sizeof(void *) * size);
+  char *storage = (char *) malloc(cpa_storage_size(size, mode));
+
+  if (!weights || !data || !storage) {
+    printf("%zu\t%s\tcould not allocate\n", size, name);
+  } else {
+    for (i = 0; i < size; ++i) {
+      weights[i] = rng.IRandom(1, MAX_WEIGHT);
+      data[i] = (void *) (i + 1);
+    }
+    memset(storage, 0, cpa_storage_size(size, mode));
+    cpa_init(&cpa, size, storage, mode);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < size; ++i) cpa_append(&cpa, data[i], weights[i]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%zu\t%s-app\t\t\t%.1f\n", size, name, 
+           elapsed_ns(&start, &end) / size);
+    cpa_init(&cpa, size, storage, mode);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    cpa_append_weights(&cpa, data, weights, size);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%zu\t%s-blk\t\t\t%.1f\n", size, name, 
+           elapsed_ns(&start, &end) / size);
+  }
+  free(weights);
+  free(data);
+  free(storage);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t default_sizes[] = {1000000, 10000000};
+  int i, num_sizes = argc > 1 ? argc - 1 : 2;
+
+  printf("size\tmode\tentries/line\tns/search\tnot found\n");
+  for (i = 0; i < num_sizes; ++i) {
+    size_t size = argc > 1 ? strtoul(argv[i + 1], NULL, 10) : default_sizes[i];
+    bench_search(size, CPA_AOS, "aos", false);
+    bench_search(size, CPA_AOS, "aos-b", true);
+    bench_search(size, CPA_SOA, "soa", false);
+    bench_search(size, CPA_SOA, "soa-b", true);
+    bench_search(size, CPA_AOS, "aos-e", false, true);
+    bench_search(size, CPA_SOA, "soa-e", false, true);
+    bench_search(size, CPA_FENWICK, "fenwick", false);
+    bench_search(size, CPA_FENWICK, "fenw-b", true);
+    bench_sampler<double>(size, "tmpl-d");
+    bench_sampler<uint32_t>(size, "tmpl-u32");
+    bench_alias(size);
+    bench_build(size, CPA_AOS, "aos");
+    bench_build(size, CPA_SOA, "soa");
+    bench_build(size, CPA_FENWICK, "fenw");
+  }
+  for (size_t size = 8; size <= 2 * BATCH_SIZE; size *= 2) {
+    bench_small(size, CPA_AOS, "aos-lin", cpa_linear_search);
+    bench_small(size, CPA_AOS, "aos-bin", cpa_binary_search);
+    bench_small(size, CPA_SOA, "soa-lin", cpa_linear_search);
+    bench_small(size, CPA_SOA, "soa-bin", cpa_binary_search);
+  }
+  return 0;
+}
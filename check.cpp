@@ -0,0 +1,1472 @@
+/*
+  (C) Nathan Geffen 2013 under GPL version 3.0.
+
+  See COPYING for license.
+
+  # Checks of the CPA library and match_pair.
+
+  Usage: cpa_check
+
+  Each check runs part of the library on random inputs and compares what
+  it does with a brute force model, or with another part of the library
+  that must give the same results. The first difference a check finds is
+  reported on stderr. The exit status is the number of checks that
+  failed, so make check fails if any does.
+*/
+
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <vector>
+
+#include "cpa.h"
+#include "cpa_alias.h"
+#include "ensemble.h"
+#include "match_pair.h"
+#include "partner_writer.h"
+#include "philox.h"
+#include "population.h"
+
+using namespace std;
+using namespace mp;
+
+static const uint32_t SEED = 31279;
+
+/* Storage modes checked against the model */
+
+static const int MODES[] = {CPA_AOS, CPA_SOA, CPA_FENWICK};
+static const int NUM_MODES = sizeof(MODES) / sizeof(MODES[0]);
+static const char *MODE_NAMES[] = {"aos", "soa", "fenwick", "integer"};
+
+/* Sizes of the arrays checked, which include sizes on either side of
+   CPA_LINEAR_THRESHOLD */
+
+static const size_t SIZES[] = {1, 2, 3, 7, 64, 100, 129, 1000};
+static const size_t NUM_SIZES = sizeof(SIZES) / sizeof(SIZES[0]);
+
+/*
+  Reports a failure of check and returns false.
+*/
+
+bool fail(const char *check, const char *format, ...)
+{
+  va_list args;
+  fprintf(stderr, "%s: ", check);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fputc('\n', stderr);
+  return false;
+}
+
+/*
+  Brute force model of a CPA. An entry is found by adding up the
+  weights of the entries that haven't been found, in order, till the
+  sum is greater than the key.
+*/
+
+struct Model {
+  Model() : total(0.0) {}
+
+  vector< double > weights;
+  vector< bool > found;
+  double total;  // Of the weights of the entries that haven't been found
+
+  void append(double weight) {
+    weights.push_back(weight);
+    found.push_back(false);
+    total += weight;
+  }
+  void take(size_t i) {
+    found[i] = true;
+    total -= weights[i];
+  }
+  void set_weight(size_t i, double weight) {
+    if (!found[i]) total += weight - weights[i];
+    weights[i] = weight;
+  }
+  void reinsert(size_t i, double weight) {
+    found[i] = false;
+    weights[i] = weight;
+    total += weight;
+  }
+  double cumulative_weight() const { return total; }
+  size_t find(double key) const {
+    double sum = 0.0;
+    for (size_t i = 0; i < weights.size(); ++i) {
+      if (found[i]) continue;
+      sum += weights[i];
+      if (key < sum) return i;
+    }
+    return weights.size();
+  }
+  void reset() {
+    found.assign(found.size(), false);
+    total = 0.0;
+    for (size_t i = 0; i < weights.size(); ++i) total += weights[i];
+  }
+};
+
+/*
+  Returns the value that entry i of the checked arrays holds. 0 is left
+  for NULL.
+*/
+
+void *value(size_t i)
+{
+  return (void *) (i + 1);
+}
+
+/*
+  Makes a CPA of the given mode and a model of it, with whole number
+  weights from 1 to 10.
+*/
+
+Cpa *make_cpa(TRandomPhilox &rng, const size_t size, const int mode,
+              Model &model)
+{
+  Cpa *cpa = cpa_new_mode(size, NULL, NULL, mode);
+  model = Model();
+  for (size_t i = 0; i < size; ++i) {
+    double weight = rng.IRandom(1, 10);
+    cpa_append(cpa, value(i), weight);
+    model.append(weight);
+  }
+  return cpa;
+}
+
+/*
+  Returns a key in the middle of a whole number range of the model's
+  cumulative weight, so that rounding can't move it into the next
+  entry.
+*/
+
+double draw_key(TRandomPhilox &rng, const Model &model)
+{
+  return rng.Bounded((uint32_t) model.cumulative_weight()) + 0.5;
+}
+
+/*
+  Searches cpa with search till every entry is found, checking each
+  result against the model. Returns false on the first difference.
+*/
+
+bool search_all(const char *check, TRandomPhilox &rng, Cpa *cpa,
+                Model &model, void *(*search)(Cpa *, const double))
+{
+  const char *mode = MODE_NAMES[cpa->mode];
+  while (!cpa_all_found(cpa)) {
+    double key = draw_key(rng, model);
+    size_t i = model.find(key);
+    void *found = search(cpa, key);
+    if (found != value(i))
+      return fail(check, "%s size %zu key %.1f: found %p, not entry %zu",
+                  mode, cpa->size, key, found, i);
+    model.take(i);
+    if (cpa->cumulative_weight != model.cumulative_weight())
+      return fail(check, "%s size %zu: cumulative weight %g, not %g", mode,
+                  cpa->size, cpa->cumulative_weight,
+                  model.cumulative_weight());
+  }
+  if (search(cpa, 0.5))
+    return fail(check, "%s size %zu: found an entry when all were found",
+                mode, cpa->size);
+  return true;
+}
+
+/*
+  Makes n searches of cpa with search, checking each result against the
+  model. Returns false on the first difference.
+*/
+
+bool search_some(const char *check, TRandomPhilox &rng, Cpa *cpa,
+                 Model &model, void *(*search)(Cpa *, const double),
+                 const size_t n)
+{
+  for (size_t k = 0; k < n && !cpa_all_found(cpa); ++k) {
+    double key = draw_key(rng, model);
+    size_t i = model.find(key);
+    void *found = search(cpa, key);
+    if (found != value(i))
+      return fail(check, "%s size %zu key %.1f: found %p, not entry %zu",
+                  MODE_NAMES[cpa->mode], cpa->size, key, found, i);
+    model.take(i);
+  }
+  return true;
+}
+
+/*
+  Checks that cpa_iterate returns each entry that hasn't been found
+  once, and then NULL.
+*/
+
+bool iterate_all(const char *check, Cpa *cpa, Model &model)
+{
+  Cpa_iterator iterator;
+  void *found;
+  iterator.started = 0;
+  iterator.stack_size = 0;
+  while ((found = cpa_iterate(cpa, &iterator))) {
+    size_t i = (size_t) found - 1;
+    if (i >= cpa->size || model.found[i])
+      return fail(check, "%s size %zu: iterated to %p twice or wrongly",
+                  MODE_NAMES[cpa->mode], cpa->size, found);
+    model.take(i);
+  }
+  if (!cpa_all_found(cpa) || model.cumulative_weight() != 0.0)
+    return fail(check, "%s size %zu: iteration stopped early",
+                MODE_NAMES[cpa->mode], cpa->size);
+  return true;
+}
+
+/*
+  The searches, cpa_iterate and cpa_reset of each storage mode agree
+  with the model, and cpa_iterate finds the entries that searches have
+  left. An empty array has nothing to iterate.
+*/
+
+bool check_modes()
+{
+  TRandomPhilox rng(SEED);
+  Model model;
+  for (int m = 0; m < NUM_MODES; ++m)
+    for (size_t s = 0; s < NUM_SIZES; ++s) {
+      Cpa *cpa = make_cpa(rng, SIZES[s], MODES[m], model);
+      bool ok = search_all("modes", rng, cpa, model, cpa_binary_search);
+      cpa_reset(cpa);
+      model.reset();
+      ok = ok && search_all("modes", rng, cpa, model, cpa_search);
+      cpa_reset(cpa);
+      model.reset();
+      ok = ok && search_all("modes", rng, cpa, model, cpa_linear_search);
+      cpa_reset(cpa);
+      model.reset();
+      ok = ok && iterate_all("modes", cpa, model);
+      cpa_reset(cpa);
+      model.reset();
+      ok = ok && search_some("modes", rng, cpa, model, cpa_search,
+                             SIZES[s] / 2 + 1);
+      ok = ok && iterate_all("modes", cpa, model);
+      cpa_free(cpa);
+      if (!ok) return false;
+    }
+  for (int m = 0; m < NUM_MODES; ++m) {
+    Cpa *cpa = cpa_new_mode(0, NULL, NULL, MODES[m]);
+    Cpa_iterator iterator;
+    iterator.started = 0;
+    iterator.stack_size = 0;
+    void *found = cpa_iterate(cpa, &iterator);
+    cpa_free(cpa);
+    if (found)
+      return fail("modes", "%s: iterated to an entry of an empty array",
+                  MODE_NAMES[MODES[m]]);
+  }
+  // Modes that aren't storage modes are refused, not taken for another
+  static const int BAD_MODES[] = {-1, 3, 7};
+  for (size_t b = 0; b < sizeof(BAD_MODES) / sizeof(BAD_MODES[0]); ++b) {
+    Cpa *sized = cpa_new_mode(10, NULL, NULL, BAD_MODES[b]);
+    Cpa *empty = cpa_new_mode(0, NULL, NULL, BAD_MODES[b]);
+    bool refused = sized->error == UNSUPPORTED_MODE && 
+      cpa_append(empty, value(0), 1.0) == UNSUPPORTED_MODE && 
+      empty->size == 0 && cpa_storage_size(10, BAD_MODES[b]) == 0;
+    cpa_free(sized);
+    cpa_free(empty);
+    if (!refused)
+      return fail("modes", "mode %d wasn't refused", BAD_MODES[b]);
+  }
+  return true;
+}
+
+/*
+  A CPA_FENWICK array can be appended to after some of its entries have
+  been found, and the new entries are found as if they had been there
+  from the start.
+*/
+
+bool check_fenwick_append()
+{
+  TRandomPhilox rng(SEED);
+  Model model;
+  Cpa *cpa = make_cpa(rng, 100, CPA_FENWICK, model);
+  bool ok = true;
+  for (size_t k = 0; ok && k < 50; ++k) {
+    double key = draw_key(rng, model);
+    size_t i = model.find(key);
+    if (cpa_binary_search(cpa, key) != value(i))
+      ok = fail("fenwick", "search %zu before appending", k);
+    model.take(i);
+  }
+  for (size_t i = 100; ok && i < 300; ++i) {
+    double weight = rng.IRandom(1, 10);
+    cpa_append(cpa, value(i), weight);
+    model.append(weight);
+  }
+  ok = ok && search_all("fenwick", rng, cpa, model, cpa_binary_search);
+  cpa_free(cpa);
+  return ok;
+}
+
+/*
+  Checks that the probabilities with which alias draws each entry of the
+  model are its share of the weight of the entries that haven't been
+  found.
+*/
+
+bool check_alias_table(const Cpa_alias *alias, const Model &model)
+{
+  vector< double > drawn(model.weights.size(), 0.0);
+  for (size_t c = 0; c < alias->size; ++c) {
+    const Cpa_alias_entry &column = alias->entries[c];
+    drawn[(size_t) column.data - 1] += column.probability / alias->size;
+    if (column.probability < 1.0)
+      drawn[(size_t) column.alias - 1] += 
+        (1.0 - column.probability) / alias->size;
+  }
+  for (size_t i = 0; i < drawn.size(); ++i) {
+    double expected = model.found[i] ? 0.0 
+      : model.weights[i] / model.cumulative_weight();
+    if (fabs(drawn[i] - expected) > 1e-9)
+      return fail("alias", "size %zu: entry %zu drawn with %g, not %g",
+                  drawn.size(), i, drawn[i], expected);
+  }
+  return true;
+}
+
+/*
+  Alias tables made from weights, and from the entries of a CPA that
+  haven't been found, draw each entry in proportion to its weight, and
+  cpa_alias_draw_batch draws the same entries as cpa_alias_draw.
+*/
+
+bool check_alias()
+{
+  TRandomPhilox rng(SEED);
+  Model model;
+  for (size_t s = 0; s < NUM_SIZES; ++s) {
+    const size_t size = SIZES[s];
+    Cpa *cpa = make_cpa(rng, size, CPA_AOS, model);
+    vector< void* > data(size), out(size);
+    vector< double > u(size);
+    for (size_t i = 0; i < size; ++i) data[i] = value(i);
+    Cpa_alias *alias = cpa_alias_new(size, &data[0], &model.weights[0]);
+    bool ok = check_alias_table(alias, model);
+    rng.Fill(&u[0], size);
+    cpa_alias_draw_batch(alias, &u[0], size, &out[0]);
+    for (size_t k = 0; ok && k < size; ++k)
+      if (out[k] != cpa_alias_draw(alias, u[k]))
+        ok = fail("alias", "size %zu: batch draw %zu differs", size, k);
+    cpa_alias_free(alias);
+    for (size_t k = 0; k < size / 2; ++k) {
+      double key = draw_key(rng, model);
+      model.take(model.find(key));
+      cpa_binary_search(cpa, key);
+    }
+    alias = cpa_alias_new_from_cpa(cpa);
+    ok = ok && check_alias_table(alias, model);
+    cpa_alias_free(alias);
+    cpa_free(cpa);
+    if (!ok) return false;
+  }
+  return true;
+}
+
+/*
+  cpa_alias_draw2 resolves the probability of each column of a table too
+  big for the coin to come from the bits of one 32 bit number left over
+  from selecting the column, with weights that don't give probabilities
+  that are multiples of a power of 2, and cpa_alias_draw2_batch draws
+  the same entries as it.
+*/
+
+bool check_alias_large()
+{
+  static const size_t SIZE = 1 << 21, COINS = 1 << 16, COLUMNS = 32;
+  TRandomPhilox rng(SEED);
+  Model model;
+  vector< void* > data(SIZE), out(COINS);
+  vector< double > u_index(COINS), u_coin(COINS);
+  for (size_t i = 0; i < SIZE; ++i) {
+    data[i] = value(i);
+    model.append(rng.IRandom(1, 10));
+  }
+  Cpa_alias *alias = cpa_alias_new(SIZE, &data[0], &model.weights[0]);
+  bool ok = check_alias_table(alias, model);
+  for (size_t k = 0; ok && k < COLUMNS; ++k) {
+    size_t c = rng.Bounded(SIZE), drawn = 0;
+    const Cpa_alias_entry &column = alias->entries[c];
+    for (size_t j = 0; j < COINS; ++j) {
+      u_index[j] = (c + 0.5) / SIZE;
+      u_coin[j] = (j + 0.5) / COINS;
+      if (cpa_alias_draw2(alias, u_index[j], u_coin[j]) == column.data)
+        ++drawn;
+    }
+    if (column.probability < 1.0 && 
+        fabs(drawn - column.probability * COINS) > 1.0)
+      ok = fail("alias", "column %zu: data drawn %zu times in %zu, not %g",
+                c, drawn, COINS, column.probability * COINS);
+  }
+  rng.Fill(&u_index[0], COINS);
+  rng.Fill(&u_coin[0], COINS);
+  cpa_alias_draw2_batch(alias, &u_index[0], &u_coin[0], COINS, &out[0]);
+  for (size_t k = 0; ok && k < COINS; ++k)
+    if (out[k] != cpa_alias_draw2(alias, u_index[k], u_coin[k]))
+      ok = fail("alias", "batch draw2 %zu differs", k);
+  cpa_alias_free(alias);
+  return ok;
+}
+
+/*
+  cpa_binary_search_batch finds what the model finds for each key in
+  turn, in each storage mode. The keys are all drawn before the batch,
+  so some repeat and later ones may be out of range.
+*/
+
+bool check_batch()
+{
+  TRandomPhilox rng(SEED);
+  Model model;
+  for (int m = 0; m < NUM_MODES; ++m)
+    for (size_t s = 0; s < NUM_SIZES; ++s) {
+      const size_t size = SIZES[s];
+      Cpa *cpa = make_cpa(rng, size, MODES[m], model);
+      vector< double > keys(size + CPA_BATCH_GROUP);
+      vector< void* > out(keys.size());
+      bool ok = true;
+      for (size_t k = 0; k < keys.size(); ++k)
+        keys[k] = k % 5 == 4 ? keys[k - 1] : draw_key(rng, model);
+      cpa_binary_search_batch(cpa, &keys[0], keys.size(), &out[0]);
+      for (size_t k = 0; ok && k < keys.size(); ++k) {
+        size_t i = model.find(keys[k]);
+        if (out[k] != (i < size ? value(i) : NULL))
+          ok = fail("batch", "%s size %zu: key %zu found %p, not entry %zu",
+                    MODE_NAMES[MODES[m]], size, k, out[k], i);
+        if (i < size) model.take(i);
+      }
+      cpa_free(cpa);
+      if (!ok) return false;
+    }
+  return true;
+}
+
+/*
+  Searches of the Eytzinger index agree with the model, and the index is
+  kept up to date by the searches, cpa_iterate and cpa_reset. Besides the
+  usual sizes an array big enough to have more levels than fit in a page
+  is searched in part.
+*/
+
+static const size_t LARGE_SIZE = 70000;
+
+bool check_index()
+{
+  TRandomPhilox rng(SEED);
+  Model model;
+  for (int m = 0; m < 2; ++m)
+    for (size_t s = 0; s <= NUM_SIZES; ++s) {
+      const size_t size = s < NUM_SIZES ? SIZES[s] : LARGE_SIZE;
+      const size_t n = s < NUM_SIZES ? size : 1000;
+      Cpa *cpa = make_cpa(rng, size, MODES[m], model);
+      bool ok = cpa_build_index(cpa) == 0 ||
+        fail("index", "%s size %zu: not built", MODE_NAMES[MODES[m]], size);
+      ok = ok && search_some("index", rng, cpa, model, cpa_binary_search, n);
+      cpa_reset(cpa);
+      model.reset();
+      ok = ok && search_some("index", rng, cpa, model, cpa_binary_search, n);
+      cpa_reset(cpa);
+      model.reset();
+      ok = ok && (size == LARGE_SIZE || iterate_all("index", cpa, model));
+      cpa_free(cpa);
+      if (!ok) return false;
+    }
+  return true;
+}
+
+/*
+  Does n random changes of cpa and the model, each a search, a change of
+  weight, a removal or a reinsertion, checking the results, the error
+  codes and the cumulative weight after each one.
+*/
+
+bool change_some(const char *check, TRandomPhilox &rng, Cpa *cpa,
+                 Model &model, void *(*search)(Cpa *, const double),
+                 const size_t n)
+{
+  const char *mode = MODE_NAMES[cpa->mode];
+  const size_t size = cpa->size;
+  for (size_t k = 0; k < n; ++k) {
+    size_t i = rng.Bounded((uint32_t) size);
+    double weight = rng.IRandom(1, 10);
+    int op = rng.IRandom(0, 3);
+    if (op == 0 && !cpa_all_found(cpa)) {
+      double key = draw_key(rng, model);
+      i = model.find(key);
+      void *found = search(cpa, key);
+      if (found != value(i))
+        return fail(check, "%s size %zu change %zu: found %p, not entry %zu",
+                    mode, size, k, found, i);
+      model.take(i);
+    } else if (op == 1) {
+      if (cpa_update_weight(cpa, i, weight))
+        return fail(check, "%s size %zu: weight of %zu not changed", mode,
+                    size, i);
+      model.set_weight(i, weight);
+    } else if (op == 2) {
+      if (cpa_remove(cpa, i) != (model.found[i] ? NOT_FOUND : 0))
+        return fail(check, "%s size %zu: wrong result removing %zu", mode,
+                    size, i);
+      if (!model.found[i]) model.take(i);
+    } else {
+      if (cpa_reinsert(cpa, i, weight) != (model.found[i] ? 0 : NOT_FOUND))
+        return fail(check, "%s size %zu: wrong result reinserting %zu",
+                    mode, size, i);
+      if (model.found[i]) model.reinsert(i, weight);
+    }
+    if (cpa->cumulative_weight != model.cumulative_weight())
+      return fail(check, "%s size %zu change %zu: cumulative weight %g, "
+                  "not %g", mode, size, k, cpa->cumulative_weight,
+                  model.cumulative_weight());
+  }
+  if (cpa_update_weight(cpa, size, 1.0) != BAD_INDEX ||
+      cpa_remove(cpa, size) != BAD_INDEX ||
+      cpa_reinsert(cpa, size, 1.0) != BAD_INDEX)
+    return fail(check, "%s size %zu: index %zu not rejected", mode, size,
+                size);
+  return true;
+}
+
+/*
+  cpa_update_weight, cpa_remove and cpa_reinsert, mixed with searches,
+  agree with the model in each storage mode, with and without an index.
+  After a reset the changed weights are searched from scratch.
+*/
+
+bool check_changes()
+{
+  TRandomPhilox rng(SEED);
+  Model model;
+  for (int m = 0; m < NUM_MODES; ++m)
+    for (int indexed = 0; indexed < 2; ++indexed)
+      for (size_t s = 0; s < NUM_SIZES; ++s) {
+        const size_t size = SIZES[s];
+        if (indexed && MODES[m] == CPA_FENWICK) continue;
+        Cpa *cpa = make_cpa(rng, size, MODES[m], model);
+        bool ok = !indexed || cpa_build_index(cpa) == 0 ||
+          fail("changes", "%s size %zu: not built", MODE_NAMES[MODES[m]],
+               size);
+        ok = ok && change_some("changes", rng, cpa, model, cpa_binary_search,
+                               4 * size);
+        cpa_reset(cpa);
+        model.reset();
+        ok = ok && search_all("changes", rng, cpa, model, cpa_binary_search);
+        cpa_reset(cpa);
+        model.reset();
+        ok = ok && change_some("changes", rng, cpa, model, cpa_search,
+                               4 * size);
+        cpa_free(cpa);
+        if (!ok) return false;
+      }
+  return true;
+}
+
+/*
+  Arrays made with no entries grow as they are appended to, arrays made
+  by cpa_new_weights are searched like arrays made by appending, and
+  arrays set up by cpa_init don't grow, in each storage mode.
+*/
+
+bool check_growth()
+{
+  TRandomPhilox rng(SEED);
+  Model model;
+  for (int m = 0; m < NUM_MODES; ++m)
+    for (size_t s = 0; s < NUM_SIZES; ++s) {
+      const size_t size = SIZES[s];
+      const char *mode = MODE_NAMES[MODES[m]];
+      Cpa *cpa = cpa_new_mode(0, NULL, NULL, MODES[m]);
+      bool ok = (cpa && !cpa->error) ||
+        fail("growth", "%s: empty array not made", mode);
+      model = Model();
+      vector< void* > data(size);
+      for (size_t i = 0; ok && i < size; ++i) {
+        double weight = rng.IRandom(1, 10);
+        data[i] = value(i);
+        if (cpa_append(cpa, data[i], weight))
+          ok = fail("growth", "%s: entry %zu of an empty array not appended",
+                    mode, i);
+        model.append(weight);
+      }
+      ok = ok && search_all("growth", rng, cpa, model, cpa_binary_search);
+      if (cpa) cpa_free(cpa);
+      model.reset();
+      cpa = cpa_new_weights(size, &data[0], &model.weights[0], MODES[m]);
+      ok = ok && search_all("growth", rng, cpa, model, cpa_search);
+      cpa_free(cpa);
+
+      Cpa fixed;
+      vector< char > storage(cpa_storage_size(size, MODES[m]));
+      cpa_init(&fixed, size, &storage[0], MODES[m]);
+      for (size_t i = 0; i < size; ++i) cpa_append(&fixed, data[i], 1.0);
+      if (ok && cpa_append(&fixed, value(size), 1.0) != OUT_OF_MEMORY)
+        ok = fail("growth", "%s size %zu: array of the caller grown", mode,
+                  size);
+      if (!ok) return false;
+    }
+  return true;
+}
+
+/*
+  The first block of Philox4x32-10 with a key and counter of 0 is the
+  known answer vector of Random123, the reference implementation. The 
+  blocks made many at a time, which use SIMD instructions where the CPU
+  has them, are the same as those made one at a time, and TRandomPhilox
+  returns the words of the blocks in order.
+*/
+
+bool check_philox()
+{
+  static const uint32_t KNOWN[4] = {0x6627e8d5, 0xe169c58d, 0xbc57ac4c,
+                                    0x9b00dbd8};
+  const uint32_t keys[][2] = {{0, 0}, {SEED, 7}, {0xFFFFFFFF, 0xFFFFFFFF}};
+  const size_t n = 3 * PHILOX_BLOCKS + 5;
+  const uint64_t start = 0xFFFFFFF0ull;  // So the high word changes
+  uint32_t block[4], out[4 * n];
+  for (size_t j = 0; j < sizeof(keys) / sizeof(keys[0]); ++j) {
+    philox_blocks(keys[j], start, n, out);
+    for (size_t b = 0; b < n; ++b) {
+      philox_blocks(keys[j], start + b, 1, block);
+      if (memcmp(block, out + 4 * b, sizeof(block)))
+        return fail("philox", "key %zu: block %zu differs", j, b);
+    }
+  }
+  philox_blocks(keys[0], 0, 1, block);
+  TRandomPhilox rng(0, 0);
+  for (int k = 0; k < 4; ++k) {
+    if (block[k] != KNOWN[k])
+      return fail("philox", "word %d of the known answer is %08x, not %08x",
+                  k, block[k], KNOWN[k]);
+    uint32_t word = rng.BRandom();
+    if (word != KNOWN[k])
+      return fail("philox", "BRandom %d is %08x, not %08x", k, word,
+                  KNOWN[k]);
+  }
+  return true;
+}
+
+/*
+  Fill, Skip and the single draws of TRandomPhilox, mixed in random
+  amounts, take the same numbers from a stream as BRandom does one at a
+  time, and Bounded and Bounded64 stay in range.
+*/
+
+bool check_philox_draws()
+{
+  TRandomPhilox reference(SEED, 9), rng(SEED, 9), lengths(SEED, 10);
+  vector< uint32_t > words(200);
+  vector< double > fractions(200);
+  for (int k = 0; k < 2000; ++k) {
+    const size_t n = lengths.Bounded(200);
+    const int op = (int) lengths.Bounded(4);
+    if (op == 0) {
+      rng.Fill(&words[0], n);
+      for (size_t i = 0; i < n; ++i)
+        if (words[i] != reference.BRandom())
+          return fail("philox_draws", "Fill of %zu: word %zu differs", n, i);
+    } else if (op == 1) {
+      rng.Fill(&fractions[0], n);
+      for (size_t i = 0; i < n; ++i)
+        if (fractions[i] != reference.Random())
+          return fail("philox_draws", "Fill of %zu doubles: %zu differs", n,
+                      i);
+    } else if (op == 2) {
+      rng.Skip(n);
+      for (size_t i = 0; i < n; ++i) reference.BRandom();
+    } else {
+      for (size_t i = 0; i < n % 9; ++i)
+        if (rng.BRandom() != reference.BRandom())
+          return fail("philox_draws", "BRandom after %d draws differs", k);
+    }
+  }
+  for (int k = 0; k < 100000; ++k) {
+    const uint32_t range = lengths.BRandom() >> lengths.Bounded(32) | 1;
+    const uint64_t range64 = lengths.BRandom64() >> lengths.Bounded(64) | 1;
+    if (rng.Bounded(range) >= range || rng.Bounded64(range64) >= range64)
+      return fail("philox_draws", "draw %d out of range", k);
+  }
+  TRandomPhilox small(SEED, 11), small64(SEED, 11);
+  for (uint32_t range = 1; range < 1000; ++range)
+    if (small.Bounded(range) != small64.Bounded64(range))
+      return fail("philox_draws", "Bounded64(%u) differs from Bounded", 
+                  range);
+  return true;
+}
+
+/*
+  cpa::Sampler, which has its own copy of the code of CPA_SOA, finds the
+  same entries as CPA_SOA on the same operations: searches, removals,
+  reinsertions, iterations and resets. The sizes include some whose
+  paths are as long as an Iterator holds.
+*/
+
+bool check_sampler()
+{
+  typedef cpa::Sampler< uint32_t, double > Double_sampler;
+  TRandomPhilox rng(SEED);
+  Model model;
+  for (size_t s = 0; s <= NUM_SIZES; ++s) {
+    const size_t size = s < NUM_SIZES ? SIZES[s] : LARGE_SIZE;
+    Cpa *cpa = make_cpa(rng, size, CPA_SOA, model);
+    Double_sampler sampler;
+    Double_sampler::Iterator sampler_iterator;
+    Cpa_iterator iterator;
+    bool ok = true;
+    for (size_t i = 0; i < size; ++i) 
+      sampler.append((uint32_t) i, model.weights[i]);
+    for (int round = 0; ok && round < 3; ++round) {
+      for (size_t k = 0; ok && k < 2 * size && k < 3000; ++k) {
+        const uint32_t i = rng.Bounded((uint32_t) size);
+        const int op = (int) rng.Bounded(3);
+        if (op == 0 && !cpa_all_found(cpa)) {
+          double key = draw_key(rng, model);
+          size_t found = sampler.find(key);
+          if (cpa_binary_search(cpa, key) != value(found))
+            ok = fail("sampler", "size %zu key %.1f: sampler found %zu",
+                      size, key, found);
+          else model.take(found);
+        } else if (op == 1 && !model.found[i]) {
+          sampler.remove(i);
+          cpa_remove(cpa, i);
+          model.take(i);
+        } else if (op == 2 && model.found[i]) {
+          sampler.reinsert(i);
+          cpa_reinsert(cpa, i, model.weights[i]);
+          model.reinsert(i, model.weights[i]);
+        }
+        if (ok && (sampler.cumulative_weight() != cpa->cumulative_weight ||
+                   sampler.num_found() != cpa->num_found))
+          ok = fail("sampler", "size %zu: cumulative weights %g and %g",
+                    size, sampler.cumulative_weight(),
+                    cpa->cumulative_weight);
+      }
+      // Iterates through what is left in the last round
+      iterator.started = 0;
+      iterator.stack_size = 0;
+      sampler_iterator = Double_sampler::Iterator();
+      for (size_t k = 0; ok && (round == 2 || k < size / 4); ++k) {
+        void *found = cpa_iterate(cpa, &iterator);
+        uint32_t i = sampler.iterate(sampler_iterator);
+        if (found != (i == Double_sampler::npos ? NULL : value(i)))
+          ok = fail("sampler", "size %zu: iteration %zu differs", size, k);
+        if (!found) break;
+      }
+      if (ok && round == 2 && !sampler.all_found())
+        ok = fail("sampler", "size %zu: iteration stopped early", size);
+      if (round == 0) {
+        cpa_reset(cpa);
+        sampler.reset();
+        model.reset();
+      } else {
+        for (size_t i = 0; i < size; ++i) 
+          model.found[i] = sampler.is_found((uint32_t) i);
+        model.total = sampler.cumulative_weight();
+      }
+    }
+    cpa_free(cpa);
+    if (!ok) return false;
+  }
+  return true;
+}
+
+/*
+  cpa::Sampler with integer weights, as CPA_INTEGER mode uses it, finds
+  what the model finds for every whole number key, including the last
+  one below the cumulative weight, with weights too big for the sums to
+  be exact in a float. The model's doubles are exact for these sums.
+*/
+
+bool check_integer()
+{
+  typedef cpa::Sampler< uint32_t, uint64_t > Sampler;
+  TRandomPhilox rng(SEED);
+  for (size_t s = 0; s < NUM_SIZES; ++s) {
+    const size_t size = SIZES[s];
+    Sampler sampler;
+    Model model;
+    for (size_t i = 0; i < size; ++i) {
+      uint64_t weight = rng.Bounded64(1ull << 40) + 1;
+      sampler.append((uint32_t) i, weight);
+      model.append((double) weight);
+    }
+    for (int round = 0; round < 2; ++round) {
+      while (!sampler.all_found()) {
+        const uint32_t i = rng.Bounded((uint32_t) size);
+        if (rng.Bounded(4) == 0) {
+          if (model.found[i]) {
+            sampler.reinsert(i);
+            model.reinsert(i, model.weights[i]);
+          } else {
+            sampler.remove(i);
+            model.take(i);
+          }
+          continue;
+        }
+        const uint64_t total = sampler.cumulative_weight();
+        const uint64_t key = rng.Bounded(2) ? total - 1 
+          : rng.Bounded64(total);
+        const size_t expected = model.find((double) key);
+        const uint32_t found = sampler.find(key);
+        if (found != expected)
+          return fail("integer", "size %zu key %llu: found %u, not %zu",
+                      size, (unsigned long long) key, found, expected);
+        model.take(expected);
+        if ((double) sampler.cumulative_weight() != model.cumulative_weight())
+          return fail("integer", "size %zu: cumulative weight differs",
+                      size);
+      }
+      if (sampler.find(0) != Sampler::npos)
+        return fail("integer", "size %zu: found an entry when all were "
+                    "found", size);
+      sampler.reset();
+      model.reset();
+    }
+  }
+  return true;
+}
+
+/*
+  Sets population to size individuals, made the same way as main.cpp
+  makes them, from stream stream of SEED.
+*/
+
+void make_population(vector< Indiv > &population, const size_t size,
+                     const uint32_t stream)
+{
+  TRandomPhilox gen(SEED, stream);
+  ThreadRandStream use(gen);
+  population.clear();
+  for (size_t i = 0; i < size; ++i) {
+    Indiv ind = Indiv();
+    ind.sex = (unsigned) i % 2;
+    ind.age = (unsigned) rand_int_range(17, 65);
+    ind.age_group = ind.age / 5;
+    ind.risk_group = (unsigned) rand_int_range(0, 1);
+    ind.partner = NULL;
+    population.push_back(ind);
+  }
+}
+
+/*
+  Checks that the partnerships of population are between individuals of
+  opposite sexes, each of whom has the other as partner, and returns the
+  number of individuals with partners, or -1 if there is a bad one.
+*/
+
+long count_partners(const char *check, const vector< Indiv > &population)
+{
+  long matched = 0;
+  for (size_t i = 0; i < population.size(); ++i) {
+    const Indiv *partner = population[i].partner;
+    if (!partner) continue;
+    if (partner < &population[0] || partner >= &population[0] + 
+        population.size() || partner->partner != &population[i] ||
+        partner->sex == population[i].sex) {
+      fail(check, "individual %zu has a bad partner", i);
+      return -1;
+    }
+    ++matched;
+  }
+  return matched;
+}
+
+/*
+  Returns the position of the partner of each individual of population,
+  or population.size() for none.
+*/
+
+vector< size_t > partner_positions(const vector< Indiv > &population)
+{
+  vector< size_t > positions(population.size(), population.size());
+  for (size_t i = 0; i < population.size(); ++i)
+    if (population[i].partner)
+      positions[i] = population[i].partner - &population[0];
+  return positions;
+}
+
+/*
+  match_pair makes valid partnerships in every mode, and the same ones
+  with a MatchContext that has been used before, on a population of
+  another size, as with a new one.
+*/
+
+bool check_context()
+{
+  vector< Indiv > other, fresh, reused;
+  make_population(other, 3001, 1);
+  make_population(fresh, 5000, 2);
+  for (int mode = 0; mode <= CPA_INTEGER; ++mode) {
+    MatchContext new_context(mode), old_context(mode);
+    match_pair(other, old_context);
+    reused = fresh;
+    {
+      TRandomPhilox gen(SEED, 3);
+      ThreadRandStream use(gen);
+      match_pair(fresh, new_context);
+    }
+    {
+      TRandomPhilox gen(SEED, 3);
+      ThreadRandStream use(gen);
+      match_pair(reused, old_context);
+    }
+    long matched = count_partners("context", fresh);
+    if (matched <= 0)
+      return matched < 0 || fail("context", "%s: no one matched",
+                                 MODE_NAMES[mode]);
+    if (partner_positions(fresh) != partner_positions(reused))
+      return fail("context", "%s: a reused context matched differently",
+                  MODE_NAMES[mode]);
+    for (size_t i = 0; i < fresh.size(); ++i) fresh[i].partner = NULL;
+  }
+  return true;
+}
+
+/*
+  Partition of an individual in check_partitions
+*/
+
+static const unsigned NUM_PARTITIONS = 5;
+
+unsigned age_partition(const Indiv *indiv)
+{
+  return indiv->age % NUM_PARTITIONS;
+}
+
+/*
+  match_pair_partitioned matches individuals only with others in the same
+  partition, and makes the same matches on one thread as on several, in
+  every mode. The population is matched twice, so that the second time
+  old partnerships are broken.
+*/
+
+bool check_partitions()
+{
+  vector< Indiv > one, several;
+  make_population(one, 6000, 4);
+  for (int mode = 0; mode <= CPA_INTEGER; ++mode) {
+    PartitionContext one_thread(1, mode), threads(4, mode);
+    several = one;
+    for (int call = 0; call < 2; ++call) {
+      match_pair_partitioned(one, one_thread, age_partition, NUM_PARTITIONS,
+                             SEED + call);
+      match_pair_partitioned(several, threads, age_partition, 
+                             NUM_PARTITIONS, SEED + call);
+      long matched = count_partners("partitions", several);
+      if (matched <= 0)
+        return matched < 0 || fail("partitions", "%s: no one matched",
+                                   MODE_NAMES[mode]);
+      for (size_t i = 0; i < several.size(); ++i)
+        if (several[i].partner && 
+            age_partition(several[i].partner) != age_partition(&several[i]))
+          return fail("partitions", "%s: %zu matched in another partition",
+                      MODE_NAMES[mode], i);
+      if (partner_positions(one) != partner_positions(several))
+        return fail("partitions", "%s call %d: 1 and 4 threads differ",
+                    MODE_NAMES[mode], call);
+    }
+    for (size_t i = 0; i < one.size(); ++i) one[i].partner = NULL;
+  }
+  return true;
+}
+
+/*
+  Population files and compact population files give back the
+  individuals written to them, without their partners, and the records
+  of a population file have no bytes but those of the attributes. Each
+  kind of file is refused as the other.
+*/
+
+bool check_files()
+{
+  vector< Indiv > population;
+  make_population(population, 10000, 5);
+  match_pair(population);
+  char path[] = "/tmp/cpa_check_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) return fail("files", "no temporary file");
+  close(fd);
+
+  bool ok = write_population(path, &population[0], population.size()) == 0 
+    || fail("files", "population file not written");
+  FILE *f = fopen(path, "rb");
+  Population_header header;
+  Indiv record, expected;
+  ok = ok && ((f && fread(&header, sizeof(header), 1, f) == 1)
+              || fail("files", "population file not read"));
+  for (size_t i = 0; ok && i < population.size(); ++i) {
+    memset(&expected, 0, sizeof(expected));
+    expected.sex = population[i].sex;
+    expected.age = population[i].age;
+    expected.age_group = population[i].age_group;
+    expected.risk_group = population[i].risk_group;
+    if (fread(&record, sizeof(record), 1, f) != 1 ||
+        memcmp(&record, &expected, sizeof(record)))
+      ok = fail("files", "record %zu differs", i);
+  }
+  if (f) fclose(f);
+  MappedPopulation mapped;
+  CompactPopulation compact, read;
+  ok = ok && ((mapped.open(path) == 0 && 
+               mapped.size() == population.size())
+              || fail("files", "population file not mapped"));
+  for (size_t i = 0; ok && i < population.size(); ++i) {
+    const Indiv &indiv = mapped.population()[i];
+    if (indiv.sex != population[i].sex || indiv.age != population[i].age ||
+        indiv.age_group != population[i].age_group ||
+        indiv.risk_group != population[i].risk_group || indiv.partner)
+      ok = fail("files", "mapped individual %zu differs", i);
+  }
+  mapped.close();
+  ok = ok && (read_population(path, read) == BAD_FORMAT
+              || fail("files", "population file read as compact"));
+
+  compact.assign(&population[0], population.size());
+  ok = ok && (write_population(path, compact) == 0
+              || fail("files", "compact file not written"));
+  ok = ok && ((read_population(path, read) == 0 &&
+               read.size() == compact.size())
+              || fail("files", "compact file not read"));
+  for (size_t i = 0; ok && i < compact.size(); ++i)
+    if (read.sex(i) != compact.sex(i) || read.age(i) != compact.age(i) ||
+        read.age_group(i) != compact.age_group(i) ||
+        read.risk_group(i) != compact.risk_group(i) || read.eligible(i) ||
+        read.partner(i) != CompactPopulation::NO_PARTNER)
+      ok = fail("files", "compact individual %zu differs", i);
+  ok = ok && (mapped.open(path) == BAD_FORMAT
+              || fail("files", "compact file mapped"));
+  unlink(path);
+  return ok;
+}
+
+/*
+  A PartnerWriter writes each partnership once, as the pair of the
+  positions of the partners, lowest first, in both formats, whether it
+  writes in the background or not, and with buffers small enough that
+  a population takes several.
+*/
+
+bool check_writer()
+{
+  vector< Indiv > population;
+  vector< pair< uint32_t, uint32_t > > expected, pairs;
+  make_population(population, 20000, 6);
+  match_pair(population);
+  for (size_t i = 0; i < population.size(); ++i)
+    if (population[i].partner > &population[i])
+      expected.push_back(make_pair((uint32_t) i, (uint32_t) 
+                                   (population[i].partner - &population[0])));
+  char path[] = "/tmp/cpa_check_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) return fail("writer", "no temporary file");
+  close(fd);
+
+  bool ok = true;
+  for (int format = 0; ok && format < 2; ++format)
+    for (int background = 0; ok && background < 2; ++background) {
+      PartnerWriter writer(format, background, 4096, 3);
+      ok = (writer.open(path) == 0 || fail("writer", "%s not opened", path));
+      if (ok) {
+        writer.write(population);
+        ok = writer.close() == 0 || fail("writer", "%s not written", path);
+      }
+      FILE *f = fopen(path, "rb");
+      uint32_t ids[2];
+      unsigned id, partner_id;
+      pairs.clear();
+      if (format == PARTNERS_BINARY)
+        while (f && fread(ids, sizeof(ids), 1, f) == 1)
+          pairs.push_back(make_pair(ids[0], ids[1]));
+      else
+        while (f && fscanf(f, "%u,%u\n", &id, &partner_id) == 2)
+          pairs.push_back(make_pair((uint32_t) id, (uint32_t) partner_id));
+      if (f) fclose(f);
+      if (ok && pairs != expected)
+        ok = fail("writer", "format %d background %d: %zu pairs written, "
+                  "not the %zu partnerships", format, background, 
+                  pairs.size(), expected.size());
+    }
+  unlink(path);
+  return ok;
+}
+
+/*
+  match_pair with counting_sort makes valid partnerships in every mode,
+  about as many as without it, since the partners are drawn from the
+  same distribution. The same context is used with and without it in
+  turn, so that each leaves it as the other expects.
+*/
+
+bool check_counting_sort()
+{
+  vector< Indiv > sorted, shuffled;
+  make_population(sorted, 20000, 12);
+  shuffled = sorted;
+  for (int mode = 0; mode <= CPA_INTEGER; ++mode) {
+    MatchContext context(mode);
+    long matched[2] = {0, 0};
+    for (int call = 0; call < 4; ++call) {
+      context.counting_sort = call % 2;
+      vector< Indiv > &population = call % 2 ? sorted : shuffled;
+      for (size_t i = 0; i < population.size(); ++i) 
+        population[i].partner = NULL;
+      match_pair(population, context);
+      long n = count_partners("counting_sort", population);
+      if (n <= 0)
+        return n < 0 || fail("counting_sort", "%s: no one matched",
+                             MODE_NAMES[mode]);
+      matched[call % 2] += n;
+    }
+    if (labs(matched[1] - matched[0]) > matched[0] / 50)
+      return fail("counting_sort", "%s: %ld matched, not about %ld",
+                  MODE_NAMES[mode], matched[1], matched[0]);
+  }
+  return true;
+}
+
+/*
+  An IncrementalMatch, over several steps in which partnerships end, 
+  some individuals are removed and the rest are added back, makes valid
+  partnerships, never breaks one, never matches anyone who isn't 
+  available, and keeps count of who is. A CompactPopulation matched by 
+  another one, from the same stream, gets the same partners.
+*/
+
+bool check_incremental()
+{
+  vector< Indiv > population;
+  CompactPopulation compact;
+  vector< size_t > positions, removed;
+  vector< Indiv* > before;
+  vector< bool > available;
+  IncrementalMatch incremental, compact_incremental;
+  TRandomPhilox gen(SEED, 13), compact_gen(SEED, 13), churn(SEED, 14);
+  make_population(population, 5000, 15);
+  compact.assign(&population[0], population.size());
+  for (size_t i = 0; i < population.size(); ++i) positions.push_back(i);
+  available.assign(population.size(), true);
+  for (int step = 0; step < 6; ++step) {
+    {
+      ThreadRandStream use(gen);
+      incremental.add(&population[0], &positions[0], positions.size());
+      incremental.remove(removed.empty() ? NULL : &removed[0], 
+                         removed.size());
+      before.clear();
+      for (size_t i = 0; i < population.size(); ++i)
+        before.push_back(population[i].partner);
+      incremental.match(&population[0]);
+    }
+    {
+      ThreadRandStream use(compact_gen);
+      compact_incremental.add(compact, &positions[0], positions.size());
+      compact_incremental.remove(removed.empty() ? NULL : &removed[0], 
+                                 removed.size());
+      compact_incremental.match(compact);
+    }
+    long matched = count_partners("incremental", population);
+    if (matched <= 0)
+      return matched < 0 || fail("incremental", "step %d: no one matched",
+                                 step);
+    size_t left = 0;
+    for (size_t i = 0; i < population.size(); ++i) {
+      if (before[i] && population[i].partner != before[i])
+        return fail("incremental", "step %d: %zu's partnership broken",
+                    step, i);
+      if (!before[i] && population[i].partner && !available[i])
+        return fail("incremental", "step %d: unavailable %zu matched",
+                    step, i);
+      size_t partner = compact.partner(i) == CompactPopulation::NO_PARTNER
+        ? population.size() : compact.partner(i);
+      if (partner != (population[i].partner ? 
+                      population[i].partner - &population[0] : 
+                      population.size()))
+        return fail("incremental", "step %d: compact %zu differs", step, i);
+      if (available[i] && !population[i].partner) ++left;
+    }
+    if (incremental.size() != left)
+      return fail("incremental", "step %d: %zu available, not %zu", step,
+                  incremental.size(), left);
+    // Ends a tenth of the partnerships and makes a few others unavailable
+    positions.clear();
+    removed.clear();
+    for (size_t i = 0; i < population.size(); ++i)
+      if (!population[i].partner && available[i] && churn.Bounded(20) == 0) {
+        removed.push_back(i);
+        available[i] = false;
+      }
+    for (size_t i = 0; i < population.size(); ++i) {
+      Indiv *partner = population[i].partner;
+      if (partner > &population[i] && churn.Bounded(10) == 0) {
+        size_t j = partner - &population[0];
+        partner->partner = population[i].partner = NULL;
+        compact.partners[i] = compact.partners[j] = 
+          CompactPopulation::NO_PARTNER;
+        positions.push_back(i);
+        positions.push_back(j);
+      }
+    }
+  }
+  return true;
+}
+
+bool can_pair_secondary_always(const Indiv *)
+{
+  return true;
+}
+
+/*
+  Checks that the secondary partnerships of population are between
+  individuals of opposite sexes who aren't partners, each of whom has
+  the other as secondary partner.
+*/
+
+bool check_secondary_partners(const char *check, const char *mode,
+                              const vector< Indiv > &population)
+{
+  for (size_t i = 0; i < population.size(); ++i) {
+    const Indiv *secondary = population[i].secondary_partner;
+    if (secondary && (secondary->secondary_partner != &population[i] ||
+                      secondary->sex == population[i].sex ||
+                      secondary == population[i].partner))
+      return fail(check, "%s: %zu has a bad secondary partner", mode, i);
+  }
+  return true;
+}
+
+/*
+  The secondary round of match_pair makes valid secondary partnerships
+  in every mode, with and without counting_sort. An individual whose 
+  partner is the only one left in the age group it selects is matched
+  from another age group: with one man, who has a partner in his age
+  group and another woman in another, the other woman is always his
+  secondary partner.
+*/
+
+bool check_secondary()
+{
+  vector< Indiv > population;
+  make_population(population, 8000, 16);
+  for (int mode = 0; mode <= CPA_INTEGER; ++mode)
+    for (int sorted = 0; sorted < 2; ++sorted) {
+      MatchContext context(mode);
+      context.counting_sort = sorted;
+      context.can_pair_secondary = can_pair_secondary_always;
+      for (int call = 0; call < 2; ++call) {
+        match_pair(population, context);
+        if (count_partners("secondary", population) < 0 ||
+            !check_secondary_partners("secondary", MODE_NAMES[mode],
+                                      population))
+          return false;
+      }
+    }
+
+  for (int mode = 0; mode <= CPA_INTEGER; ++mode) 
+    for (uint32_t stream = 0; stream < 40; ++stream) {
+      TRandomPhilox gen(SEED, stream);
+      ThreadRandStream use(gen);
+      MatchContext context(mode);
+      context.can_pair_secondary = can_pair_secondary_always;
+      make_population(population, 3, 17);
+      const unsigned ages[3] = {27, 26, 47};
+      for (int i = 0; i < 3; ++i) {
+        population[i].sex = i ? FEMALE : MALE;
+        population[i].age = ages[i];
+        population[i].age_group = ages[i] / 5;
+        population[i].risk_group = HIGH;
+      }
+      match_pair(population, context);
+      Indiv *man = &population[0];
+      if (!man->partner || !man->secondary_partner ||
+          man->secondary_partner == man->partner ||
+          !check_secondary_partners("secondary", MODE_NAMES[mode], 
+                                    population))
+        return fail("secondary", "%s stream %u: the man's secondary partner "
+                    "is %p, not the woman who isn't his partner", 
+                    MODE_NAMES[mode], stream, 
+                    (void *) man->secondary_partner);
+    }
+  return true;
+}
+
+/*
+  Group of an individual in check_compact, which spreads them over the
+  groups of Cpa_strata. There is only group 0 unless the program is 
+  compiled with MATCH_STRATA.
+*/
+
+unsigned age_group_of(unsigned age)
+{
+  return age % Cpa_strata::NUM_GROUPS;
+}
+
+unsigned indiv_group(const Indiv *indiv)
+{
+  return age_group_of(indiv->age);
+}
+
+unsigned compact_group(const CompactPopulation &population, uint32_t i)
+{
+  return age_group_of(population.age(i));
+}
+
+/*
+  match_pair on a CompactPopulation keeps the attributes of Indivs and
+  makes the same matches as on the Indivs, in every mode, with and 
+  without counting_sort, and only within groups.
+*/
+
+bool check_compact()
+{
+  vector< Indiv > population;
+  CompactPopulation compact;
+  make_population(population, 6000, 7);
+  compact.assign(&population[0], population.size());
+  for (size_t i = 0; i < population.size(); ++i)
+    if (compact.sex(i) != population[i].sex ||
+        compact.age(i) != population[i].age ||
+        compact.age_group(i) != population[i].age_group ||
+        compact.risk_group(i) != population[i].risk_group)
+      return fail("compact", "individual %zu not kept", i);
+  for (int mode = 0; mode <= CPA_INTEGER; ++mode)
+    for (int sorted = 0; sorted < 2; ++sorted) {
+      MatchContext context(mode);
+      context.counting_sort = sorted;
+      context.group = indiv_group;
+      context.compact_group = compact_group;
+      {
+        TRandomPhilox gen(SEED, 8);
+        ThreadRandStream use(gen);
+        match_pair(population, context);
+      }
+      {
+        TRandomPhilox gen(SEED, 8);
+        ThreadRandStream use(gen);
+        match_pair(compact, context);
+      }
+      long matched = count_partners("compact", population);
+      if (matched <= 0)
+        return matched < 0 || fail("compact", "%s: no one matched",
+                                   MODE_NAMES[mode]);
+      vector< size_t > positions = partner_positions(population);
+      for (size_t i = 0; i < population.size(); ++i) {
+        size_t partner = compact.partner(i) == CompactPopulation::NO_PARTNER
+          ? population.size() : compact.partner(i);
+        if (partner != positions[i])
+          return fail("compact", "%s sorted %d: %zu matched differently",
+                      MODE_NAMES[mode], sorted, i);
+        if (population[i].partner && 
+            indiv_group(population[i].partner) != indiv_group(&population[i]))
+          return fail("compact", "%s: %zu matched in another group",
+                      MODE_NAMES[mode], i);
+      }
+    }
+  return true;
+}
+
+/*
+  run_ensemble gives each replicate the same statistics whatever the
+  number of threads, apart from the time, and a replicate's statistics
+  are those of matching a copy of the population from its stream.
+  copy_population points the partners of the copy into the copy and
+  clears the secondary partners, which a population that has never
+  been matched may have left with anything in them.
+*/
+
+bool check_ensemble()
+{
+  static const unsigned NUM_REPLICATES = 9;
+  vector< Indiv > population, copy;
+  make_population(population, 4000, 18);
+  Indiv stranger = Indiv();
+  population[0].partner = &population[3];
+  population[3].partner = &population[0];
+  for (size_t i = 0; i < population.size(); i += 2)
+    population[i].secondary_partner = &stranger;
+  copy_population(&population[0], population.size(), copy);
+  for (size_t i = 0; i < copy.size(); ++i)
+    if (copy[i].secondary_partner ||
+        copy[i].partner != (i == 0 ? &copy[3] : i == 3 ? &copy[0] : NULL))
+      return fail("ensemble", "copy of individual %zu has bad partners", i);
+  make_population(population, 4000, 18);
+  for (int mode = 0; mode <= CPA_INTEGER; ++mode) {
+    vector< Replicate_stats > one, several;
+    run_ensemble(&population[0], population.size(), NUM_REPLICATES, 1, SEED,
+                 mode, one);
+    run_ensemble(&population[0], population.size(), NUM_REPLICATES, 4, SEED,
+                 mode, several);
+    if (one.size() != NUM_REPLICATES || several.size() != NUM_REPLICATES)
+      return fail("ensemble", "%s: not %u replicates", MODE_NAMES[mode],
+                  NUM_REPLICATES);
+    for (unsigned r = 0; r < NUM_REPLICATES; ++r) {
+      if (one[r].replicate != r || several[r].replicate != r ||
+          one[r].matched != several[r].matched ||
+          memcmp(one[r].age_gaps, several[r].age_gaps,
+                 sizeof(one[r].age_gaps)))
+        return fail("ensemble", "%s replicate %u: 1 and 4 threads differ",
+                    MODE_NAMES[mode], r);
+      copy = population;
+      TRandomPhilox gen(SEED, r);
+      ThreadRandStream use(gen);
+      MatchContext context(mode);
+      match_pair(copy, context);
+      long matched = count_partners("ensemble", copy);
+      if (matched < 0 || (size_t) matched != one[r].matched)
+        return fail("ensemble", "%s replicate %u: %zu matched, not %ld",
+                    MODE_NAMES[mode], r, one[r].matched, matched);
+    }
+  }
+  return true;
+}
+
+struct check_s {
+  const char *name;
+  bool (*run)();
+};
+
+typedef struct check_s Check;
+
+static const Check CHECKS[] = {
+  {"modes", check_modes},
+  {"fenwick", check_fenwick_append},
+  {"alias", check_alias},
+  {"alias_large", check_alias_large},
+  {"batch", check_batch},
+  {"index", check_index},
+  {"changes", check_changes},
+  {"sampler", check_sampler},
+  {"integer", check_integer},
+  {"growth", check_growth},
+  {"philox", check_philox},
+  {"philox_draws", check_philox_draws},
+  {"context", check_context},
+  {"partitions", check_partitions},
+  {"counting_sort", check_counting_sort},
+  {"compact", check_compact},
+  {"secondary", check_secondary},
+  {"incremental", check_incremental},
+  {"files", check_files},
+  {"writer", check_writer},
+  {"ensemble", check_ensemble}
+};
+
+int main()
+{
+  int failed = 0;
+  for (size_t c = 0; c < sizeof(CHECKS) / sizeof(CHECKS[0]); ++c) {
+    bool ok = CHECKS[c].run();
+    printf("%-16s %s\n", CHECKS[c].name, ok ? "ok" : "FAILED");
+    if (!ok) ++failed;
+  }
+  return failed;
+}
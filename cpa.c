@@ -6,14 +6,28 @@
 
   See cpa.h for documentation of extern functions. Only functions not declared in 
   cpa.h are documented here. These should not be called by programs using this library.
+
+  The walks of the search tree are the macros of cpa_tree.h, which 
+  cpa::Sampler in cpa_sampler.h uses too.
 */
 
 #include <assert.h>  
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <unistd.h>
+#endif
+#if defined(_POSIX_THREADS) && _POSIX_THREADS > 0
+#define CPA_HAVE_THREADS 1
+#include <pthread.h>
+#endif
+
 #include "cpa.h"
+#include "cpa_tree.h"
 
 /*
   This function uses a very poor random number generating technique.
@@ -24,35 +38,440 @@ double cpa_generate_probability(void* data)
   return (double) (rand() % 10) + 1;
 }
 
+/*
+  Field accessors that work in all storage modes. Each one expands to an
+  lvalue, so it can be read or assigned. The subtractors don't exist in
+  CPA_FENWICK mode.
+*/
+
+#define CPA_FIELD(cpa, i, field, soa_field)                     \
+  (*((cpa)->mode != CPA_AOS ? &(soa_field)                      \
+     : &(cpa)->entries[i].field))
+#define CPA_DATA(cpa, i) CPA_FIELD(cpa, i, data, (cpa)->columns.data[i])
+#define CPA_WEIGHT(cpa, i) \
+  CPA_FIELD(cpa, i, weight, (cpa)->columns.weights[i])
+#define CPA_CUMULATIVE_WEIGHT(cpa, i)                            \
+  CPA_FIELD(cpa, i, cumulative_weight,                           \
+            (cpa)->columns.nodes[i].cumulative_weight)
+#define CPA_LEFT_SUBTRACTOR(cpa, i)                                     \
+  CPA_FIELD(cpa, i, left_subtractor, (cpa)->columns.nodes[i].left_subtractor)
+#define CPA_RIGHT_SUBTRACTOR(cpa, i)                                    \
+  CPA_FIELD(cpa, i, right_subtractor,                                   \
+            (cpa)->columns.nodes[i].right_subtractor)
+#define CPA_LINEAR_SUBTRACTOR(cpa, i)                                   \
+  CPA_FIELD(cpa, i, linear_subtractor,                                  \
+            (cpa)->columns.linear_subtractors[i])
+
+/*
+  Adds n to the probes counted in cpa->num_probes. Compiled out unless
+  CPA_STATS is defined, so that the searches don't pay for it.
+*/
+
+#ifdef CPA_STATS
+#define CPA_COUNT_PROBES(cpa, n) ((cpa)->num_probes += (n))
+#else
+#define CPA_COUNT_PROBES(cpa, n) ((void) 0)
+#endif
+
+int cpa_is_found(const Cpa *cpa, const size_t i)
+{
+  if (cpa->mode == CPA_SOA)
+    return cpa->columns.nodes[i].weight == -HUGE_VAL;
+  if (cpa->mode == CPA_FENWICK)
+    return cpa->columns.found[i];
+  return cpa->entries[i].found;
+}
+
+void *cpa_data(const Cpa *cpa, const size_t i)
+{
+  return CPA_DATA(cpa, i);
+}
+
+double cpa_weight(const Cpa *cpa, const size_t i)
+{
+  return CPA_WEIGHT(cpa, i);
+}
+
+/*
+  Returns the weight that the binary searches take off the upper bound of
+  entry i to get its lower bound, which is its weight when the cumulative
+  weights were set, or -HUGE_VAL if it has been found.
+*/
+
+double cpa_search_weight(const Cpa *cpa, const size_t i)
+{
+  if (cpa->mode == CPA_SOA) return cpa->columns.nodes[i].weight;
+  if (cpa_is_found(cpa, i)) return -HUGE_VAL;
+  return cpa->entries[i].weight - cpa->entries[i].adder;
+}
+
+void cpa_set_found(Cpa *cpa, const size_t i, const int found)
+{
+  if (cpa->mode == CPA_SOA)
+    cpa->columns.nodes[i].weight = found ? -HUGE_VAL : cpa->columns.weights[i];
+  else if (cpa->mode == CPA_FENWICK)
+    cpa->columns.found[i] = (unsigned char) found;
+  else
+    cpa->entries[i].found = found;
+}
+
+/*
+  Returns block rounded up to the next cache line.
+*/
+
+char *cpa_align(void *block)
+{
+  const size_t offset = 
+    (CPA_CACHE_LINE - (size_t) block % CPA_CACHE_LINE) % CPA_CACHE_LINE;
+  return (char *) block + offset;
+}
+
+/*
+  Returns whether mode is one of the storage modes.
+*/
+
+int cpa_known_mode(const int mode)
+{
+  return mode == CPA_AOS || mode == CPA_SOA || mode == CPA_FENWICK;
+}
+
+size_t cpa_storage_size(const size_t size, const int mode)
+{
+  size_t bytes;
+  if (!cpa_known_mode(mode)) return 0;
+  if (mode == CPA_SOA)
+    bytes = size * (sizeof(Cpa_node) + 2 * sizeof(double) + sizeof(void *));
+  else if (mode == CPA_FENWICK)
+    bytes = (size + 1) * sizeof(double) + 
+      size * (sizeof(double) + sizeof(void *) + 1);
+  else
+    bytes = size * sizeof(Cpa_entry);
+  /* Room to align the start, and the end rounded to a whole line */
+  return (bytes + 2 * CPA_CACHE_LINE - 1) / CPA_CACHE_LINE * CPA_CACHE_LINE;
+}
+
+/*
+  Places the entries or columns of a CPA in storage, which holds at least
+  cpa_storage_size bytes. The CPA_SOA nodes are aligned to a cache line
+  so that a node never straddles two lines. The CPA_FENWICK tree is 
+  indexed from 1, as is usual for Fenwick trees, so it has one more
+  element than the other columns.
+*/
+
+void cpa_place(Cpa *cpa, const size_t size, void *storage)
+{
+  Cpa_columns *columns = &cpa->columns;
+  char *block = cpa_align(storage);
+  if (cpa->mode == CPA_SOA) {
+    columns->nodes = (Cpa_node *) block;
+    columns->weights = (double *) (columns->nodes + size);
+    columns->linear_subtractors = columns->weights + size;
+    columns->data = (void **) (columns->linear_subtractors + size);
+  } else if (cpa->mode == CPA_FENWICK) {
+    columns->tree = (double *) block;
+    columns->tree[0] = 0.0;
+    columns->weights = columns->tree + size + 1;
+    columns->data = (void **) (columns->weights + size);
+    columns->found = (unsigned char *) (columns->data + size);
+  } else {
+    cpa->entries = (Cpa_entry *) block;
+  }
+}
+
+/*
+  Adds delta to the weight of entry i in the Fenwick tree of a
+  CPA_FENWICK array. O(log n).
+*/
+
+void cpa_fenwick_add(Cpa *cpa, const size_t i, const double delta)
+{
+  size_t j;
+  for (j = i + 1; j <= cpa->size; j += j & (~j + 1))
+    cpa->columns.tree[j] += delta;
+}
+
+/*
+  Returns the index of the entry whose range of the cumulative weights
+  of a CPA_FENWICK array contains key, or cpa->size if key is out of 
+  range. Found entries have no weight in the tree, so they are skipped.
+  O(log n).
+*/
+
+size_t cpa_fenwick_find(const Cpa *cpa, double key)
+{
+  const double *tree = cpa->columns.tree;
+  size_t pos = 0, step = 1, i;
+
+  if (key < 0.0) return cpa->size;
+  while (step <= cpa->size / 2) step <<= 1;
+  for (; step; step >>= 1) {
+    if (pos + step <= cpa->size && tree[pos + step] <= key) {
+      pos += step;
+      key -= tree[pos];
+    }
+  }
+  if (pos >= cpa->size || !cpa->columns.found[pos]) return pos;
+  /* Rounding with fractional weights can leave key on the boundary of a
+     found entry. Use the nearest entry that has not been found. */
+  for (i = pos + 1; i < cpa->size; ++i)
+    if (!cpa->columns.found[i]) return i;
+  for (i = pos; i > 0; --i)
+    if (!cpa->columns.found[i - 1]) return i - 1;
+  return cpa->size;
+}
+
+/*
+  Rebuilds the Fenwick tree of a CPA_FENWICK array from the weights of the
+  entries that have not been found. O(n).
+*/
+
+void cpa_fenwick_build(Cpa *cpa)
+{
+  size_t i, parent;
+  double *tree = cpa->columns.tree;
+  cpa->cumulative_weight = 0.0;
+  for (i = 1; i <= cpa->size; ++i) 
+    tree[i] = cpa->columns.found[i - 1] ? 0.0 : cpa->columns.weights[i - 1];
+  for (i = 1; i <= cpa->size; ++i) {
+    cpa->cumulative_weight += cpa->columns.found[i - 1] 
+      ? 0.0 : cpa->columns.weights[i - 1];
+    parent = i + (i & (~i + 1));
+    if (parent <= cpa->size) tree[parent] += tree[i];
+  }
+}
+
+/*
+  Copies the fields of the entries in the subtree of the binary search
+  tree holding entries lower up to but not including higher to node k of
+  the index and its descendants, or if to_index is 0 copies the
+  subtractors back from the index to the entries.
+*/
+
+void cpa_copy_index(Cpa *cpa, const size_t k, const size_t lower, 
+                    const size_t higher, const int to_index)
+{
+  const size_t i = (lower + higher) / 2;
+  Cpa_node *node;
+  if (k >= (size_t) 1 << cpa->index.depth) return;
+  node = cpa->index.nodes + k;
+  if (lower == higher) {
+    if (!to_index) return;
+    node->cumulative_weight = -HUGE_VAL;
+    node->right_subtractor = node->left_subtractor = 0.0;
+    node->weight = -HUGE_VAL;
+  } else if (to_index) {
+    node->cumulative_weight = CPA_CUMULATIVE_WEIGHT(cpa, i);
+    node->right_subtractor = CPA_RIGHT_SUBTRACTOR(cpa, i);
+    node->left_subtractor = CPA_LEFT_SUBTRACTOR(cpa, i);
+    node->weight = cpa_search_weight(cpa, i);
+  } else {
+    CPA_RIGHT_SUBTRACTOR(cpa, i) = node->right_subtractor;
+    CPA_LEFT_SUBTRACTOR(cpa, i) = node->left_subtractor;
+  }
+  cpa_copy_index(cpa, 2 * k, lower, i, to_index);
+  cpa_copy_index(cpa, 2 * k + 1, lower == higher ? i : i + 1, higher, 
+                 to_index);
+}
+
+/*
+  Drops the index of a CPA, so that the array is searched instead.
+*/
+
+void cpa_free_index(Cpa *cpa)
+{
+  cpa_copy_index(cpa, 1, 0, cpa->size, 0);
+  free(cpa->index.block);
+  memset(&cpa->index, 0, sizeof(cpa->index));
+}
+
+/*
+  Returns the depth of the binary search tree of a CPA with size entries,
+  which is the number of bits in size.
+*/
+
+size_t cpa_index_depth(const size_t size)
+{
+  size_t depth = 0;
+  while (size >> depth) ++depth;
+  return depth;
+}
+
+size_t cpa_index_storage_size(const size_t size)
+{
+  return CPA_CACHE_LINE - 1 + 
+    sizeof(Cpa_node) * ((size_t) 1 << cpa_index_depth(size));
+}
+
+int cpa_build_index_at(Cpa *cpa, void *storage)
+{
+  if (cpa->mode == CPA_FENWICK) return UNSUPPORTED_MODE;
+  if (cpa->size == 0) return ZERO_ARRAY_SIZE;
+  if (!storage) return OUT_OF_MEMORY;
+  if (cpa->index.nodes) cpa_free_index(cpa);
+  cpa->index.nodes = (Cpa_node *) cpa_align(storage);
+  cpa->index.depth = cpa_index_depth(cpa->size);
+  cpa_copy_index(cpa, 1, 0, cpa->size, 1);
+  return 0;
+}
+
+int cpa_build_index(Cpa *cpa)
+{
+  void *block;
+  int error;
+  if (cpa->mode == CPA_FENWICK) return UNSUPPORTED_MODE;
+  if (cpa->size == 0) return ZERO_ARRAY_SIZE;
+  block = malloc(cpa_index_storage_size(cpa->size));
+  error = cpa_build_index_at(cpa, block);
+  if (error) free(block);
+  else cpa->index.block = block;
+  return error;
+}
+
 Cpa  *cpa_new(const size_t size, void* data[], 
               double (* generator) (void *data))
+{
+  return cpa_new_mode(size, data, generator, CPA_AOS);
+}
+
+Cpa  *cpa_new_mode(const size_t size, void* data[], 
+                   double (* generator) (void *data), const int mode)
 {
   size_t i;
+  void *block;
   Cpa *cpa;
   cpa = (Cpa *) malloc(sizeof(Cpa));
   if (!cpa) return NULL;
-  cpa->entries = (Cpa_entry *) malloc(sizeof(Cpa_entry) * size);
-  if (!cpa->entries || size == 0) {
+  block = size && cpa_known_mode(mode) 
+    ? malloc(cpa_storage_size(size, mode)) : NULL;
+  cpa_init(cpa, size, block, mode);
+  cpa->columns.block = block;
+  cpa->owns_storage = 1;
+  /* An empty array gets its storage from cpa_reserve on the first append */
+  if (cpa->error == ZERO_ARRAY_SIZE) cpa->error = 0;
+  if (cpa->error) return cpa;
+  if (!generator) generator = cpa_generate_probability;
+  if (data) 
+    for (i = 0; i < size; ++i) 
+      cpa_append(cpa, data[i], generator(data[i]));
+  return cpa;
+}
+
+Cpa *cpa_new_weights(const size_t size, void *data[], const double weights[],
+                     const int mode)
+{
+  Cpa *cpa = cpa_new_mode(size, NULL, NULL, mode);
+  if (cpa && !cpa->error) cpa_append_weights(cpa, data, weights, size);
+  return cpa;
+}
+
+Cpa *cpa_init(Cpa *cpa, const size_t size, void *storage, const int mode)
+{
+  cpa->mode = mode;
+  cpa->entries = NULL;
+  memset(&cpa->columns, 0, sizeof(cpa->columns));
+  memset(&cpa->index, 0, sizeof(cpa->index));
+  cpa->cumulative_weight = 0.0;
+  cpa->size = 0;
+  cpa->num_found = 0;
+  cpa->num_probes = 0;
+  cpa->owns_storage = 0;
+  /* Only the packed nodes are close enough together for the linear
+     search to beat the binary search. */
+  cpa->linear_threshold = mode == CPA_SOA ? CPA_LINEAR_THRESHOLD : 0;
+  /* Any other mode would be taken for CPA_SOA by the field accessors, 
+     in storage laid out for CPA_AOS */
+  if (!cpa_known_mode(mode)) {
+    cpa->error = UNSUPPORTED_MODE;
+    cpa->capacity = 0;
+    return cpa;
+  }
+  if (!storage || size == 0) {
     cpa->error = size ? OUT_OF_MEMORY : ZERO_ARRAY_SIZE;
-    cpa->size = 0;
     cpa->capacity = 0;
-    cpa->num_found = 0;
     return cpa;
   }
   cpa->error = 0;
-  cpa->size = 0;
   cpa->capacity = size;
-  cpa->num_found = 0;
-  if (!generator) generator = cpa_generate_probability;
-  if (data) 
-    for (i = 0; i < size; ++i) 
-      cpa_append(cpa, data[i], generator(data[i]));
+  cpa_place(cpa, size, storage);
   return cpa;
 }
 
-void cpa_append(Cpa *cpa, void *data, double weight) 
+int cpa_reserve(Cpa *cpa, const size_t capacity)
+{
+  Cpa grown;
+  void *block;
+  const size_t size = cpa->size;
+  if (capacity <= cpa->capacity) return 0;
+  if (!cpa_known_mode(cpa->mode)) return UNSUPPORTED_MODE;
+  if (!cpa->owns_storage) return OUT_OF_MEMORY;
+  block = malloc(cpa_storage_size(capacity, cpa->mode));
+  if (!block) return OUT_OF_MEMORY;
+  if (cpa->index.nodes) cpa_free_index(cpa);
+  grown = *cpa;
+  cpa_place(&grown, capacity, block);
+  /* An array that had no storage has nothing to copy */
+  if (cpa->capacity) {
+    if (cpa->mode == CPA_SOA) {
+      memcpy(grown.columns.nodes, cpa->columns.nodes, 
+             size * sizeof(Cpa_node));
+      memcpy(grown.columns.linear_subtractors, 
+             cpa->columns.linear_subtractors, size * sizeof(double));
+    } else if (cpa->mode == CPA_FENWICK) {
+      memcpy(grown.columns.tree, cpa->columns.tree, 
+             (size + 1) * sizeof(double));
+      memcpy(grown.columns.found, cpa->columns.found, size);
+    } else {
+      memcpy(grown.entries, cpa->entries, size * sizeof(Cpa_entry));
+    }
+    if (cpa->mode != CPA_AOS) {
+      memcpy(grown.columns.weights, cpa->columns.weights, 
+             size * sizeof(double));
+      memcpy(grown.columns.data, cpa->columns.data, size * sizeof(void *));
+    }
+  }
+  free(cpa->columns.block);
+  grown.columns.block = block;
+  grown.capacity = capacity;
+  grown.error = 0;
+  *cpa = grown;
+  return 0;
+}
+
+int cpa_append(Cpa *cpa, void *data, double weight) 
 {
+  const size_t i = cpa->size;
+  int error;
   assert(weight != 0.0);
+  if (i == cpa->capacity && (error = cpa_reserve(cpa, i ? 2 * i : 1))) 
+    return error;
+  if (cpa->index.nodes) cpa_free_index(cpa);
+  if (cpa->mode == CPA_SOA) {
+    Cpa_node *node = cpa->columns.nodes + i;
+    cpa->columns.data[i] = data;
+    cpa->columns.weights[i] = weight;
+    cpa->columns.linear_subtractors[i] = 0.0;
+    node->weight = weight;
+    node->left_subtractor = 0.0;
+    node->right_subtractor = 0.0;
+    node->cumulative_weight = i ? node[-1].cumulative_weight + weight : weight;
+    cpa->cumulative_weight = node->cumulative_weight;
+    ++cpa->size;
+    return 0;
+  }
+  if (cpa->mode == CPA_FENWICK) {
+    /* Node i + 1 of the tree covers the entries after i + 1 - lowbit,
+       which have all been appended, so it can be filled in now. */
+    size_t j, lowbit = (i + 1) & (~(i + 1) + 1);
+    double *tree = cpa->columns.tree;
+    cpa->columns.data[i] = data;
+    cpa->columns.weights[i] = weight;
+    cpa->columns.found[i] = 0;
+    tree[i + 1] = weight;
+    for (j = 1; j < lowbit; j <<= 1) tree[i + 1] += tree[i + 1 - j];
+    cpa->cumulative_weight += weight;
+    ++cpa->size;
+    return 0;
+  }
   cpa->entries[cpa->size].data = data;
   cpa->entries[cpa->size].adder = 0.0;
   cpa->entries[cpa->size].left_subtractor = 0.0;
@@ -69,6 +488,7 @@ void cpa_append(Cpa *cpa, void *data, double weight)
       cpa->entries[cpa->size].weight;          
   cpa->cumulative_weight = cpa->entries[cpa->size].cumulative_weight;
   ++cpa->size;
+  return 0;
 }
 
 int cpa_all_found(const Cpa* cpa) 
@@ -76,69 +496,625 @@ int cpa_all_found(const Cpa* cpa)
   return cpa->num_found == cpa->size;
 }
 
-void *cpa_linear_search(Cpa *cpa, const double key) 
-{
-  size_t i;
-  double subtractor = 0.0, comparator;
+/*
+  Adds delta to the weight of entry i, for the subtractor modes. q is the
+  search path to i, from cpa_path or a search. The subtractors of the
+  nodes on the path are changed so that the cumulative weights of i and 
+  the entries after it go up by delta (see CPA_TREE_SHIFT_STEP). The 
+  linear subtractor of i is changed too.
 
-  for (i = 0; i < cpa->size; ++i) {
-    subtractor += cpa->entries[i].linear_subtractor;
-    if (!cpa->entries[i].found) {
-      comparator = cpa->entries[i].cumulative_weight + subtractor;
-      if (key < comparator &&
-          key >= comparator - cpa->entries[i].weight) {
-        cpa->entries[i].found = 1;
-        ++cpa->num_found;
-        cpa->entries[i].linear_subtractor -= cpa->entries[i].weight;
-        cpa->cumulative_weight -= cpa->entries[i].weight;
-        return cpa->entries[i].data;
-      }
+  The searches take the weight the entry had when the cumulative weights
+  were set off its upper bound to get its lower bound, and the lower 
+  bound isn't moved, so the caller must keep track of how far the 
+  current weight is from that one.
+
+  If there is an index the changes are made to it instead of the array,
+  which saves a second walk of uncached memory. They are copied back 
+  when the index is dropped. The position of i in the index is returned.
+*/
+
+size_t cpa_shift(Cpa *cpa, const size_t q[], const size_t q_size, 
+                 const size_t i, const double delta)
+{
+  size_t j, k = 1;
+  int set = 0;
+  double left, right;
+  Cpa_node *index = cpa->index.nodes;
+  CPA_LINEAR_SUBTRACTOR(cpa, i) += delta;
+  for (j = 0; j < q_size; ++j) {
+    CPA_TREE_SHIFT_STEP(set, q[j], i, delta, left, right);
+    if (index) {
+      /* q is the path from the root, so its tree position is known */
+      index[k].left_subtractor += left;
+      index[k].right_subtractor += right;
+      if (j + 1 < q_size) k = 2 * k + (q[j + 1] > q[j]);
+    } else {
+      CPA_LEFT_SUBTRACTOR(cpa, q[j]) += left;
+      CPA_RIGHT_SUBTRACTOR(cpa, q[j]) += right;
     }
   }
-  return NULL;
+  return k;
 }
 
 /*
   This function is used by the binary search and binary traversal 
   functions to ensure these algorithms find the correct 
-  cumulative probability entry on successive calls. 
+  cumulative probability entry on successive calls. In CPA_FENWICK mode
+  it removes the found entry's weight from the tree instead, and q is
+  not used.
 */
 
 void cpa_set_subtractors(Cpa *cpa, const size_t q[], const size_t q_size, 
                          const size_t found_index)
 {
-  size_t j;
-  int set = 0;
+  size_t k;
+  const double weight = CPA_WEIGHT(cpa, found_index);
   ++cpa->num_found;
-  cpa->entries[found_index].found = 1;
-  for (j = 0; j < q_size; ++j) {
-    if (!set && q[j] > found_index) {
-      set = 1;
-      cpa->entries[q[j]].left_subtractor -= cpa->entries[found_index].weight;
-      cpa->entries[q[j]].right_subtractor -= cpa->entries[found_index].weight;
-    } else if (set && q[j] < found_index) {
-      set = 0;
-      cpa->entries[q[j]].left_subtractor += cpa->entries[found_index].weight;  
-      cpa->entries[q[j]].right_subtractor += cpa->entries[found_index].weight;
-    } else if (!set && q[j] == found_index) {
-      cpa->entries[q[j]].right_subtractor -= cpa->entries[found_index].weight;
-    } else if (set && q[j] == found_index) {
-      cpa->entries[q[j]].left_subtractor += cpa->entries[found_index].weight;
+  cpa_set_found(cpa, found_index, 1);
+  if (cpa->mode == CPA_FENWICK) {
+    cpa_fenwick_add(cpa, found_index, -weight);
+    return;
+  }
+  k = cpa_shift(cpa, q, q_size, found_index, -weight);
+  if (cpa->index.nodes && q_size) cpa->index.nodes[k].weight = -HUGE_VAL;
+}
+
+/*
+  Kernels used by cpa_linear_search in the subtractor modes. Starting at
+  entry i, with subtractor the sum of the linear subtractors of the
+  entries before i, each returns the first entry whose cumulative weight
+  plus the sum of the linear subtractors up to and including its own is 
+  greater than key, or cpa->size if there is none, and sets subtractor to
+  that sum. 
+
+  Found entries don't need to be skipped: the linear subtractor of a found
+  entry takes its sum back to that of the last entry before it that isn't
+  found, so if key is less than it the earlier entry is returned first.
+  The caller checks the returned entry in case of rounding error.
+
+  The vector kernels compare 4 (AVX2) or 8 (AVX-512) entries per 
+  instruction. The running sum of the subtractors is a shift-and-add
+  prefix sum in the vector. The fields are gathered, so the kernels work
+  for both storage modes.
+*/
+
+size_t cpa_linear_find_scalar(const Cpa *cpa, const double key, size_t i,
+                              double *subtractor)
+{
+  double s = *subtractor;
+  for (; i < cpa->size; ++i) {
+    s += CPA_LINEAR_SUBTRACTOR(cpa, i);
+    if (key < CPA_CUMULATIVE_WEIGHT(cpa, i) + s) break;
+  }
+  *subtractor = s;
+  return i;
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#define CPA_HAVE_SIMD 1
+
+#include <immintrin.h>
+
+/* Gather offsets of 4 or 8 consecutive entries of a field, s doubles 
+   apart */
+
+#define CPA_LANES256(s) _mm256_set_epi64x(3 * (s), 2 * (s), (s), 0)
+#define CPA_LANES512(s) \
+  _mm512_set_epi64(7 * (s), 6 * (s), 5 * (s), 4 * (s), \
+                   3 * (s), 2 * (s), (s), 0)
+
+/*
+  Sets the addresses and strides, in doubles, of the fields read by the
+  vector kernels.
+*/
+
+void cpa_linear_fields(const Cpa *cpa, 
+                       const double **cumulative_weights, long long *cw_stride,
+                       const double **linear_subtractors, long long *ls_stride)
+{
+  if (cpa->mode == CPA_SOA) {
+    *cumulative_weights = &cpa->columns.nodes[0].cumulative_weight;
+    *cw_stride = sizeof(Cpa_node) / sizeof(double);
+    *linear_subtractors = cpa->columns.linear_subtractors;
+    *ls_stride = 1;
+  } else {
+    *cumulative_weights = &cpa->entries[0].cumulative_weight;
+    *cw_stride = sizeof(Cpa_entry) / sizeof(double);
+    *linear_subtractors = &cpa->entries[0].linear_subtractor;
+    *ls_stride = sizeof(Cpa_entry) / sizeof(double);
+  }
+}
+
+__attribute__((target("avx2")))
+size_t cpa_linear_find_avx2(const Cpa *cpa, const double key, size_t i,
+                            double *subtractor)
+{
+  const double *cw, *ls;
+  long long cw_stride, ls_stride;
+  const __m256d keys = _mm256_set1_pd(key);
+  const __m256d zero = _mm256_setzero_pd();
+  __m256d carry = _mm256_set1_pd(*subtractor), x;
+  __m256i cw_index, ls_index;
+  double sums[4];
+  int mask;
+
+  cpa_linear_fields(cpa, &cw, &cw_stride, &ls, &ls_stride);
+  cw_index = CPA_LANES256(cw_stride);
+  ls_index = CPA_LANES256(ls_stride);
+  for (; i + 4 <= cpa->size; i += 4) {
+    x = ls_stride == 1 
+      ? _mm256_loadu_pd(ls + i)
+      : _mm256_i64gather_pd(ls + i * ls_stride, ls_index, 8);
+    /* [a, b, c, d] -> [a, a+b, a+b+c, a+b+c+d] */
+    x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, 0x90),
+                                         zero, 0x1));
+    x = _mm256_add_pd(x, _mm256_blend_pd(_mm256_permute4x64_pd(x, 0x40),
+                                         zero, 0x3));
+    x = _mm256_add_pd(x, carry);
+    mask = _mm256_movemask_pd(_mm256_cmp_pd(
+      keys, 
+      _mm256_add_pd(_mm256_i64gather_pd(cw + i * cw_stride, cw_index, 8), x),
+      _CMP_LT_OQ));
+    if (mask) {
+      _mm256_storeu_pd(sums, x);
+      *subtractor = sums[__builtin_ctz(mask)];
+      return i + __builtin_ctz(mask);
     }
+    carry = _mm256_permute4x64_pd(x, 0xff);
   }
+  *subtractor = _mm256_cvtsd_f64(carry);
+  return cpa_linear_find_scalar(cpa, key, i, subtractor);
 }
 
-void *cpa_binary_search(Cpa *cpa, const double key)
+__attribute__((target("avx512f")))
+size_t cpa_linear_find_avx512(const Cpa *cpa, const double key, size_t i,
+                              double *subtractor)
+{
+  const double *cw, *ls;
+  long long cw_stride, ls_stride;
+  const __m512d keys = _mm512_set1_pd(key);
+  const __m512i shift1 = _mm512_set_epi64(6, 5, 4, 3, 2, 1, 0, 0);
+  const __m512i shift2 = _mm512_set_epi64(5, 4, 3, 2, 1, 0, 0, 0);
+  const __m512i shift4 = _mm512_set_epi64(3, 2, 1, 0, 0, 0, 0, 0);
+  const __m512i last = _mm512_set1_epi64(7);
+  /* The gathers and the permute are the masked forms with every lane
+     set, because the plain ones leave their source undefined, which
+     GCC warns about at -O3 */
+  const __m512d zero = _mm512_setzero_pd();
+  const __mmask8 all = 0xff;
+  __m512d carry = _mm512_set1_pd(*subtractor), x;
+  __m512i cw_index, ls_index;
+  double sums[8];
+  __mmask8 mask;
+
+  cpa_linear_fields(cpa, &cw, &cw_stride, &ls, &ls_stride);
+  cw_index = CPA_LANES512(cw_stride);
+  ls_index = CPA_LANES512(ls_stride);
+  for (; i + 8 <= cpa->size; i += 8) {
+    x = ls_stride == 1 
+      ? _mm512_loadu_pd(ls + i)
+      : _mm512_mask_i64gather_pd(zero, all, ls_index, ls + i * ls_stride, 8);
+    x = _mm512_add_pd(x, _mm512_maskz_permutexvar_pd(0xfe, shift1, x));
+    x = _mm512_add_pd(x, _mm512_maskz_permutexvar_pd(0xfc, shift2, x));
+    x = _mm512_add_pd(x, _mm512_maskz_permutexvar_pd(0xf0, shift4, x));
+    x = _mm512_add_pd(x, carry);
+    mask = _mm512_cmp_pd_mask(
+      keys, 
+      _mm512_add_pd(_mm512_mask_i64gather_pd(zero, all, cw_index, 
+                                             cw + i * cw_stride, 8), x),
+      _CMP_LT_OQ);
+    if (mask) {
+      _mm512_storeu_pd(sums, x);
+      *subtractor = sums[__builtin_ctz(mask)];
+      return i + __builtin_ctz(mask);
+    }
+    carry = _mm512_mask_permutexvar_pd(x, all, last, x);
+  }
+  *subtractor = _mm512_cvtsd_f64(carry);
+  return cpa_linear_find_scalar(cpa, key, i, subtractor);
+}
+
+#endif
+
+typedef size_t (*Cpa_linear_find)(const Cpa *, const double, size_t, double *);
+
+/*
+  Kernels used by cpa_append_weights. Each one sets out[k * stride] to
+  carry plus the sum of weights 0 to k, for each k below n, and returns
+  carry plus the sum of all n weights.
+*/
+
+typedef double (*Cpa_scan)(const double [], const size_t, double, double *,
+                           const size_t);
+
+double cpa_scan_scalar(const double weights[], const size_t n, double carry,
+                       double *out, const size_t stride)
+{
+  size_t k;
+  for (k = 0; k < n; ++k) {
+    carry += weights[k];
+    out[k * stride] = carry;
+  }
+  return carry;
+}
+
+#ifdef CPA_HAVE_SIMD
+
+/* Sums 4 weights at a time in a register: shifted copies of the register
+   are added to it so that each lane holds the sum of itself and the lanes
+   below it, and then the carry is added to all of them. */
+
+__attribute__((target("avx2")))
+double cpa_scan_avx2(const double weights[], const size_t n, double carry,
+                     double *out, const size_t stride)
+{
+  size_t k = 0;
+  double sums[4];
+  __m256d x, shifted;
+  for (; k + 4 <= n; k += 4) {
+    x = _mm256_loadu_pd(weights + k);
+    shifted = _mm256_permute4x64_pd(x, 0x90);
+    x = _mm256_add_pd(x, _mm256_blend_pd(shifted, _mm256_setzero_pd(), 1));
+    x = _mm256_add_pd(x, _mm256_permute2f128_pd(x, x, 0x08));
+    _mm256_storeu_pd(sums, _mm256_add_pd(x, _mm256_set1_pd(carry)));
+    out[k * stride] = sums[0];
+    out[(k + 1) * stride] = sums[1];
+    out[(k + 2) * stride] = sums[2];
+    out[(k + 3) * stride] = sums[3];
+    carry = sums[3];
+  }
+  return cpa_scan_scalar(weights + k, n - k, carry, out + k * stride, stride);
+}
+
+#endif
+
+/*
+  The fastest linear search and scan kernels that the CPU supports. They
+  are set once, by cpa_select_kernels, before either is first used, so
+  that threads searching or appending at the same time don't race to set
+  them.
+*/
+
+static Cpa_linear_find cpa_linear_find_selected = cpa_linear_find_scalar;
+static Cpa_scan cpa_scan_selected = cpa_scan_scalar;
+
+void cpa_select_kernels(void)
+{
+#ifdef CPA_HAVE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) 
+    cpa_linear_find_selected = cpa_linear_find_avx512;
+  else if (__builtin_cpu_supports("avx2")) 
+    cpa_linear_find_selected = cpa_linear_find_avx2;
+  if (__builtin_cpu_supports("avx2")) 
+    cpa_scan_selected = cpa_scan_avx2;
+#endif
+}
+
+#ifdef CPA_HAVE_THREADS
+static pthread_once_t cpa_kernels_once = PTHREAD_ONCE_INIT;
+#define CPA_SELECT_KERNELS() \
+  pthread_once(&cpa_kernels_once, cpa_select_kernels)
+#else
+static int cpa_kernels_selected = 0;
+#define CPA_SELECT_KERNELS()                                    \
+  (cpa_kernels_selected ? (void) 0                              \
+   : (cpa_select_kernels(), (void) (cpa_kernels_selected = 1)))
+#endif
+
+Cpa_linear_find cpa_linear_kernel(void)
+{
+  CPA_SELECT_KERNELS();
+  return cpa_linear_find_selected;
+}
+
+Cpa_scan cpa_scan_kernel(void)
+{
+  CPA_SELECT_KERNELS();
+  return cpa_scan_selected;
+}
+
+/* Number of entries that cpa_fill does at a time */
+
+static const size_t CPA_FILL_BLOCK = 64;
+
+/*
+  Sets entries cpa->size + first up to cpa->size + last from elements
+  first to last of data and weights, in the subtractor modes. carry is the
+  cumulative weight of the entry before them, and the cumulative weight
+  of the last one is returned. The entries are done a block at a time, so
+  that they are still in cache when the block is scanned.
+*/
+
+double cpa_fill(Cpa *cpa, void *data[], const double weights[], size_t first,
+                const size_t last, double carry, const Cpa_scan scan)
+{
+  size_t i, j, end;
+  for (; first < last; first = end) {
+    end = first + CPA_FILL_BLOCK < last ? first + CPA_FILL_BLOCK : last;
+    j = cpa->size + first;
+    if (cpa->mode == CPA_SOA) {
+      Cpa_node *node = cpa->columns.nodes + j;
+      for (i = first; i < end; ++i, ++node) {
+        node->weight = weights[i];
+        node->left_subtractor = 0.0;
+        node->right_subtractor = 0.0;
+        cpa->columns.linear_subtractors[j + i - first] = 0.0;
+      }
+      memcpy(cpa->columns.weights + j, weights + first, 
+             (end - first) * sizeof(double));
+      memcpy(cpa->columns.data + j, data + first, 
+             (end - first) * sizeof(void *));
+      carry = scan(weights + first, end - first, carry, 
+                   &cpa->columns.nodes[j].cumulative_weight,
+                   sizeof(Cpa_node) / sizeof(double));
+    } else {
+      Cpa_entry *entry = cpa->entries + j;
+      for (i = first; i < end; ++i, ++entry) {
+        entry->data = data[i];
+        entry->weight = weights[i];
+        entry->adder = 0.0;
+        entry->left_subtractor = 0.0;
+        entry->right_subtractor = 0.0;
+        entry->linear_subtractor = 0.0;
+        entry->found = 0;
+      }
+      carry = scan(weights + first, end - first, carry,
+                   &cpa->entries[j].cumulative_weight,
+                   sizeof(Cpa_entry) / sizeof(double));
+    }
+  }
+  return carry;
+}
+
+/*
+  Part of the entries appended by cpa_append_weights, which is given to 
+  one thread. On the first pass carry is set to the sum of the part's
+  weights, and on the second it is the cumulative weight of the entry
+  before the part, which is replaced by that of its last entry.
+*/
+
+struct cpa_part_s {
+  Cpa *cpa;
+  void **data;
+  const double *weights;
+  size_t first;
+  size_t last;
+  double carry;
+  Cpa_scan scan;
+};
+
+typedef struct cpa_part_s Cpa_part;
+
+void *cpa_sum_part(void *arg)
+{
+  Cpa_part *part = (Cpa_part *) arg;
+  size_t i;
+  /* Four sums, so the additions don't all wait for each other */
+  double sums[4] = {0.0, 0.0, 0.0, 0.0};
+  for (i = part->first; i + 4 <= part->last; i += 4) {
+    sums[0] += part->weights[i];
+    sums[1] += part->weights[i + 1];
+    sums[2] += part->weights[i + 2];
+    sums[3] += part->weights[i + 3];
+  }
+  for (; i < part->last; ++i) sums[0] += part->weights[i];
+  part->carry = (sums[0] + sums[1]) + (sums[2] + sums[3]);
+  return NULL;
+}
+
+void *cpa_fill_part(void *arg)
+{
+  Cpa_part *part = (Cpa_part *) arg;
+  part->carry = cpa_fill(part->cpa, part->data, part->weights, part->first,
+                         part->last, part->carry, part->scan);
+  return NULL;
+}
+
+/*
+  Returns the number of threads that cpa_append_weights uses for n 
+  entries.
+*/
+
+size_t cpa_num_threads(const size_t n)
+{
+  size_t threads = n / CPA_THREAD_SIZE;
+#ifdef CPA_HAVE_THREADS
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > 0 && threads > (size_t) cpus) threads = cpus;
+  if (threads > CPA_MAX_THREADS) threads = CPA_MAX_THREADS;
+  return threads ? threads : 1;
+#else
+  return 1;
+#endif
+}
+
+/*
+  Calls func on each of the parts, each in its own thread except the 
+  first, which is done by the calling thread. A part whose thread can't 
+  be started is done by the calling thread too.
+*/
+
+void cpa_run_parts(Cpa_part parts[], const size_t num_parts, 
+                   void *(*func)(void *))
+{
+  size_t i;
+#ifdef CPA_HAVE_THREADS
+  pthread_t threads[CPA_MAX_THREADS];
+  int started[CPA_MAX_THREADS];
+  for (i = 1; i < num_parts; ++i)
+    started[i] = pthread_create(&threads[i], NULL, func, &parts[i]) == 0;
+  func(&parts[0]);
+  for (i = 1; i < num_parts; ++i) {
+    if (started[i]) pthread_join(threads[i], NULL);
+    else func(&parts[i]);
+  }
+#else
+  for (i = 0; i < num_parts; ++i) func(&parts[i]);
+#endif
+}
+
+/*
+  Appends n entries to a CPA_FENWICK array, which has room for them. As
+  in cpa_fenwick_build, each new node of the tree is added to its parent.
+  The old nodes whose parents are new are those that a prefix sum up to
+  the last old entry would read, and they are added first.
+*/
+
+void cpa_fenwick_append(Cpa *cpa, void *data[], const double weights[],
+                        const size_t n)
+{
+  size_t i, parent;
+  const size_t last = cpa->size + n;
+  double *tree = cpa->columns.tree;
+  memcpy(cpa->columns.weights + cpa->size, weights, n * sizeof(double));
+  memcpy(cpa->columns.data + cpa->size, data, n * sizeof(void *));
+  memset(cpa->columns.found + cpa->size, 0, n);
+  memcpy(tree + cpa->size + 1, weights, n * sizeof(double));
+  for (i = cpa->size; i > 0; i -= i & (~i + 1)) {
+    parent = i + (i & (~i + 1));
+    if (parent <= last) tree[parent] += tree[i];
+  }
+  for (i = cpa->size + 1; i <= last; ++i) {
+    cpa->cumulative_weight += weights[i - cpa->size - 1];
+    parent = i + (i & (~i + 1));
+    if (parent <= last) tree[parent] += tree[i];
+  }
+  cpa->size = last;
+}
+
+int cpa_append_weights(Cpa *cpa, void *data[], const double weights[],
+                       const size_t n)
+{
+  Cpa_part parts[CPA_MAX_THREADS];
+  size_t i, num_parts;
+  double carry, sum;
+  const size_t size = cpa->size + n;
+  int error;
+
+  if (size > cpa->capacity && 
+      (error = cpa_reserve(cpa, size > 2 * cpa->capacity 
+                           ? size : 2 * cpa->capacity)))
+    return error;
+  if (n == 0) return 0;
+  if (cpa->index.nodes) cpa_free_index(cpa);
+  if (cpa->mode == CPA_FENWICK) {
+    cpa_fenwick_append(cpa, data, weights, n);
+    return 0;
+  }
+  carry = cpa->size ? CPA_CUMULATIVE_WEIGHT(cpa, cpa->size - 1) : 0.0;
+  num_parts = cpa_num_threads(n);
+  for (i = 0; i < num_parts; ++i) {
+    parts[i].cpa = cpa;
+    parts[i].data = data;
+    parts[i].weights = weights;
+    parts[i].first = n / num_parts * i;
+    parts[i].last = i + 1 < num_parts ? n / num_parts * (i + 1) : n;
+    parts[i].carry = carry;
+    parts[i].scan = cpa_scan_kernel();
+  }
+  /* With one part there is nothing to add up first */
+  if (num_parts > 1) {
+    cpa_run_parts(parts, num_parts, cpa_sum_part);
+    for (i = 0; i < num_parts; ++i) {
+      sum = parts[i].carry;
+      parts[i].carry = carry;
+      carry += sum;
+    }
+  }
+  cpa_run_parts(parts, num_parts, cpa_fill_part);
+  cpa->cumulative_weight = parts[num_parts - 1].carry;
+  cpa->size = size;
+  return 0;
+}
+
+void *cpa_linear_search(Cpa *cpa, const double key) 
+{
+  size_t i = 0;
+  double subtractor = 0.0, weight;
+  Cpa_linear_find find;
+
+  if (cpa->mode == CPA_FENWICK) {
+    /* The found entries have no weight, so just walk the weights. */
+    for (i = 0; i < cpa->size; ++i) {
+      if (cpa->columns.found[i]) continue;
+      subtractor += cpa->columns.weights[i];
+      if (key < subtractor) {
+        CPA_COUNT_PROBES(cpa, i + 1);
+        cpa->columns.found[i] = 1;
+        ++cpa->num_found;
+        cpa->cumulative_weight -= cpa->columns.weights[i];
+        cpa_fenwick_add(cpa, i, -cpa->columns.weights[i]);
+        return cpa->columns.data[i];
+      }
+    }
+    CPA_COUNT_PROBES(cpa, cpa->size);
+    return NULL;
+  }
+
+  find = cpa_linear_kernel();
+  while ((i = find(cpa, key, i, &subtractor)) < cpa->size) {
+    weight = CPA_WEIGHT(cpa, i);
+    if (!cpa_is_found(cpa, i) && 
+        key >= CPA_CUMULATIVE_WEIGHT(cpa, i) + subtractor - weight) {
+      CPA_COUNT_PROBES(cpa, i + 1);
+      cpa_set_found(cpa, i, 1);
+      ++cpa->num_found;
+      CPA_LINEAR_SUBTRACTOR(cpa, i) -= weight;
+      cpa->cumulative_weight -= weight;
+      return CPA_DATA(cpa, i);
+    }
+    ++i;  /* Only possible through rounding error */
+  }
+  CPA_COUNT_PROBES(cpa, cpa->size);
+  return NULL;
+}
+
+void *cpa_search(Cpa *cpa, const double key)
+{
+  if (cpa->size <= cpa->linear_threshold) 
+    return cpa_linear_search(cpa, key);
+  return cpa_binary_search(cpa, key);
+}
+
+/*
+  Binary search for the CPA_SOA storage mode. It is the same algorithm as
+  cpa_binary_search, but each probe reads a single node, and so a single
+  cache line. Found nodes have a weight of -HUGE_VAL, which sends the 
+  search left without a separate test.
+*/
+
+void *cpa_binary_search_soa(Cpa *cpa, const double key)
+{
+  size_t q_size, i;
+  size_t q[64];
+
+  CPA_TREE_SEARCH(size_t, double, cpa->columns.nodes, cpa->size, key, q, 
+                  q_size, i);
+  CPA_COUNT_PROBES(cpa, q_size);
+  if (i == cpa->size) return NULL;  /* Not found */
+  cpa->cumulative_weight -= cpa->columns.weights[i];
+  cpa_set_subtractors(cpa, q, q_size, i);
+  return cpa->columns.data[i];
+}
+
+/*
+  Binary search for the CPA_AOS storage mode.
+*/
+
+void *cpa_binary_search_aos(Cpa *cpa, const double key)
 {
   size_t lower = 0, higher = cpa->size - 1, q_size = 0, i;
   size_t q[64];
   double subtractor = 0.0;
-  
+
   while(1) {
     if ( (signed) higher < (signed) lower) return NULL;  /* Not found */
     i = (lower + higher + 1) / 2;
     q[q_size] = i;
     ++q_size;
+    CPA_COUNT_PROBES(cpa, 1);
     subtractor += cpa->entries[i].right_subtractor;
     if (cpa->entries[i].cumulative_weight + subtractor <= key) {
       lower = i + 1;
@@ -148,7 +1124,7 @@ void *cpa_binary_search(Cpa *cpa, const double key)
     subtractor += cpa->entries[i].left_subtractor;
     if (cpa->entries[i].found || 
         cpa->entries[i].cumulative_weight + subtractor - 
-        cpa->entries[i].weight  > key) {
+        cpa->entries[i].weight + cpa->entries[i].adder > key) {
       higher = i - 1;
       continue;
     }
@@ -158,6 +1134,224 @@ void *cpa_binary_search(Cpa *cpa, const double key)
   }
 }
 
+/*
+  Binary search of the Eytzinger index. Each level goes right if the
+  entry's cumulative weight is at most key, and left otherwise, without
+  branching. The found entry is the last one where the search went left,
+  which is the first entry whose cumulative weight is greater than key.
+  The search doesn't stop there, but it goes right all the way down from
+  it, because the cumulative weights of the entries before it are at
+  most key. Padding nodes always go right. A found entry's cumulative 
+  weight is that of the last entry before it that hasn't been found, so
+  it can't be the first greater than key. If rounding error makes the
+  match fail the index is searched again the usual way.
+*/
+
+void *cpa_binary_search_index(Cpa *cpa, const double key)
+{
+  const Cpa_node *nodes = cpa->index.nodes;
+  const size_t depth = cpa->index.depth;
+  size_t lower = 0, higher = cpa->size, level, i, k = 1;
+  size_t match = cpa->size, match_k = 0, match_level = 0;
+  size_t q[64];
+  double subtractor = 0.0, match_subtractor = 0.0, right_subtractor;
+  size_t right;
+
+  for (level = 0; level < depth; ++level) {
+    /* The 8 nodes three levels down are in 4 cache lines */
+    CPA_PREFETCH(nodes + 8 * k);
+    CPA_PREFETCH(nodes + 8 * k + 2);
+    CPA_PREFETCH(nodes + 8 * k + 4);
+    CPA_PREFETCH(nodes + 8 * k + 6);
+    i = (lower + higher) / 2;
+    q[level] = i;
+    right_subtractor = subtractor + nodes[k].right_subtractor;
+    right = nodes[k].cumulative_weight + right_subtractor <= key;
+    subtractor = right ? right_subtractor 
+      : subtractor + nodes[k].left_subtractor;
+    match = right ? match : i;
+    match_k = right ? match_k : k;
+    match_level = right ? match_level : level;
+    match_subtractor = right ? match_subtractor : subtractor;
+    lower = right ? i + 1 : lower;
+    higher = right ? higher : i;
+    k = 2 * k + right;
+  }
+  CPA_COUNT_PROBES(cpa, depth);
+  if (match == cpa->size) return NULL;
+  if (nodes[match_k].cumulative_weight + match_subtractor - 
+      nodes[match_k].weight > key) {
+    /* Search again with branches, as cpa_binary_search_soa does */
+    lower = 0;
+    higher = cpa->size;
+    subtractor = 0.0;
+    k = 1;
+    for (level = 0; lower < higher; ++level) {
+      match = (lower + higher) / 2;
+      q[level] = match;
+      CPA_COUNT_PROBES(cpa, 1);
+      right_subtractor = subtractor + nodes[k].right_subtractor;
+      if (nodes[k].cumulative_weight + right_subtractor <= key) {
+        subtractor = right_subtractor;
+        lower = match + 1;
+        k = 2 * k + 1;
+        continue;
+      } 
+      subtractor += nodes[k].left_subtractor;
+      if (nodes[k].cumulative_weight + subtractor - nodes[k].weight > key) {
+        higher = match;
+        k = 2 * k;
+        continue;
+      }
+      break;
+    }
+    if (lower >= higher) return NULL;
+    match_level = level;
+  }
+  cpa->cumulative_weight -= CPA_WEIGHT(cpa, match);
+  cpa_set_subtractors(cpa, q, match_level + 1, match);
+  return CPA_DATA(cpa, match);
+}
+
+void *cpa_binary_search(Cpa *cpa, const double key)
+{
+  size_t i;
+
+  if (cpa->index.nodes) return cpa_binary_search_index(cpa, key);
+  if (cpa->mode == CPA_SOA) return cpa_binary_search_soa(cpa, key);
+  if (cpa->mode == CPA_FENWICK) {
+    i = cpa_fenwick_find(cpa, key);
+    CPA_COUNT_PROBES(cpa, cpa_index_depth(cpa->size));
+    if (i >= cpa->size) return NULL;
+    cpa->cumulative_weight -= cpa->columns.weights[i];
+    cpa_set_subtractors(cpa, NULL, 0, i);
+    return cpa->columns.data[i];
+  }
+  return cpa_binary_search_aos(cpa, key);
+}
+
+/*
+  Used by cpa_binary_search_batch to bring the search paths of n keys
+  into the cache. The searches are walked in lockstep without changing
+  the array. In each round the next probe of every unfinished search is
+  prefetched before any of them is read, so up to n cache misses are in
+  flight at once instead of one. The directions are chosen without
+  branches, because they are as good as random.
+
+  Returns the number of searches that matched an entry.
+*/
+
+size_t cpa_prefetch_paths(const Cpa *cpa, const double keys[], const size_t n)
+{
+  size_t lower[CPA_BATCH_GROUP], higher[CPA_BATCH_GROUP];
+  double subtractor[CPA_BATCH_GROUP];
+  size_t j, i, active = n, step = 1, matched = 0;
+  int right, left;
+  double right_subtractor, cumulative_weight, weight;
+
+  assert(n <= CPA_BATCH_GROUP);
+  for (j = 0; j < n; ++j) {
+    lower[j] = 0;
+    higher[j] = cpa->size;
+    subtractor[j] = 0.0;
+  }
+
+  if (cpa->mode == CPA_FENWICK) {
+    /* lower is the position reached, subtractor what has been taken off
+       the key, and step is the same for all of the searches. */
+    const double *tree = cpa->columns.tree;
+    while (step <= cpa->size / 2) step <<= 1;
+    for (; step; step >>= 1) {
+      for (j = 0; j < n; ++j)
+        CPA_PREFETCH(tree + lower[j] + step);
+      for (j = 0; j < n; ++j) {
+        i = lower[j] + step;
+        right = i <= cpa->size && 
+          tree[i] + subtractor[j] <= keys[j];
+        lower[j] = right ? i : lower[j];
+        subtractor[j] += right ? tree[i] : 0.0;
+      }
+    }
+    for (j = 0; j < n; ++j) {
+      if (lower[j] >= cpa->size) continue;
+      ++matched;
+      CPA_PREFETCH(cpa->columns.weights + lower[j]);
+      CPA_PREFETCH(cpa->columns.data + lower[j]);
+      CPA_PREFETCH(cpa->columns.found + lower[j]);
+    }
+    return matched;
+  }
+
+  while (active) {
+    for (j = 0; j < n; ++j) {
+      i = (lower[j] + higher[j]) / 2;
+      if (cpa->mode == CPA_SOA) {
+        CPA_PREFETCH(cpa->columns.nodes + i);
+      } else {
+        /* An entry can straddle two cache lines */
+        CPA_PREFETCH(&cpa->entries[i].cumulative_weight);
+        CPA_PREFETCH(&cpa->entries[i].linear_subtractor);
+      }
+    }
+    active = 0;
+    for (j = 0; j < n; ++j) {
+      if (lower[j] >= higher[j]) continue;
+      i = (lower[j] + higher[j]) / 2;
+      if (cpa->mode == CPA_SOA) {
+        const Cpa_node *node = cpa->columns.nodes + i;
+        cumulative_weight = node->cumulative_weight;
+        right_subtractor = subtractor[j] + node->right_subtractor;
+        weight = node->weight;
+        subtractor[j] += node->left_subtractor;
+      } else {
+        const Cpa_entry *entry = cpa->entries + i;
+        cumulative_weight = entry->cumulative_weight;
+        right_subtractor = subtractor[j] + entry->right_subtractor;
+        weight = entry->found ? -HUGE_VAL : entry->weight - entry->adder;
+        subtractor[j] += entry->left_subtractor;
+      }
+      right = cumulative_weight + right_subtractor <= keys[j];
+      left = cumulative_weight + subtractor[j] - weight > keys[j];
+      if (!right && !left) {
+        /* The cold columns are read once the entry is matched */
+        ++matched;
+        if (cpa->mode == CPA_SOA) {
+          CPA_PREFETCH(cpa->columns.weights + i);
+          CPA_PREFETCH(cpa->columns.data + i);
+        }
+      }
+      /* Selects by arithmetic, which compiles without branches */
+      subtractor[j] += right * (right_subtractor - subtractor[j]);
+      lower[j] += right * (i + 1 - lower[j]);
+      higher[j] -= !right * (higher[j] - (left ? i : lower[j]));
+      active += lower[j] < higher[j];
+    }
+  }
+  return matched;
+}
+
+void cpa_binary_search_batch(Cpa *cpa, const double keys[], const size_t n,
+                             void *out[])
+{
+  size_t k, j, group;
+  if (cpa->index.nodes) {
+    /* Searches of the index prefetch their own paths */
+    for (k = 0; k < n; ++k) out[k] = cpa_binary_search(cpa, keys[k]);
+    return;
+  }
+  for (k = 0; k < n; k += group) {
+    group = n - k < CPA_BATCH_GROUP ? n - k : CPA_BATCH_GROUP;
+    /* Finding entries only makes the array smaller, so keys that match
+       nothing now won't match anything later in the group either. */
+    if (cpa_prefetch_paths(cpa, keys + k, group)) {
+      for (j = 0; j < group; ++j) 
+        out[k + j] = cpa_binary_search(cpa, keys[k + j]);
+    } else {
+      for (j = 0; j < group; ++j) out[k + j] = NULL;
+    }
+  }
+}
+
 void cpa_traverse(Cpa *cpa, void (func)(void*))
 {
   size_t stack[64*3];
@@ -189,9 +1383,9 @@ void cpa_traverse(Cpa *cpa, void (func)(void*))
       ++counter;
     }
     if (func) {
-      func(cpa->entries[index].data);
+      func(CPA_DATA(cpa, index));
     }
-    cpa->cumulative_weight -= cpa->entries[index].weight;
+    cpa->cumulative_weight -= CPA_WEIGHT(cpa, index);
     cpa_set_subtractors(cpa, q, q_size, index);
   }
 }
@@ -203,62 +1397,131 @@ void cpa_traverse(Cpa *cpa, void (func)(void*))
 void cpa_reset(Cpa * cpa) 
 {
   size_t i;
-  for (i = 0; i < cpa->size; ++i) cpa->entries[i].found = 0;
+  for (i = 0; i < cpa->size; ++i) cpa_set_found(cpa, i, 0);
+  cpa->num_found = 0;
+  if (cpa->mode == CPA_FENWICK) {
+    cpa_fenwick_build(cpa);
+    return;
+  }
+  /* The weights may have been changed since the array was made */
+  cpa->cumulative_weight = 0.0;
+  for (i = 0; i < cpa->size; ++i) {
+    cpa->cumulative_weight += CPA_WEIGHT(cpa, i);
+    CPA_CUMULATIVE_WEIGHT(cpa, i) = cpa->cumulative_weight;
+    CPA_LEFT_SUBTRACTOR(cpa, i) = 0.0;
+    CPA_RIGHT_SUBTRACTOR(cpa, i) = 0.0;
+    CPA_LINEAR_SUBTRACTOR(cpa, i) = 0.0;
+    if (cpa->mode == CPA_AOS) cpa->entries[i].adder = 0.0;
+  }
+  if (cpa->index.nodes) cpa_copy_index(cpa, 1, 0, cpa->size, 1);
+}
+
+void* cpa_iterate(Cpa *cpa, Cpa_iterator *cpa_iterator)
+{
+  size_t index;
+  CPA_TREE_ITERATE(size_t, *cpa_iterator, cpa->size, index, 
+                   cpa_is_found(cpa, index));
+  if (index == cpa->size) return NULL;
+  cpa->cumulative_weight -= CPA_WEIGHT(cpa, index);
+  cpa_set_subtractors(cpa, cpa_iterator->q, cpa_iterator->q_size, index);
+  return CPA_DATA(cpa, index);
 }
 
 /*
-  Used by cpa_iterate to initialize the iterator.
+  Sets q to the indices that a binary search probes on its way to the
+  entry at index, and returns how many there are. Only the size of the
+  array decides the path.
 */
 
-void cpa_iterate_init(const Cpa *cpa, Cpa_iterator *cpa_iterator)
+size_t cpa_path(const Cpa *cpa, const size_t index, size_t q[])
 {
-  cpa_iterator->started = 1;
-  cpa_iterator->stack[0] = 0;              /* initial low */
-  cpa_iterator->stack[1] = cpa->size - 1;  /* initial high */
-  cpa_iterator->stack[2] = 1;              /* initial q size */ 
-  cpa_iterator->q_size = 0;
-  cpa_iterator->stack_size = 1;  
-} 
+  size_t q_size;
+  CPA_TREE_PATH(size_t, cpa->size, index, q, q_size);
+  return q_size;
+}
 
-void* cpa_iterate(Cpa *cpa, Cpa_iterator *cpa_iterator)
+/*
+  Changes the weight of entry index by delta, leaving it in the array, 
+  for the subtractor modes. The entry must not have been found.
+*/
+
+void cpa_shift_weight(Cpa *cpa, const size_t index, const double delta)
 {
-  size_t low, high, index;
+  size_t q[64], q_size;
+  q_size = cpa_path(cpa, index, q);
+  cpa_shift(cpa, q, q_size, index, delta);
+  CPA_WEIGHT(cpa, index) += delta;
+  if (cpa->mode == CPA_AOS) cpa->entries[index].adder += delta;
+  cpa->cumulative_weight += delta;
+}
 
-  if(!cpa_iterator->stack_size) {
-    if (cpa_iterator->started) return NULL;
-    cpa_iterate_init(cpa, cpa_iterator);
+int cpa_update_weight(Cpa *cpa, const size_t index, const double weight)
+{
+  assert(weight != 0.0);
+  if (index >= cpa->size) return BAD_INDEX;
+  if (cpa_is_found(cpa, index)) {
+    if (cpa->mode == CPA_AOS) 
+      cpa->entries[index].adder += weight - cpa->entries[index].weight;
+    CPA_WEIGHT(cpa, index) = weight;
+    return 0;
   }
+  if (cpa->mode == CPA_FENWICK) {
+    cpa_fenwick_add(cpa, index, weight - cpa->columns.weights[index]);
+    cpa->cumulative_weight += weight - cpa->columns.weights[index];
+    cpa->columns.weights[index] = weight;
+    return 0;
+  }
+  cpa_shift_weight(cpa, index, weight - CPA_WEIGHT(cpa, index));
+  return 0;
+}
 
-  do {
-    --cpa_iterator->stack_size;
-    low = cpa_iterator->stack[cpa_iterator->stack_size*3];
-    high = cpa_iterator->stack[cpa_iterator->stack_size*3+1];
-    cpa_iterator->q_size = cpa_iterator->stack[cpa_iterator->stack_size*3+2];
-    index = (low + high + 1) / 2;
-    cpa_iterator->q[cpa_iterator->q_size-1] = index;
-    if (index > low) {
-      cpa_iterator->stack[cpa_iterator->stack_size*3] = low;
-      cpa_iterator->stack[cpa_iterator->stack_size*3+1] = index - 1;
-      cpa_iterator->stack[cpa_iterator->stack_size*3+2] = 
-        cpa_iterator->q_size + 1;
-      ++cpa_iterator->stack_size;
-    }
-    if (index < high) {
-      cpa_iterator->stack[cpa_iterator->stack_size*3] = index + 1;
-      cpa_iterator->stack[cpa_iterator->stack_size*3+1] = high;
-      cpa_iterator->stack[cpa_iterator->stack_size*3+2] = 
-        cpa_iterator->q_size + 1;
-      ++cpa_iterator->stack_size;
-    }
-  } while (cpa->entries[index].found);
-  cpa->cumulative_weight -= cpa->entries[index].weight;
-  cpa_set_subtractors(cpa, cpa_iterator->q, cpa_iterator->q_size, index);
-  return cpa->entries[index].data;
+int cpa_remove(Cpa *cpa, const size_t index)
+{
+  size_t q[64], q_size = 0;
+  if (index >= cpa->size) return BAD_INDEX;
+  if (cpa_is_found(cpa, index)) return NOT_FOUND;
+  if (cpa->mode != CPA_FENWICK) q_size = cpa_path(cpa, index, q);
+  cpa->cumulative_weight -= CPA_WEIGHT(cpa, index);
+  cpa_set_subtractors(cpa, q, q_size, index);
+  return 0;
+}
+
+int cpa_reinsert(Cpa *cpa, const size_t index, const double weight)
+{
+  size_t q[64], q_size, k;
+  double search_weight;
+  assert(weight != 0.0);
+  if (index >= cpa->size) return BAD_INDEX;
+  if (!cpa_is_found(cpa, index)) return NOT_FOUND;
+  --cpa->num_found;
+  if (cpa->mode == CPA_FENWICK) {
+    cpa->columns.found[index] = 0;
+    cpa->columns.weights[index] = weight;
+    cpa_fenwick_add(cpa, index, weight);
+    cpa->cumulative_weight += weight;
+    return 0;
+  }
+  /* The entry's lower bound hasn't moved since it was found, so it is 
+     matched again with the weight it had when the cumulative weights 
+     were set. A found entry has no weight, so its upper bound goes up by
+     all of the new one. */
+  search_weight = CPA_CUMULATIVE_WEIGHT(cpa, index) - 
+    (index ? CPA_CUMULATIVE_WEIGHT(cpa, index - 1) : 0.0);
+  cpa_set_found(cpa, index, 0);
+  CPA_WEIGHT(cpa, index) = weight;
+  if (cpa->mode == CPA_AOS) cpa->entries[index].adder = weight - search_weight;
+  else cpa->columns.nodes[index].weight = search_weight;
+  q_size = cpa_path(cpa, index, q);
+  k = cpa_shift(cpa, q, q_size, index, weight);
+  if (cpa->index.nodes) cpa->index.nodes[k].weight = search_weight;
+  cpa->cumulative_weight += weight;
+  return 0;
 }
 
 Cpa *cpa_free(Cpa *cpa)
 {
-  free(cpa->entries);
+  free(cpa->columns.block);
+  free(cpa->index.block);
   free(cpa);
   return NULL;
 }
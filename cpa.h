@@ -18,6 +18,13 @@
 static const int OUT_OF_MEMORY = 1;
 static const int ZERO_ARRAY_SIZE = 2;
 static const int NOT_FOUND = 3;
+static const int UNSUPPORTED_MODE = 4;
+static const int BAD_INDEX = 5;
+
+/* Storage modes */
+static const int CPA_AOS = 0;  /* Array of Cpa_entry structures (default) */
+static const int CPA_SOA = 1;  /* Searched fields in separate packed arrays */
+static const int CPA_FENWICK = 2;  /* Fenwick tree of weights */
 
 /* Entry in cumulative probability array */
 
@@ -25,7 +32,7 @@ struct cpa_entry_s {
   void *data;
   double weight;
   double cumulative_weight;
-  double adder;
+  double adder;  /* Weight added since the cumulative weights were set */
   double left_subtractor;
   double right_subtractor;
   double linear_subtractor;
@@ -34,17 +41,77 @@ struct cpa_entry_s {
 
 typedef struct cpa_entry_s Cpa_entry;
 
+/* Node used by the CPA_SOA storage mode. It holds only the fields that
+   are read by each probe of a search, so that two nodes fit in a cache
+   line instead of one Cpa_entry. The data, current weights and linear
+   search subtractors are kept in separate columns, which are only read
+   once an entry has been matched.
+*/
+
+static const size_t CPA_CACHE_LINE = 64;
+
+struct cpa_node_s {
+  double cumulative_weight;
+  double right_subtractor;
+  double left_subtractor;
+  double weight;  /* When the cumulative weights were set, -HUGE_VAL once
+                     the entry has been found */
+};
+
+typedef struct cpa_node_s Cpa_node;
+
+struct cpa_columns_s {
+  Cpa_node *nodes;              /* CPA_SOA only */
+  double *tree;                 /* CPA_FENWICK only, indexed from 1 */
+  double *weights;
+  double *linear_subtractors;   /* CPA_SOA only */
+  void **data;
+  unsigned char *found;         /* CPA_FENWICK only */
+  void *block;  /* Allocation holding all of the above and the entries,
+                   NULL if the caller owns the storage or there is none
+                   yet */
+};
+
+typedef struct cpa_columns_s Cpa_columns;
+
+/* Eytzinger index built by cpa_build_index. nodes[k] is the node of the
+   entry probed at position k of the binary search tree, numbered in 
+   breadth first order from 1, so that the children of node k are nodes
+   2k and 2k + 1. The tree is padded out to a complete tree of depth
+   levels with nodes whose cumulative weight is -HUGE_VAL. The first
+   levels of the tree share a few cache lines at the start of nodes,
+   instead of being spread over the whole array. While there is an index
+   only its left and right subtractors are kept up to date, not those of
+   the array.
+*/
+
+struct cpa_index_s {
+  Cpa_node *nodes;  /* NULL if there is no index */
+  size_t depth;
+  void *block;      /* NULL if the caller owns the storage */
+};
+
+typedef struct cpa_index_s Cpa_index;
+
 /* Structure containing cumulative probability array and other 
    housekeeping information.
 */
 
 struct cpa_s {
-  Cpa_entry *entries;
+  Cpa_entry *entries;      /* CPA_AOS mode only, else NULL */
+  Cpa_columns columns;     /* CPA_SOA and CPA_FENWICK modes */
+  Cpa_index index;
   size_t capacity;
   size_t size;
   size_t num_found;
+  size_t linear_threshold; /* cpa_search is linear up to this size */
+  size_t num_probes;       /* Entries read by the searches, only counted 
+                              if cpa.c is compiled with CPA_STATS */
   double cumulative_weight;
+  int mode;
   int error;
+  int owns_storage;        /* 1 if made by cpa_new*, which may grow it, 0 if
+                              set up by cpa_init */
 };
 
 typedef struct cpa_s Cpa;
@@ -59,6 +126,33 @@ struct cpa_iterator_s {
 
 typedef struct cpa_iterator_s Cpa_iterator;
 
+/* Default size up to which cpa_search uses the linear search in CPA_SOA
+   mode. Up to about this size the vectorised scan of the linear search is
+   faster than the binary search, measured with cpa_bench. In the other
+   modes the default is 0, because an entry takes a whole cache line or
+   the linear search isn't vectorised. */
+
+#define CPA_LINEAR_THRESHOLD 128
+
+/* Number of searches that cpa_binary_search_batch walks together */
+
+#define CPA_BATCH_GROUP 16
+
+/* cpa_append_weights gives each thread at least this many entries, and
+   uses at most CPA_MAX_THREADS threads. Smaller appends use only the 
+   calling thread. */
+
+#define CPA_THREAD_SIZE 262144
+#define CPA_MAX_THREADS 64
+
+/* Prefetches the cache line holding address p, where the compiler can. */
+
+#if defined(__GNUC__)
+#define CPA_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define CPA_PREFETCH(p) ((void) (p))
+#endif
+
 /**
    Generates a random integer in the semi-open range specified 
    by its two parameters. 
@@ -97,12 +191,97 @@ double cpa_generate_weight(void* data);
   index. If set to NULL, the **for test purposes only** function, 
   cpa_generate_weight is called.
   
-  Return value: cumulative probability array.
+  Return value: cumulative probability array. An array of size 0 has no
+  storage till the first entry is appended.
   
 */
 Cpa  *cpa_new(const size_t size, void* data[], 
               double (* generator) (void *data));
 
+/**
+  Same as cpa_new, but also sets the storage mode of the array.
+
+  Input parameters:
+
+  size, data, generator: as for cpa_new
+
+  mode: one of the three storage modes.
+
+    CPA_AOS stores each entry in a Cpa_entry structure, which is what
+    cpa_new does.
+
+    CPA_SOA stores the fields used by the searches in a packed array of
+    Cpa_node structures and the rest in separate arrays, all in 
+    cpa->columns. This uses the cache far better on large arrays.
+
+    CPA_FENWICK keeps the weights in a Fenwick (binary indexed) tree 
+    instead of using subtractors, with the weights and data, in 
+    cpa->columns. Its searches are also O(log n). It has no index: 
+    cpa_build_index and cpa_build_index_at return UNSUPPORTED_MODE.
+
+  cpa->entries is NULL in the CPA_SOA and CPA_FENWICK modes. All the 
+  other cpa_* functions work the same way in all three modes.
+
+  Return value: cumulative probability array, with error set to 
+  UNSUPPORTED_MODE if mode isn't one of the three.
+*/
+Cpa  *cpa_new_mode(const size_t size, void* data[], 
+                   double (* generator) (void *data), const int mode);
+
+/**
+  Generates a new cumulative probability array from arrays of data and
+  weights, without calling a generator for each entry. The cumulative
+  weights are worked out as by cpa_append_weights.
+
+  Input parameters:
+
+  size: number of entries in the array
+
+  data: array of user data, one per entry
+
+  weights: array of weights, one per entry
+
+  mode: storage mode, as for cpa_new_mode
+
+  Return value: cumulative probability array.
+*/
+Cpa *cpa_new_weights(const size_t size, void *data[], const double weights[],
+                     const int mode);
+
+/**
+  Returns the number of bytes of storage that cpa_init needs for an array
+  of size entries in the given mode. It is a whole number of cache lines,
+  or 0 if mode isn't one of the storage modes.
+*/
+size_t cpa_storage_size(const size_t size, const int mode);
+
+/**
+  Sets up an empty cumulative probability array in memory owned by the
+  caller, so that arrays can be made over and over without allocating
+  memory. Entries are added with cpa_append or cpa_append_weights, and
+  the array is never grown. It must not be passed to cpa_free. Its 
+  storage, and the storage of its index, may be reused once it is no 
+  longer needed.
+
+  Input parameters:
+
+  size: maximum number of entries
+
+  storage: at least cpa_storage_size(size, mode) bytes, with any 
+  alignment
+
+  mode: storage mode, as for cpa_new_mode
+
+  Output parameters:
+
+  cpa: cumulative probability array, with error set to UNSUPPORTED_MODE
+  if mode isn't one of the storage modes, else to ZERO_ARRAY_SIZE if size
+  is 0 or OUT_OF_MEMORY if storage is NULL.
+
+  Return value: cpa
+*/
+Cpa *cpa_init(Cpa *cpa, const size_t size, void *storage, const int mode);
+
 /**
    Appends a data entry to a cumulative probability array.
    
@@ -115,10 +294,67 @@ Cpa  *cpa_new(const size_t size, void* data[],
    data: void pointer to the data to be added.
 
    weight: weight of entry in cumulative probability array
-   
+
+   Return value: 0 on success, OUT_OF_MEMORY if the array is full and
+   can't be grown, or UNSUPPORTED_MODE if it was made with a mode that
+   isn't a storage mode. An array made by cpa_new, cpa_new_mode or 
+   cpa_new_weights doubles its capacity when it is full, so appending is 
+   O(1) amortised, but an array set up by cpa_init is never grown.
+*/
+
+int cpa_append(Cpa *cpa, void *data, double weight);
+
+/**
+   Appends n entries to a cumulative probability array at once. This is 
+   much faster than calling cpa_append n times on big arrays. The prefix
+   sums of the weights are worked out with SIMD instructions where the
+   CPU has them, and split between threads when there are more than 
+   CPA_THREAD_SIZE entries per thread, so it runs at about the speed of
+   memory. Each thread's part is summed in a different order, so with 
+   fractional weights the cumulative weights can differ from cpa_append's
+   by rounding error. With whole number weights they are the same.
+
+   Input/Output parameters:
+
+   cpa: cumulative probability array
+
+   Input parameters:
+
+   data: array of n pointers to user data
+
+   weights: array of n weights
+
+   n: number of entries to append
+
+   Return value: 0 on success, or OUT_OF_MEMORY if the array doesn't have
+   room and can't be grown, or UNSUPPORTED_MODE as for cpa_append, in 
+   which cases nothing is appended.
 */
 
-void cpa_append(Cpa *cpa, void *data, double weight);
+int cpa_append_weights(Cpa *cpa, void *data[], const double weights[],
+                       const size_t n);
+
+/**
+   Makes room in a cumulative probability array made by cpa_new, 
+   cpa_new_mode or cpa_new_weights for at least capacity entries, 
+   allocating its storage if it has none yet. An index is dropped if the
+   array is moved.
+
+   Input/Output parameters:
+
+   cpa: cumulative probability array
+
+   Input parameters:
+
+   capacity: number of entries to make room for
+
+   Return value: 0 on success or OUT_OF_MEMORY if memory could not be 
+   allocated, or if the array is too small and doesn't own its storage
+   because it was set up by cpa_init, or UNSUPPORTED_MODE if it was made
+   with a mode that isn't a storage mode.
+*/
+
+int cpa_reserve(Cpa *cpa, const size_t capacity);
 
 /**
    Returns 1 if all entries in the cumulative probability arra have been found
@@ -131,10 +367,31 @@ void cpa_append(Cpa *cpa, void *data, double weight);
 
 int cpa_all_found(const Cpa* cpa);
 
+/**
+   Accessors for entry i of a cumulative probability array, which work in
+   every storage mode. cpa_is_found returns 1 if the entry has been found
+   or traversed, cpa_data returns its user data and cpa_weight its weight.
+
+   Input parameters:
+   
+   cpa: cumulative probability array
+
+   i: index of the entry, i.e. the number of entries appended before it
+*/
+
+int cpa_is_found(const Cpa *cpa, const size_t i);
+void *cpa_data(const Cpa *cpa, const size_t i);
+double cpa_weight(const Cpa *cpa, const size_t i);
+
 /**
   Inefficiently searches a cumulative probability array for the given key 
   and returns a pointer to the data stored in the found entry, or NULL if not found.
   The time complexity of this algorithm is O(n), where n is the size of array.
+  Where the CPU supports them, the scan uses AVX-512 or AVX2 instructions
+  to compare several entries at once, else a scalar loop. Entries found by
+  cpa_binary_search or cpa_iterate are skipped, but cpa_binary_search
+  doesn't know about entries found by this function, so call cpa_reset
+  before switching to it.
   
   Input/output parameters:
 
@@ -165,6 +422,89 @@ void *cpa_linear_search(Cpa *cpa, const double key);
 */
 void *cpa_binary_search(Cpa *cpa, const double key);
 
+/**
+  Searches a cumulative probability array with cpa_linear_search if its
+  size is at most cpa->linear_threshold, else with cpa_binary_search. The
+  threshold is set when the array is made (see CPA_LINEAR_THRESHOLD), and
+  can be changed before the array is searched. cpa_iterate can be mixed
+  with this function.
+
+  Input/output parameters:
+
+  cpa: cumulative probability array
+
+  Input parameter:
+
+  key: random number key to search for.
+
+  Return value: pointer to data stored in the found entry in the array.
+*/
+void *cpa_search(Cpa *cpa, const double key);
+
+/**
+  Builds an Eytzinger index of a cumulative probability array, which
+  cpa_binary_search then uses instead of the array. Searches of the
+  index don't branch, and the nodes they will probe are prefetched, which
+  is much faster on arrays that don't fit in the cache. The index holds
+  a copy of the searched fields of each entry, padded to the next power
+  of 2 entries, so it takes 32 to 64 bytes per entry. 
+
+  The index can be built at any time, and is kept up to date by the
+  searches, cpa_iterate, cpa_traverse and cpa_reset. cpa_append drops the
+  index, so build it once the array is complete. The linear search
+  doesn't use it. An index is not supported in CPA_FENWICK mode, because
+  the Fenwick tree is already compact.
+
+  Input/output parameters:
+
+  cpa: cumulative probability array
+
+  Return value: 0 on success, else OUT_OF_MEMORY, ZERO_ARRAY_SIZE or
+  UNSUPPORTED_MODE.
+*/
+int cpa_build_index(Cpa *cpa);
+
+/**
+  Returns the number of bytes of storage that cpa_build_index_at needs
+  for the index of an array of size entries.
+*/
+size_t cpa_index_storage_size(const size_t size);
+
+/**
+  Same as cpa_build_index, but the index is put in storage owned by the
+  caller, which holds at least cpa_index_storage_size(cpa->size) bytes.
+*/
+int cpa_build_index_at(Cpa *cpa, void *storage);
+
+/**
+  Does n binary searches of a cumulative probability array, one for each
+  key, and sets out[i] to the result of the search for keys[i]. The
+  results are exactly those of calling cpa_binary_search for each key in
+  turn, so keys[i] is searched for after the entries found for keys[0] to
+  keys[i - 1] have been removed, even if some keys are the same. The
+  searches are done in groups of CPA_BATCH_GROUP keys. The search paths of
+  a group are first walked together so that their cache misses overlap,
+  which is much faster than cpa_binary_search on arrays that don't fit in
+  the cache.
+
+  Input/output parameters:
+
+  cpa: cumulative probability array
+
+  Input parameters:
+
+  keys: array of n random number keys to search for
+
+  n: number of keys
+
+  Output parameters:
+
+  out: array of n pointers, set to the data of the found entries, or NULL
+  where a key was not found
+*/
+void cpa_binary_search_batch(Cpa *cpa, const double keys[], const size_t n,
+                             void *out[]);
+
 /**
   Does a binary traversal of a cumulative probability array. On each iteration it 
   calls a function parameter with the address of the data in the next entry of the array.
@@ -182,7 +522,9 @@ void cpa_traverse(Cpa *cpa, void (func)(void*));
 
 /**
    Resets all the entries in the cumulative probability array to
-   found, so that a fresh iteration of it can be done.
+   not found, so that a fresh iteration of it can be done. The found 
+   count, subtractors and cumulative weight are reset too, so the array
+   can be searched again as if new.
 
   Input/output parameters:
 
@@ -205,6 +547,66 @@ void cpa_reset(Cpa * cpa);
 */
 void *cpa_iterate(Cpa *cpa, Cpa_iterator *cpa_iterator);
 
+/**
+  Changes the weight of an entry in a cumulative probability array. If the
+  entry has been found, the new weight is used when cpa_reset is called.
+  The time complexity is O(log n).
+
+  Input/output parameters:
+
+  cpa: cumulative probability array
+
+  Input parameters:
+
+  index: index of the entry, i.e. the number of entries that were appended
+  before it
+
+  weight: new weight of the entry
+
+  Return value: 0 on success or BAD_INDEX if index is out of range.
+*/
+int cpa_update_weight(Cpa *cpa, const size_t index, const double weight);
+
+/**
+  Takes an entry out of a cumulative probability array without searching
+  for it, as if it had been found. The time complexity is O(log n).
+
+  Input/output parameters:
+
+  cpa: cumulative probability array
+
+  Input parameters:
+
+  index: index of the entry, i.e. the number of entries that were appended
+  before it
+
+  Return value: 0 on success, NOT_FOUND if the entry has already been 
+  found or removed, or BAD_INDEX if index is out of range.
+*/
+int cpa_remove(Cpa *cpa, const size_t index);
+
+/**
+  Puts an entry that has been found or removed back into a cumulative 
+  probability array with the given weight, so that it can be found again.
+  The time complexity is O(log n). An iteration with cpa_iterate that has
+  already passed the entry doesn't go back for it.
+
+  Input/output parameters:
+
+  cpa: cumulative probability array
+
+  Input parameters:
+
+  index: index of the entry, i.e. the number of entries that were appended
+  before it
+
+  weight: weight of the reinserted entry
+
+  Return value: 0 on success, NOT_FOUND if the entry has not been found, 
+  or BAD_INDEX if index is out of range.
+*/
+int cpa_reinsert(Cpa *cpa, const size_t index, const double weight);
+
 /**
   Frees all memory used by a cumulative probability array and returns NULL. 
   This should be called when all processing with a cpa is complete.
@@ -0,0 +1,176 @@
+/*
+  (C) Nathan Geffen 2013 under GPL version 3.0. This is free software.
+  See the file called COPYING for the license.
+
+  # Definitions of functions for alias tables.
+
+  See cpa_alias.h for documentation of extern functions. Only functions not
+  declared in cpa_alias.h are documented here. These should not be called by
+  programs using this library.
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "cpa_alias.h"
+
+/* Number of draws ahead of the current one that cpa_alias_draw_batch
+   prefetches. */
+static const size_t CPA_ALIAS_PREFETCH_DISTANCE = 16;
+
+/*
+  Allocates an alias table with size entries, or an empty one with error
+  set.
+*/
+
+Cpa_alias *cpa_alias_alloc(const size_t size)
+{
+  Cpa_alias *alias;
+  alias = (Cpa_alias *) malloc(sizeof(Cpa_alias));
+  if (!alias) return NULL;
+  alias->size = 0;
+  alias->total_weight = 0.0;
+  alias->entries = size
+    ? (Cpa_alias_entry *) malloc(sizeof(Cpa_alias_entry) * size) : NULL;
+  alias->error = size ? (alias->entries ? 0 : OUT_OF_MEMORY) : ZERO_ARRAY_SIZE;
+  if (!alias->error) alias->size = size;
+  return alias;
+}
+
+/*
+  Builds the columns of an alias table using Vose's method. On entry
+  alias->entries[i].probability holds the weight of entry i and
+  alias->total_weight the sum of the weights. small and large are work
+  arrays with alias->size elements.
+*/
+
+void cpa_alias_build(Cpa_alias *alias, size_t small[], size_t large[])
+{
+  size_t i, s, l, num_small = 0, num_large = 0;
+  Cpa_alias_entry *entries = alias->entries;
+  const double scale = alias->size / alias->total_weight;
+
+  for (i = 0; i < alias->size; ++i) {
+    entries[i].probability *= scale;
+    entries[i].alias = entries[i].data;
+    if (entries[i].probability < 1.0) small[num_small++] = i;
+    else large[num_large++] = i;
+  }
+  while (num_small && num_large) {
+    s = small[--num_small];
+    l = large[num_large - 1];
+    entries[s].alias = entries[l].data;
+    entries[l].probability -= 1.0 - entries[s].probability;
+    if (entries[l].probability < 1.0) {
+      --num_large;
+      small[num_small++] = l;
+    }
+  }
+  /* What's left over is 1.0, up to rounding error. */
+  while (num_large) entries[large[--num_large]].probability = 1.0;
+  while (num_small) entries[small[--num_small]].probability = 1.0;
+}
+
+/*
+  Finishes building an alias table whose probabilities have been set to
+  the weights.
+*/
+
+Cpa_alias *cpa_alias_finish(Cpa_alias *alias)
+{
+  size_t *work;
+  if (alias->total_weight <= 0.0) {
+    alias->error = ZERO_ARRAY_SIZE;
+    return alias;
+  }
+  work = (size_t *) malloc(sizeof(size_t) * 2 * alias->size);
+  if (!work) {
+    alias->error = OUT_OF_MEMORY;
+    return alias;
+  }
+  cpa_alias_build(alias, work, work + alias->size);
+  free(work);
+  return alias;
+}
+
+Cpa_alias *cpa_alias_new(const size_t size, void *data[],
+                         const double weights[])
+{
+  size_t i;
+  Cpa_alias *alias = cpa_alias_alloc(size);
+  if (!alias || alias->error) return alias;
+  for (i = 0; i < size; ++i) {
+    assert(weights[i] >= 0.0);
+    alias->entries[i].data = data[i];
+    alias->entries[i].probability = weights[i];
+    alias->total_weight += weights[i];
+  }
+  return cpa_alias_finish(alias);
+}
+
+Cpa_alias *cpa_alias_new_from_cpa(const Cpa *cpa)
+{
+  size_t i, j;
+  Cpa_alias *alias = cpa_alias_alloc(cpa->size - cpa->num_found);
+  if (!alias || alias->error) return alias;
+  for (i = 0, j = 0; i < cpa->size; ++i) {
+    if (cpa_is_found(cpa, i)) continue;
+    alias->entries[j].data = cpa_data(cpa, i);
+    alias->entries[j].probability = cpa_weight(cpa, i);
+    alias->total_weight += alias->entries[j].probability;
+    ++j;
+  }
+  return cpa_alias_finish(alias);
+}
+
+void *cpa_alias_draw(const Cpa_alias *alias, const double u)
+{
+  const double x = u * alias->size;
+  size_t i = (size_t) x;
+  if (i >= alias->size) i = alias->size - 1;  /* Rounding when u ~ 1 */
+  return x - i < alias->entries[i].probability
+    ? alias->entries[i].data : alias->entries[i].alias;
+}
+
+void cpa_alias_draw_batch(const Cpa_alias *alias, const double u[],
+                          const size_t n, void *out[])
+{
+  size_t k;
+  for (k = 0; k < n; ++k) {
+    if (k + CPA_ALIAS_PREFETCH_DISTANCE < n)
+      CPA_PREFETCH(alias->entries +
+                   (size_t) (u[k + CPA_ALIAS_PREFETCH_DISTANCE] *
+                             alias->size));
+    out[k] = cpa_alias_draw(alias, u[k]);
+  }
+}
+
+void *cpa_alias_draw2(const Cpa_alias *alias, const double u_index,
+                      const double u_coin)
+{
+  size_t i = (size_t) (u_index * alias->size);
+  if (i >= alias->size) i = alias->size - 1;  /* Rounding when u ~ 1 */
+  return u_coin < alias->entries[i].probability
+    ? alias->entries[i].data : alias->entries[i].alias;
+}
+
+void cpa_alias_draw2_batch(const Cpa_alias *alias, const double u_index[],
+                           const double u_coin[], const size_t n,
+                           void *out[])
+{
+  size_t k;
+  for (k = 0; k < n; ++k) {
+    if (k + CPA_ALIAS_PREFETCH_DISTANCE < n)
+      CPA_PREFETCH(alias->entries +
+                   (size_t) (u_index[k + CPA_ALIAS_PREFETCH_DISTANCE] *
+                             alias->size));
+    out[k] = cpa_alias_draw2(alias, u_index[k], u_coin[k]);
+  }
+}
+
+Cpa_alias *cpa_alias_free(Cpa_alias *alias)
+{
+  free(alias->entries);
+  free(alias);
+  return NULL;
+}
@@ -0,0 +1,169 @@
+/**
+  (C) Nathan Geffen 2013 under GPL version 3.0. This is free software.
+  See the file called COPYING for license.
+
+  # Alias tables for weighted selection with replacement.
+
+  An alias table is built in O(n) from a cumulative probability array or
+  from an array of weights, using Vose's version of Walker's alias method.
+  After that each draw takes O(1) time and a single cache line, no matter
+  how many entries there are. Unlike the searches in cpa.h, draws don't
+  change the table, so the same entry can be drawn any number of times.
+  This code conforms to c89 and is also valid C++ .
+ */
+
+#ifndef CPA_ALIAS_H
+#define CPA_ALIAS_H
+
+#include "cpa.h"
+
+/* Column of an alias table. A uniform random number u in [0, 1) selects
+   column floor(u * size), and then a coin selects data if it is less than
+   probability, else alias. cpa_alias_draw takes the coin from the
+   fractional part of u * size, and cpa_alias_draw2 from a second uniform
+   random number.
+*/
+
+struct cpa_alias_entry_s {
+  double probability;
+  void *data;
+  void *alias;
+};
+
+typedef struct cpa_alias_entry_s Cpa_alias_entry;
+
+struct cpa_alias_s {
+  Cpa_alias_entry *entries;
+  size_t size;
+  double total_weight;
+  int error;
+};
+
+typedef struct cpa_alias_s Cpa_alias;
+
+/**
+  Generates an alias table from an array of weights. The time complexity
+  is O(n), where n is size.
+
+  Input parameters:
+
+  size: number of entries
+
+  data: array of user data, one per entry
+
+  weights: array of weights, one per entry. They must not be negative, and
+  at least one must be positive.
+
+  Return value: alias table, with error set to OUT_OF_MEMORY or
+  ZERO_ARRAY_SIZE if it could not be built.
+*/
+Cpa_alias *cpa_alias_new(const size_t size, void *data[],
+                         const double weights[]);
+
+/**
+  Generates an alias table from the entries of a cumulative probability
+  array that have not been found. The array itself is not changed. The
+  time complexity is O(n), where n is the size of the array.
+
+  Input parameters:
+
+  cpa: cumulative probability array, in any storage mode
+
+  Return value: alias table, with error set to OUT_OF_MEMORY or
+  ZERO_ARRAY_SIZE if it could not be built.
+*/
+Cpa_alias *cpa_alias_new_from_cpa(const Cpa *cpa);
+
+/**
+  Draws an entry from an alias table, with replacement. O(1).
+
+  The coin is the fractional part of u * size, so it has the bits of u
+  that are left after those that select the column. If u has b bits,
+  such as the 32 of the generators of this library, and the table has
+  about 2^k entries, probabilities are only resolved to 2^(k-b): with
+  1e7 entries and 32 bit numbers, to about 2^-9, and entries whose
+  probabilities aren't multiples of that are drawn with visible bias.
+  Use cpa_alias_draw2 for large tables.
+
+  Input parameters:
+
+  alias: alias table
+
+  u: uniform random number in [0, 1)
+
+  Return value: pointer to the data of the drawn entry.
+*/
+void *cpa_alias_draw(const Cpa_alias *alias, const double u);
+
+/**
+  Draws an entry from an alias table, with replacement, using one
+  uniform random number for the column and another for the coin, so
+  that probabilities are resolved as finely as u_coin is, whatever the
+  size of the table. O(1).
+
+  Input parameters:
+
+  alias: alias table
+
+  u_index: uniform random number in [0, 1) that selects the column
+
+  u_coin: uniform random number in [0, 1) that selects the data or the
+  alias of the column
+
+  Return value: pointer to the data of the drawn entry.
+*/
+void *cpa_alias_draw2(const Cpa_alias *alias, const double u_index,
+                      const double u_coin);
+
+/**
+  Draws n entries from an alias table, with replacement. This is faster
+  than calling cpa_alias_draw n times on large tables, because the memory
+  of later draws is fetched while earlier draws are done.
+
+  Input parameters:
+
+  alias: alias table
+
+  u: array of n uniform random numbers in [0, 1)
+
+  n: number of draws
+
+  Output parameters:
+
+  out: array of n pointers, set to the data of the drawn entries
+*/
+void cpa_alias_draw_batch(const Cpa_alias *alias, const double u[],
+                          const size_t n, void *out[]);
+
+/**
+  Draws n entries from an alias table, with replacement, as
+  cpa_alias_draw2 does, prefetching like cpa_alias_draw_batch.
+
+  Input parameters:
+
+  alias: alias table
+
+  u_index: array of n uniform random numbers in [0, 1), for the columns
+
+  u_coin: array of n uniform random numbers in [0, 1), for the coins
+
+  n: number of draws
+
+  Output parameters:
+
+  out: array of n pointers, set to the data of the drawn entries
+*/
+void cpa_alias_draw2_batch(const Cpa_alias *alias, const double u_index[],
+                           const double u_coin[], const size_t n,
+                           void *out[]);
+
+/**
+  Frees all memory used by an alias table and returns NULL.
+
+  Input/output parameters:
+
+  alias: alias table to free
+*/
+Cpa_alias *cpa_alias_free(Cpa_alias *alias);
+
+#endif /* CPA_ALIAS_H */
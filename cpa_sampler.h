@@ -0,0 +1,262 @@
+/**
+  (C) Nathan Geffen 2013 under GPL version 3.0. This is free software.
+  See the file called COPYING for license.
+
+  # Typed cumulative probability arrays for C++.
+
+  cpa::Sampler is the CPA_SOA storage mode of cpa.h as a header only
+  template. It has the same search tree, subtractors and selection without
+  replacement, but the values are stored as T, instead of as void
+  pointers to the caller's data, and the weights as WeightT. Searches
+  return the index of what they found, as an IndexT, so a 32 bit index
+  into the caller's own array can be stored as T and nothing has to be
+  cast or followed. Because all of it is in the header, the compiler can
+  inline the searches and make a version of them for each weight type.
+
+  Integer weights are added exactly, so no rounding error can creep into
+  the cumulative weights. Unsigned types may be used: the subtractors
+  wrap around, but the sums compared with the keys are never negative.
+
+  The C functions of cpa.h are unchanged, and are still what C callers,
+  and callers that need the other storage modes, indices or bulk
+  construction, use.
+
+  The walks of the search tree are the macros of cpa_tree.h, which 
+  cpa.c uses too, expanded here with WeightT and IndexT. The functions
+  of cpa.c themselves aren't called, because they take void pointers and
+  doubles and go through the accessors of all three storage modes. The
+  "sampler" check of make check runs this and CPA_SOA on the same
+  operations and compares the results.
+*/
+
+#ifndef CPA_SAMPLER_H
+#define CPA_SAMPLER_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <limits>
+#include <vector>
+
+#include "cpa_tree.h"
+
+namespace cpa {
+
+  template <class T, class WeightT = double, class IndexT = uint32_t>
+  class Sampler {
+  public:
+    typedef T value_type;
+    typedef WeightT weight_type;
+    typedef IndexT index_type;
+
+    /** Returned by the searches when nothing is found */
+    static const IndexT npos = (IndexT) -1;
+
+    /** Same as Cpa_node, in WeightT. Only these fields are read by each
+        probe of a search. */
+    struct Node {
+      WeightT cumulative_weight;
+      WeightT right_subtractor;
+      WeightT left_subtractor;
+      WeightT weight;  // When the cumulative weights were set, minus
+                       // infinity once a floating point entry is found
+    };
+
+    /** Same as Cpa_iterator */
+    struct Iterator {
+      Iterator() : started(false), stack_size(0) {}
+      bool started;
+      IndexT stack[64 * 3];
+      IndexT q[64];
+      IndexT stack_size;
+      IndexT q_size;
+    };
+
+    explicit Sampler(const size_t capacity = 0) :
+      num_found_(0), num_probes_(0), cumulative_weight_(0)
+    {
+      reserve(capacity);
+    }
+
+    void reserve(const size_t capacity)
+    {
+      nodes_.reserve(capacity);
+      weights_.reserve(capacity);
+      values_.reserve(capacity);
+      found_.reserve(capacity);
+    }
+
+    /** Removes all the entries, keeping the memory. */
+    void clear()
+    {
+      nodes_.clear();
+      weights_.clear();
+      values_.clear();
+      found_.clear();
+      num_found_ = 0;
+      num_probes_ = 0;
+      cumulative_weight_ = 0;
+    }
+
+    /** Same as cpa_append. The weight must be positive. */
+    void append(const T &value, const WeightT weight)
+    {
+      Node node;
+      assert(weight > 0);
+      assert(nodes_.size() < (size_t) npos);
+      node.cumulative_weight = nodes_.empty()
+        ? weight : nodes_.back().cumulative_weight + weight;
+      node.right_subtractor = node.left_subtractor = 0;
+      node.weight = weight;
+      nodes_.push_back(node);
+      weights_.push_back(weight);
+      values_.push_back(value);
+      found_.push_back(0);
+      cumulative_weight_ += weight;
+    }
+
+    size_t size() const { return nodes_.size(); }
+    size_t num_found() const { return num_found_; }
+    bool all_found() const { return num_found_ == nodes_.size(); }
+
+    /** Same as Cpa::num_probes, counted if CPA_STATS is defined */
+    size_t num_probes() const { return num_probes_; }
+
+    /** Sum of the weights of the entries that haven't been found */
+    WeightT cumulative_weight() const { return cumulative_weight_; }
+
+    T &operator[](const IndexT i) { return values_[i]; }
+    const T &operator[](const IndexT i) const { return values_[i]; }
+    WeightT weight(const IndexT i) const { return weights_[i]; }
+    bool is_found(const IndexT i) const { return found_[i]; }
+
+    /** Same as cpa_binary_search, but returns the index of the entry
+        found, or npos if key isn't less than cumulative_weight(). key
+        must not be negative. O(log n). */
+    IndexT find(const WeightT key)
+    {
+      const Node *nodes = nodes_.empty() ? NULL : &nodes_[0];
+      const IndexT size = (IndexT) nodes_.size();
+      IndexT q[64], q_size, i;
+
+      CPA_TREE_SEARCH(IndexT, WeightT, nodes, size, key, q, q_size, i);
+#ifdef CPA_STATS
+      num_probes_ += q_size;
+#endif
+      if (i == size) return npos;
+      set_found(q, q_size, i);
+      return i;
+    }
+
+    /** Same as find, but returns the value found, or NULL. */
+    T *search(const WeightT key)
+    {
+      const IndexT i = find(key);
+      return i == npos ? NULL : &values_[i];
+    }
+
+    /** Same as cpa_iterate: finds the entries that haven't been found,
+        one per call, in the order a binary search probes them, and
+        returns npos when there are none left. */
+    IndexT iterate(Iterator &it)
+    {
+      const IndexT size = (IndexT) nodes_.size();
+      IndexT i;
+      CPA_TREE_ITERATE(IndexT, it, size, i, found_[i]);
+      if (i == size) return npos;
+      set_found(it.q, it.q_size, i);
+      return i;
+    }
+
+    /** Same as cpa_remove: takes entry i out as if it had been found.
+        It must not have been found. O(log n). */
+    void remove(const IndexT i)
+    {
+      IndexT q[64];
+      assert(!found_[i]);
+      set_found(q, path(i, q), i);
+    }
+
+    /** Puts back entry i, which has been found or removed, with the
+        weight it had. Unlike cpa_reinsert, the weight can't be changed.
+        O(log n). */
+    void reinsert(const IndexT i)
+    {
+      IndexT q[64];
+      assert(found_[i]);
+      shift(q, path(i, q), i, weights_[i]);
+      nodes_[i].weight = weights_[i];
+      found_[i] = 0;
+      --num_found_;
+      cumulative_weight_ += weights_[i];
+    }
+
+    /** Same as cpa_reset: puts back all the entries that have been
+        found. O(n). */
+    void reset()
+    {
+      WeightT cumulative_weight = 0;
+      for (size_t i = 0; i < nodes_.size(); ++i) {
+        cumulative_weight += weights_[i];
+        nodes_[i].cumulative_weight = cumulative_weight;
+        nodes_[i].right_subtractor = nodes_[i].left_subtractor = 0;
+        nodes_[i].weight = weights_[i];
+        found_[i] = 0;
+      }
+      num_found_ = 0;
+      cumulative_weight_ = cumulative_weight;
+    }
+
+  private:
+    /** Same as cpa_path: sets q to the search path to i and returns its
+        length. */
+    IndexT path(const IndexT i, IndexT q[]) const
+    {
+      IndexT q_size;
+      CPA_TREE_PATH(IndexT, (IndexT) nodes_.size(), i, q, q_size);
+      return q_size;
+    }
+
+    /** Same as cpa_shift: adds delta to the weight of i in the 
+        subtractors of the nodes on its search path q. */
+    void shift(const IndexT q[], const IndexT q_size, const IndexT i,
+               const WeightT delta)
+    {
+      int set = 0;
+      WeightT left, right;
+      for (IndexT j = 0; j < q_size; ++j) {
+        CPA_TREE_SHIFT_STEP(set, q[j], i, delta, left, right);
+        nodes_[q[j]].left_subtractor += left;
+        nodes_[q[j]].right_subtractor += right;
+      }
+    }
+
+    /** Same as cpa_set_subtractors, with q the search path to i. */
+    void set_found(const IndexT q[], const IndexT q_size, const IndexT i)
+    {
+      const WeightT weight = weights_[i];
+      shift(q, q_size, i, (WeightT) 0 - weight);
+      // Integer weights are exact, so the search already skips i, whose
+      // lower bound is now its upper bound
+      if (!std::numeric_limits<WeightT>::is_integer)
+        nodes_[i].weight = -std::numeric_limits<WeightT>::infinity();
+      found_[i] = 1;
+      ++num_found_;
+      cumulative_weight_ -= weight;
+    }
+
+    std::vector< Node > nodes_;
+    std::vector< WeightT > weights_;
+    std::vector< T > values_;
+    std::vector< unsigned char > found_;
+    size_t num_found_;
+    size_t num_probes_;
+    WeightT cumulative_weight_;
+  };
+
+  template <class T, class WeightT, class IndexT>
+  const IndexT Sampler<T, WeightT, IndexT>::npos;
+}
+
+#endif /* CPA_SAMPLER_H */
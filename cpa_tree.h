@@ -0,0 +1,161 @@
+/**
+  (C) Nathan Geffen 2013 under GPL version 3.0. This is free software.
+  See the file called COPYING for license.
+
+  # The search tree of cumulative probability arrays.
+
+  The walks of the implicit binary search tree that the subtractor modes
+  of cpa.c and cpa::Sampler of cpa_sampler.h use, written once as macros
+  so that both have the same code. cpa.c calls them with doubles and
+  size_t, and Sampler with its WeightT and IndexT, so the compiler still
+  makes a version for each weight type. The macros only read and write
+  the fields named below, and these have the same names in Cpa_node and
+  Sampler::Node, and in Cpa_iterator and Sampler::Iterator.
+
+  A node of the tree is entry i. The search goes right past it if key is
+  at least its cumulative weight plus the right subtractors on the way,
+  left if key is less than its lower bound (its cumulative weight plus
+  the left subtractors, less its weight), and else finds it. The
+  subtractors take the weights of the found entries off the entries
+  after them. Found entries have a weight that sends the search left:
+  minus infinity for floating point weights, and for exact integer
+  weights their own, since their lower bound is then their upper bound.
+
+  The macros are statements, they evaluate their arguments more than
+  once, and the names they declare end with an underscore. This code
+  conforms to c89 and is also valid C++.
+*/
+
+#ifndef CPA_TREE_H
+#define CPA_TREE_H
+
+/*
+  Binary search of the size nodes for key, recording the nodes probed in
+  q and their number in q_size, which is also the number of probes.
+  found is set to the index of the node found, or to size if there is
+  none. Nothing is changed: the caller marks the node found with q.
+*/
+
+#define CPA_TREE_SEARCH(index_t, weight_t, nodes, size, key, q, q_size,  \
+                        found)                                          \
+  do {                                                                  \
+    index_t lower_ = 0, higher_ = (size), i_;                           \
+    weight_t subtractor_ = 0, right_subtractor_;                        \
+    (found) = (size);                                                   \
+    (q_size) = 0;                                                       \
+    /* higher_ is one past the last candidate, so that it can't wrap */ \
+    while (lower_ < higher_) {                                          \
+      i_ = lower_ + (higher_ - lower_) / 2;                             \
+      (q)[(q_size)++] = i_;                                             \
+      right_subtractor_ = subtractor_ + (nodes)[i_].right_subtractor;   \
+      if ((nodes)[i_].cumulative_weight + right_subtractor_ <= (key)) { \
+        subtractor_ = right_subtractor_;                                \
+        lower_ = i_ + 1;                                                \
+        continue;                                                       \
+      }                                                                 \
+      subtractor_ += (nodes)[i_].left_subtractor;                       \
+      if ((nodes)[i_].cumulative_weight + subtractor_ -                 \
+          (nodes)[i_].weight > (key)) {                                 \
+        higher_ = i_;                                                   \
+        continue;                                                       \
+      }                                                                 \
+      (found) = i_;                                                     \
+      break;                                                            \
+    }                                                                   \
+  } while (0)
+
+/*
+  Sets q to the nodes that a search of size nodes probes on its way to
+  node index, and q_size to their number. Only size decides the path.
+*/
+
+#define CPA_TREE_PATH(index_t, size, index, q, q_size)                  \
+  do {                                                                  \
+    index_t lower_ = 0, higher_ = (size), i_;                           \
+    (q_size) = 0;                                                       \
+    while (lower_ < higher_) {                                          \
+      i_ = lower_ + (higher_ - lower_) / 2;                             \
+      (q)[(q_size)++] = i_;                                             \
+      if (i_ == (index)) break;                                         \
+      if (i_ < (index)) lower_ = i_ + 1;                                \
+      else higher_ = i_;                                                \
+    }                                                                   \
+  } while (0)
+
+/*
+  One step of adding delta to the weight of node i, for node q_j of its
+  search path: sets left and right to what must be added to the left and
+  right subtractors of q_j so that the cumulative weights of i and the
+  nodes after it go up by delta. The nodes before the path's turns to the
+  left have the change, and the turns to the right take it off again.
+  set must be 0 before the first node of the path, and is kept by the
+  macro between nodes.
+*/
+
+#define CPA_TREE_SHIFT_STEP(set, q_j, i, delta, left, right)            \
+  do {                                                                  \
+    (left) = (right) = 0;                                               \
+    if (!(set) && (q_j) > (i)) {                                        \
+      (set) = 1;                                                        \
+      (left) = (right) = (delta);                                       \
+    } else if ((set) && (q_j) < (i)) {                                  \
+      (set) = 0;                                                        \
+      (left) = (right) = -(delta);                                      \
+    } else if (!(set) && (q_j) == (i)) {                                \
+      (right) = (delta);                                                \
+    } else if ((set) && (q_j) == (i)) {                                 \
+      (left) = -(delta);                                                \
+    }                                                                   \
+  } while (0)
+
+/*
+  Finds the next of the size nodes that iterator it hasn't passed and
+  that hasn't been found, in the order a binary search probes them, and
+  sets index to it, or to size if there is none left. it.q and it.q_size
+  are then its search path, for the caller to mark it found. is_found is
+  an expression of index that is true if that node has been found.
+  it.stack holds the ranges of the subtrees still to be done, with the
+  length of the path to their roots.
+*/
+
+#define CPA_TREE_ITERATE(index_t, it, size, index, is_found)            \
+  do {                                                                  \
+    index_t low_, high_;                                                \
+    (index) = (size);                                                   \
+    if (!(it).stack_size) {                                             \
+      if ((it).started || !(size)) break;                               \
+      (it).started = 1;                                                 \
+      (it).stack[0] = 0;              /* initial low */                 \
+      (it).stack[1] = (size) - 1;     /* initial high */                \
+      (it).stack[2] = 1;              /* initial q size */              \
+      (it).q_size = 0;                                                  \
+      (it).stack_size = 1;                                              \
+    }                                                                   \
+    do {                                                                \
+      /* The nodes left on the stack may all have been found */         \
+      if (!(it).stack_size) {                                           \
+        (index) = (size);                                               \
+        break;                                                          \
+      }                                                                 \
+      --(it).stack_size;                                                \
+      low_ = (it).stack[(it).stack_size * 3];                           \
+      high_ = (it).stack[(it).stack_size * 3 + 1];                      \
+      (it).q_size = (it).stack[(it).stack_size * 3 + 2];                \
+      (index) = low_ + (high_ - low_ + 1) / 2;                          \
+      (it).q[(it).q_size - 1] = (index);                                \
+      if ((index) > low_) {                                             \
+        (it).stack[(it).stack_size * 3] = low_;                         \
+        (it).stack[(it).stack_size * 3 + 1] = (index) - 1;              \
+        (it).stack[(it).stack_size * 3 + 2] = (it).q_size + 1;          \
+        ++(it).stack_size;                                              \
+      }                                                                 \
+      if ((index) < high_) {                                            \
+        (it).stack[(it).stack_size * 3] = (index) + 1;                  \
+        (it).stack[(it).stack_size * 3 + 1] = high_;                    \
+        (it).stack[(it).stack_size * 3 + 2] = (it).q_size + 1;          \
+        ++(it).stack_size;                                              \
+      }                                                                 \
+    } while (is_found);                                                 \
+  } while (0)
+
+#endif /* CPA_TREE_H */
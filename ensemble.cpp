@@ -0,0 +1,194 @@
+/*
+  (C) Nathan Geffen and Leigh Johnson 2013 under GPL version 3.0.
+  This is free software.
+  See the file called COPYING for the license.
+
+  # Definitions of functions for ensembles of replicates.
+
+  See ensemble.h for documentation of extern functions.
+*/
+
+#include <algorithm>
+
+#include <time.h>
+
+#include <pthread.h>
+
+#include "ensemble.h"
+
+namespace mp {
+
+  /** Work shared by the threads of run_ensemble, which take the
+      replicates in turn. */
+
+  struct ensemble_work_s {
+    const Indiv *population;
+    size_t size;
+    unsigned num_replicates;
+    unsigned next_replicate;
+    uint32_t seed;
+    int cpa_mode;
+    Replicate_stats *stats;
+    bool (*can_pair)(const Indiv*);
+    unsigned (*select_age_group)(const Age_groups, const Indiv*);
+    unsigned (*generate_weight)(const Indiv*);
+  };
+
+  typedef struct ensemble_work_s Ensemble_work;
+
+  double ensemble_now_ns()
+  {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+  }
+
+  void copy_population(const Indiv population[], size_t size,
+                       vector< Indiv > &copy)
+  {
+    copy.assign(population, population + size);
+    for (size_t i = 0; i < size; ++i) {
+      if (population[i].partner)
+        copy[i].partner = &copy[0] + (population[i].partner - population);
+      // Not read by the replicates, which have no secondary round, and
+      // not set in a population that has never been matched
+      copy[i].secondary_partner = NULL;
+    }
+  }
+
+  /**
+     Sets the counts of stats from a matched population.
+   */
+
+  void count_replicate(const vector< Indiv > &population,
+                       Replicate_stats &stats)
+  {
+    stats.matched = 0;
+    fill(stats.age_gaps, stats.age_gaps + MAX_AGE_GAP + 1, 0);
+    for (size_t i = 0; i < population.size(); ++i) {
+      const Indiv *partner = population[i].partner;
+      if (!partner) continue;
+      ++stats.matched;
+      // Each partnership once, from the partner that comes first
+      if (partner > &population[i]) {
+        unsigned gap = partner->age > population[i].age ?
+          partner->age - population[i].age : population[i].age - partner->age;
+        ++stats.age_gaps[min(gap, MAX_AGE_GAP)];
+      }
+    }
+  }
+
+  /**
+     Body of each thread of run_ensemble, which runs replicates till
+     there are none left.
+   */
+
+  void *run_replicates(void *arg)
+  {
+    Ensemble_work *work = (Ensemble_work *) arg;
+    vector< Indiv > copy;
+    MatchContext context(work->cpa_mode);
+    unsigned r;
+    double start;
+    while ((r = __sync_fetch_and_add(&work->next_replicate, 1)) <
+           work->num_replicates) {
+      TRandomPhilox gen(work->seed, r);
+      ThreadRandStream use(gen);
+      copy_population(work->population, work->size, copy);
+      start = ensemble_now_ns();
+      match_pair(copy, context, work->can_pair, work->select_age_group,
+                 work->generate_weight);
+      work->stats[r].ns = ensemble_now_ns() - start;
+      work->stats[r].replicate = r;
+      count_replicate(copy, work->stats[r]);
+    }
+    return NULL;
+  }
+
+  void run_ensemble(const Indiv population[], size_t size,
+                    unsigned num_replicates, unsigned num_threads,
+                    uint32_t seed, int cpa_mode,
+                    vector< Replicate_stats > &stats,
+                    bool (can_pair)(const Indiv*),
+                    unsigned (select_age_group)
+                    (const Age_groups, const Indiv*),
+                    unsigned (generate_weight)(const Indiv*))
+  {
+    stats.resize(num_replicates);
+    if (!num_replicates) return;
+    Ensemble_work work = {population, size, num_replicates, 0, seed,
+                          cpa_mode, &stats[0], can_pair, select_age_group,
+                          generate_weight};
+    num_threads = max(1u, min(num_threads, num_replicates));
+    vector< pthread_t > ids(num_threads);
+    vector< bool > started(num_threads, false);
+    // The calling thread is the first one
+    for (unsigned t = 1; t < num_threads; ++t)
+      started[t] = pthread_create(&ids[t], NULL, run_replicates, &work) == 0;
+    run_replicates(&work);
+    for (unsigned t = 1; t < num_threads; ++t)
+      if (started[t]) pthread_join(ids[t], NULL);
+  }
+
+  /**
+     Prints a line of the summary of print_ensemble: the mean and the
+     2.5% and 97.5% quantiles of values, which are sorted.
+   */
+
+  void print_summary(FILE *f, const char *name, vector< double > &values)
+  {
+    double sum = 0, quantiles[2], q[2] = {0.025, 0.975};
+    sort(values.begin(), values.end());
+    for (size_t k = 0; k < values.size(); ++k) sum += values[k];
+    for (int k = 0; k < 2; ++k) {
+      // Interpolated between the values on either side
+      double position = q[k] * (values.size() - 1);
+      size_t below = (size_t) position;
+      size_t above = min(below + 1, values.size() - 1);
+      quantiles[k] = values[below] +
+        (position - below) * (values[above] - values[below]);
+    }
+    fprintf(f, "%s,%.4f,%.4f,%.4f\n", name, sum / values.size(),
+            quantiles[0], quantiles[1]);
+  }
+
+  void print_ensemble(const vector< Replicate_stats > &stats, FILE *f)
+  {
+    size_t n = stats.size();
+    vector< double > matched(n), mean_gaps(n), ms(n), partnerships(n);
+    fprintf(f, "replicate,matched,mean_age_gap,ms\n");
+    for (size_t r = 0; r < n; ++r) {
+      double gaps = 0;
+      for (unsigned g = 0; g <= MAX_AGE_GAP; ++g) {
+        partnerships[r] += stats[r].age_gaps[g];
+        gaps += (double) g * stats[r].age_gaps[g];
+      }
+      matched[r] = (double) stats[r].matched;
+      mean_gaps[r] = partnerships[r] ? gaps / partnerships[r] : 0;
+      ms[r] = stats[r].ns / 1e6;
+      fprintf(f, "%u,%zu,%.4f,%.3f\n", stats[r].replicate, stats[r].matched,
+              mean_gaps[r], ms[r]);
+    }
+    if (!n) return;
+
+    fprintf(f, "statistic,mean,lower,upper\n");
+    print_summary(f, "matched", matched);
+    print_summary(f, "mean_age_gap", mean_gaps);
+    print_summary(f, "ms", ms);
+    // The gaps that no replicate has are left out
+    for (unsigned g = 0; g <= MAX_AGE_GAP; ++g) {
+      vector< double > proportions(n);
+      bool any = false;
+      for (size_t r = 0; r < n; ++r) {
+        if (stats[r].age_gaps[g]) any = true;
+        proportions[r] = partnerships[r] ?
+          stats[r].age_gaps[g] / partnerships[r] : 0;
+      }
+      if (!any) continue;
+      char name[32];
+      snprintf(name, sizeof(name), "age_gap_%u%s", g,
+               g == MAX_AGE_GAP ? "+" : "");
+      print_summary(f, name, proportions);
+    }
+  }
+}
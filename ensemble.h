@@ -0,0 +1,90 @@
+/**
+  (C) Nathan Geffen and Leigh Johnson 2013 under GPL version 3.0.
+  This is free software. See the file called COPYING for the license.
+
+  # Ensembles of independent replicates of match_pair
+
+  run_ensemble matches many replicates of the same population in
+  parallel, e.g. to get uncertainty intervals of the outcomes. Each
+  replicate matches its own copy of the population, drawing its random
+  numbers from its own stream of a seed, on one of several threads. A
+  replicate's results depend only on the seed and its number, not on
+  the number of threads or the order in which the replicates are run.
+
+  The summary statistics of each replicate are gathered in a
+  Replicate_stats, and print_ensemble reports them together.
+*/
+
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "match_pair.h"
+
+namespace mp {
+
+  /** Largest age gap that has its own count. Larger ones are counted
+      as MAX_AGE_GAP. */
+  static const unsigned MAX_AGE_GAP = 50;
+
+  struct replicate_stats_s {
+    unsigned replicate;
+    size_t matched;                     // Individuals with partners
+    size_t age_gaps[MAX_AGE_GAP + 1];   // Partnerships by the difference
+                                        // of the partners' ages in years
+    double ns;                          // Taken by match_pair
+  };
+
+  typedef struct replicate_stats_s Replicate_stats;
+
+  /** Matches num_replicates replicates of the size individuals in
+      population with match_pair, on num_threads threads, and sets stats
+      to the statistics of each replicate, in the order of the
+      replicates. population isn't changed.
+
+      Input parameters:
+
+      num_threads: threads to use, including the calling one. Each one
+      keeps a copy of the population and a MatchContext, which the
+      replicates it runs use in turn. If a thread can't be started the
+      others take its share.
+
+      seed: replicate r draws its random numbers from stream r of seed.
+
+      cpa_mode: of the MatchContexts
+
+      can_pair, select_age_group, generate_weight: as for match_pair.
+      They are called from several threads at once.
+   */
+
+  void run_ensemble(const Indiv population[], size_t size,
+                    unsigned num_replicates, unsigned num_threads,
+                    uint32_t seed, int cpa_mode,
+                    vector< Replicate_stats > &stats,
+                    bool (can_pair)(const Indiv*) = can_pair_default,
+                    unsigned (select_age_group)
+                    (const Age_groups, const Indiv*) =
+                    select_age_group_default,
+                    unsigned (generate_weight)(const Indiv*) =
+                    generate_weight_default);
+
+  /** Sets copy to the size individuals in population, with the partners
+      pointing to the individuals of copy. The partners of population
+      must be NULL or individuals of population. The secondary partners
+      of copy are NULL, whatever those of population are, so population
+      needn't have been matched. */
+  void copy_population(const Indiv population[], size_t size,
+                       vector< Indiv > &copy);
+
+  /** Prints stats to f as CSV: a line for each replicate, then the
+      mean and the 2.5% and 97.5% quantiles over the replicates of the
+      number matched, the mean age gap, the time, and the proportion of
+      the partnerships with each age gap. */
+  void print_ensemble(const vector< Replicate_stats > &stats,
+                      FILE *f = stdout);
+}
+
+#endif /* ENSEMBLE_H */
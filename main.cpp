@@ -4,12 +4,17 @@
   See COPYING for license.
 */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 #include "cpa.h"
+#include "ensemble.h"
 #include "match_pair.h"
+#include "partner_writer.h"
+#include "population.h"
 
 /* Size of array */
 
@@ -20,6 +25,8 @@ static const size_t CPA_SIZE = 10;
 
 static const size_t NUM_INDIV = 20;
 
+static const uint32_t ENSEMBLE_SEED = 31279;
+
 void match(void* data)
 {
   Indiv* i = (Indiv *) data;
@@ -61,9 +68,8 @@ void cpa_test()
   seconds = time(NULL) - seconds;
   printf("Binary took: %ld seconds\n", seconds);
   
-  /* Reset parts of cpa so that linear searches can be done */
-  for (i = 0; i < cpa->size; ++i) cpa->entries[i].found = 0;
-  cpa->cumulative_weight = cpa->entries[cpa->size - 1].cumulative_weight; 
+  /* Reset cpa so that linear searches can be done */
+  cpa_reset(cpa);
 
   /* Linear searches through cpa */
   seconds = time(NULL);
@@ -92,31 +98,113 @@ void cpa_test()
 
 int main(int argc, char *argv[])
 {
+  // If the first arguments are "-ensemble threads", the executions are
+  // run as replicates of an ensemble on that many threads, each on its
+  // own copy of the population, and their statistics are printed
+  // instead of the partners. If they are "-partners path", the 
+  // partnerships are written to the file called path instead of to 
+  // stdout. The other arguments follow.
+  unsigned ensemble_threads = 0;
+  const char *partners_path = NULL;
+  while (argc > 2) {
+    if (strcmp(argv[1], "-ensemble") == 0) {
+      ensemble_threads = atoi(argv[2]);
+      if (!ensemble_threads) ensemble_threads = 1;
+    } else if (strcmp(argv[1], "-partners") == 0) {
+      partners_path = argv[2];
+    } else {
+      break;
+    }
+    argc -= 2;
+    argv += 2;
+  }
 
   cpa_test();
 
-  vector<Indiv> population;
-
-  size_t num_indiv = argc > 1 ? atoi(argv[1]) : NUM_INDIV;
+  // The first argument is the number of individuals to make, or the 
+  // name of a population file to map. If there is a fourth, the 
+  // individuals that are made are saved in it as a population file.
+  vector<Indiv> made;
+  MappedPopulation mapped;
+  Indiv *population;
+  size_t num_indiv;
   unsigned num_executions = argc > 2 ? atoi(argv[2]) : 1;
+  int cpa_mode = argc > 3 ? atoi(argv[3]) : CPA_AOS;
+  if (!valid_cpa_mode(cpa_mode) || (argc > 3 && (!*argv[3] || 
+      strspn(argv[3], "0123456789") != strlen(argv[3])))) {
+    fprintf(stderr, "Unknown cpa mode %s: use %d (AOS), %d (SOA), "
+            "%d (Fenwick) or %d (integer)\n", argv[3], CPA_AOS, CPA_SOA,
+            CPA_FENWICK, CPA_INTEGER);
+    return 1;
+  }
 
-  for (size_t i = 0; i < num_indiv; ++i) {
-    Indiv ind;
-    ind.sex = (unsigned) i % 2;
-    ind.age = (unsigned) rand_int_range(17, 65);
-    ind.age_group = ind.age / 5;
-    ind.risk_group = (unsigned) rand_int_range(0, 1);
-    ind.partner = NULL;
-    population.push_back(ind);
+  if (argc > 1 && strspn(argv[1], "0123456789") != strlen(argv[1])) {
+    int error = mapped.open(argv[1]);
+    if (error) {
+      fprintf(stderr, "Could not load %s: %s\n", argv[1], 
+              error == IO_ERROR ? strerror(errno) : "not a population file");
+      return 1;
+    }
+    population = mapped.population();
+    num_indiv = mapped.size();
+  } else {
+    num_indiv = argc > 1 ? atoi(argv[1]) : NUM_INDIV;
+    for (size_t i = 0; i < num_indiv; ++i) {
+      Indiv ind = Indiv();
+      ind.sex = (unsigned) i % 2;
+      ind.age = (unsigned) rand_int_range(17, 65);
+      ind.age_group = ind.age / 5;
+      ind.risk_group = (unsigned) rand_int_range(0, 1);
+      ind.partner = NULL;
+      made.push_back(ind);
+    }
+    if (argc > 4 && write_population(argv[4], made.empty() ? NULL : &made[0],
+                                     made.size())) {
+      fprintf(stderr, "Could not save %s: %s\n", argv[4], strerror(errno));
+      return 1;
+    }
+    population = made.empty() ? NULL : &made[0];
   }
 
-  // printf("BEFORE MATCH_PAIR\n");
-  // print_partners(population);
+  if (ensemble_threads) {
+    vector<Replicate_stats> stats;
+    run_ensemble(population, num_indiv, num_executions, ensemble_threads,
+                 ENSEMBLE_SEED, cpa_mode, stats);
+    print_ensemble(stats);
+    return 0;
+  }
 
+  // The partnerships of each execution are written as CSV lines 
+  // "id,partner_id", after a line "MATCHES i" on stdout
+  PartnerWriter writer(PARTNERS_CSV);
+  if (partners_path ? writer.open(partners_path) : writer.open(1)) {
+    fprintf(stderr, "Could not open %s: %s\n", 
+            partners_path ? partners_path : "stdout", strerror(errno));
+    return 1;
+  }
+  MatchContext context(cpa_mode);
+#ifdef MATCH_STATS
+  MatchStats stats;
+  context.stats = &stats;
+#endif
   for(unsigned i = 0; i < num_executions; ++i) {
-    match_pair(population);
+    match_pair(population, num_indiv, context, can_pair_default, 
+               select_age_group_default, generate_weight_default);
     printf("MATCHES %d\n", i);
-    print_partners(population);
+    // Both go to fd 1 unless there is a partners file
+    fflush(stdout);
+    writer.write(population, num_indiv);
+    if (writer.flush()) {
+      fprintf(stderr, "Could not write the partners: %s\n", strerror(errno));
+      return 1;
+    }
+  }
+  if (writer.close()) {
+    fprintf(stderr, "Could not write the partners: %s\n", strerror(errno));
+    return 1;
   }
+#ifdef MATCH_STATS
+  print_match_stats(stats);
+#endif
   return 0;
 }
@@ -14,7 +14,7 @@
   1. Is the weighting a real or natural number? (Affects random num gen). 
   1a. Can a weight be zero? (Please say no)
   2. Can Indiv be changed to use pointers instead of indices?
-  3. No handling of secondary partners here.
+  3. Secondary partners are only matched for Indivs, not partitioned.
   4. Can we filter out all those not available for pairing upfront?
 
   WHAT LEIGH NEEDS TO CODE
@@ -29,15 +29,40 @@
 #include <vector>
 #include <iterator>
 
+#include <cassert>
 #include <cstdio>
 
+#include <pthread.h>
+
 #include "match_pair.h"
 #include "cpa.h"
 
 using namespace std;
 
+/*
+  Instrumentation of the phases of match_pair, compiled out unless 
+  MATCH_STATS is defined.
+*/
+
+#ifdef MATCH_STATS
+#define MATCH_START(context, phase) \
+  do { if ((context).stats) (context).stats->start(phase); } while (0)
+#define MATCH_STOP(context) \
+  do { if ((context).stats) (context).stats->stop(); } while (0)
+#define MATCH_COUNT(context, field, n) \
+  do { if ((context).stats) (context).stats->field += (n); } while (0)
+#else
+#define MATCH_START(context, phase) ((void) 0)
+#define MATCH_STOP(context) ((void) 0)
+#define MATCH_COUNT(context, field, n) ((void) 0)
+#endif
+
 namespace mp {
 
+  TRandomPhilox rand_gen_default(31279);
+
+  __thread TRandomPhilox *thread_rand_gen = NULL;
+
 
   /**
      This is a function that perhaps needs to be implemented in a more
@@ -51,30 +76,39 @@ namespace mp {
     return false;
   }
 
-  unsigned search_age_groups(const vector< unsigned> age_group, const unsigned key)
+  bool can_pair_default(const CompactPopulation &population, uint32_t i)
   {
-    unsigned low = 0, high = age_group.size() - 1;
+    return i < population.size();
+  }
 
-    while (true) {      
-      if (high <= low) { 
-        return low < age_group.size() 
-          ? rand_int_range( (int) high, (int) low )
-          : high;
-      }
-      unsigned index = (low + high + 1) / 2;
-      if (age_group[index] == key) return index;
-      if (age_group[index] > key)  {
-        high = index - 1;
-        continue;
-      }
-      low = index + 1;
-    }
+  unsigned search_age_groups(const Age_groups age_groups, const unsigned key)
+  {
+    const Age_groups at_or_below = key < AGE_GROUPS_BITS - 1 
+      ? age_groups & (((Age_groups) 2 << key) - 1) : age_groups;
+    const Age_groups above = age_groups & ~at_or_below;
+
+    assert(age_groups);
+    if (at_or_below >> key & 1) return key;
+    if (!at_or_below) return __builtin_ctz(above);
+    unsigned below_group = AGE_GROUPS_BITS - 1 - __builtin_clz(at_or_below);
+    if (!above) return below_group;
+    unsigned above_group = __builtin_ctz(above);
+    if (key - below_group < above_group - key) return below_group;
+    if (above_group - key < key - below_group) return above_group;
+    return rand_int_to(1) ? above_group : below_group;
   }
 
-  unsigned select_age_group_default(const vector< unsigned > age_group, 
+  unsigned select_age_group_default(const Age_groups age_groups, 
                                     const Indiv *ind)
   {
-    return search_age_groups(age_group, ind->age_group);
+    return search_age_groups(age_groups, ind->age_group);
+  }
+
+  unsigned select_age_group_default(const Age_groups age_groups, 
+                                    const CompactPopulation &population,
+                                    uint32_t i)
+  {
+    return search_age_groups(age_groups, population.age_group(i));
   }
 
   unsigned generate_weight_default(const Indiv *ind) 
@@ -84,141 +118,1039 @@ namespace mp {
     return 1;
   }
 
-  vector< unsigned > non_empty_cpa(Cpa* cpa[], unsigned sex, unsigned risk) 
+  unsigned generate_weight_default(const CompactPopulation &population,
+                                   uint32_t i)
   {
-    vector< unsigned > cpa_counts;
-  
-    for (unsigned i = 0; i < HIGHEST_AGE_GROUP; ++i) {
-      unsigned j = index(sex, risk, i);
-      if(cpa[ j ]->size) 
-        cpa_counts.push_back(i); // Store the age group not the index
+    unsigned age = population.age(i);
+    if (age >= 15 && age < 40) return 3;
+    if (age >= 40 && age < 50) return 2;    
+    return 1;
+  }
+
+  const uint32_t CompactPopulation::NO_PARTNER;
+
+  void CompactPopulation::resize(size_t size)
+  {
+    assert(size < NO_PARTNER);
+    attributes.resize(size, 0);
+    ages.resize(size, 0);
+    partners.resize(size, NO_PARTNER);
+  }
+
+  void CompactPopulation::assign(const Indiv population[], size_t size)
+  {
+    resize(0);
+    resize(size);
+    for (size_t i = 0; i < size; ++i) {
+      const Indiv &ind = population[i];
+      set(i, ind.sex, ind.age, ind.age_group, ind.risk_group);
+      if (ind.partner) partners[i] = (uint32_t) (ind.partner - population);
     }
-    return cpa_counts;
   }
 
+  template < class Cpas >
+  Age_groups non_empty_cpa(const Cpas &cpas, unsigned group, unsigned sex, 
+                           unsigned risk) 
+  {
+    Age_groups age_groups = 0;
+    for (unsigned i = 0; i < HIGHEST_AGE_GROUP; ++i)
+      if (!cpas.all_found(index(group, sex, risk, i))) 
+        age_groups |= (Age_groups) 1 << i; // Store the age group not the index
+    return age_groups;
+  }
+
+  /**
+     Returns the nth lowest age group in age_groups, counting from 0.
+   */
+
+  inline unsigned nth_age_group(Age_groups age_groups, unsigned n)
+  {
+    while (n--) age_groups &= age_groups - 1;
+    return __builtin_ctz(age_groups);
+  }
+
+  /**
+     Sets up the CPAs of context with the given sizes in its arena, 
+     leaving room after them for the indices of the big ones, which is
+     returned. The arena only grows.
+   */
+
+  char *init_cpas(MatchContext &context, const unsigned cpa_sizes[])
+  {
+    size_t bytes = 0, index_bytes = 0;
+    for(size_t j = 0; j < NUM_CPA; ++j) {
+      bytes += cpa_storage_size(cpa_sizes[j], context.cpa_mode);
+      if (cpa_sizes[j] >= INDEX_SIZE) 
+        index_bytes += cpa_index_storage_size(cpa_sizes[j]);
+    }
+    if (context.arena.size() < bytes + index_bytes)
+      context.arena.resize(bytes + index_bytes);
+    char *storage = &context.arena[0];
+    for(size_t j = 0; j < NUM_CPA; ++j) {
+      cpa_init(&context.cpa[j], cpa_sizes[j], storage, context.cpa_mode);
+      storage += cpa_storage_size(cpa_sizes[j], context.cpa_mode);
+      context.cpa_iterator[j].stack_size = 0; 
+      context.cpa_iterator[j].started = 0;
+    }
+    return storage;
+  }
+
+  MatchContext::MatchContext(int cpa_mode) : 
+    cpa_mode(cpa_mode), counting_sort(false), stats(NULL), 
+    can_pair_secondary(NULL), group(NULL), compact_group(NULL), 
+    partition(NULL), partition_id(0)
+  {
+    // Any other mode gives CPAs that are empty, with error set
+    assert(valid_cpa_mode(cpa_mode));
+  }
+
+  PartitionContext::PartitionContext(unsigned num_threads, int cpa_mode)
+  {
+    for (unsigned i = 0; i < (num_threads ? num_threads : 1); ++i)
+      contexts.push_back(new MatchContext(cpa_mode));
+  }
+
+  PartitionContext::~PartitionContext()
+  {
+    for (size_t i = 0; i < contexts.size(); ++i) delete contexts[i];
+  }
+
+  /**
+     Takes ind away from its old partner, if it has one. If the old 
+     partner is in another partition, which another thread may be 
+     matching, this is left till the threads are done.
+   */
+
+  inline void unpartner(MatchContext &context, Indiv *ind)
+  {
+    Indiv *old = ind->partner;
+    if (!old) return;
+    if (context.partition && context.partition(old) != context.partition_id)
+      context.unpartner_later.push_back(make_pair(old, ind));
+    else
+      old->partner = NULL;
+  }
+
+  /** Returned by hide if it hides nothing */
+  static const size_t NO_ENTRY = (size_t) -1;
+
+  /**
+     The population that match_members matches, as Indivs or as a 
+     CompactPopulation, with the functions that it was passed. A Member
+     is an individual of it as the matching loop refers to it. A Cpa 
+     stores it as a void * value, and an Integer_cpa stores its position
+     in the population.
+   */
+
+  struct Indiv_members {
+    typedef Indiv *Member;
+
+    Indiv *population;
+    bool (*can_pair)(const Indiv*);
+    unsigned (*select_age_group)(const Age_groups, const Indiv*);
+    unsigned (*generate_weight)(const Indiv*);
+
+    Member at(size_t i) const { return &population[i]; }
+    size_t position(Member m) const { return m - population; }
+    void *value(Member m) const { return m; }
+    Member member(void *value) const { return (Indiv *) value; }
+    unsigned (*group)(const Indiv*);
+
+    size_t cpa_index(Member m) const { 
+      return index(group ? group(m) : 0, m->sex, m->risk_group, 
+                   m->age_group); 
+    }
+    bool eligible(Member m) const { return m->eligible; }
+    // Sets whether m is eligible and returns it
+    bool set_eligible(Member m) const { return m->eligible = can_pair(m); }
+    unsigned weight(Member m) const { return generate_weight(m); }
+    unsigned select(const Age_groups age_groups, Member m) const {
+      return select_age_group(age_groups, m);
+    }
+    void match(MatchContext &context, Member from, Member to) const {
+      unpartner(context, from);
+      from->partner = to;
+      unpartner(context, to);
+      to->partner = from;
+    }
+    // Takes out of CPA j of cpas whoever from mustn't be matched with 
+    // and returns their entry, or NO_ENTRY if there is no one
+    template < class Cpas >
+    size_t hide(MatchContext &, Cpas &, size_t, Member) const {
+      return NO_ENTRY;
+    }
+  };
+
+  struct Compact_members {
+    typedef uint32_t Member;
+
+    CompactPopulation *population;
+    bool (*can_pair)(const CompactPopulation&, uint32_t);
+    unsigned (*select_age_group)(const Age_groups, const CompactPopulation&,
+                                 uint32_t);
+    unsigned (*generate_weight)(const CompactPopulation&, uint32_t);
+    unsigned (*group)(const CompactPopulation&, uint32_t);
+
+    Member at(size_t i) const { return (Member) i; }
+    size_t position(Member m) const { return m; }
+    // Offset by 1, so that no individual is stored as NULL
+    void *value(Member m) const { return (void *) ((uintptr_t) m + 1); }
+    Member member(void *value) const { 
+      return (Member) ((uintptr_t) value - 1); 
+    }
+    size_t cpa_index(Member m) const { 
+      return index(group ? group(*population, m) : 0, population->sex(m), 
+                   population->risk_group(m), population->age_group(m));
+    }
+    bool eligible(Member m) const { return population->eligible(m); }
+    bool set_eligible(Member m) const { 
+      bool result = can_pair(*population, m);
+      population->attributes[m] = (uint8_t) 
+        ((population->attributes[m] & 0x7F) | result << 7);
+      return result;
+    }
+    unsigned weight(Member m) const { 
+      return generate_weight(*population, m); 
+    }
+    unsigned select(const Age_groups age_groups, Member m) const {
+      return select_age_group(age_groups, *population, m);
+    }
+    void match(MatchContext &, Member from, Member to) const {
+      uint32_t *partners = &population->partners[0];
+      if (partners[from] != CompactPopulation::NO_PARTNER) 
+        partners[partners[from]] = CompactPopulation::NO_PARTNER;
+      partners[from] = to;
+      if (partners[to] != CompactPopulation::NO_PARTNER) 
+        partners[partners[to]] = CompactPopulation::NO_PARTNER;
+      partners[to] = from;
+    }
+    template < class Cpas >
+    size_t hide(MatchContext &, Cpas &, size_t, Member) const {
+      return NO_ENTRY;
+    }
+  };
+
+  /**
+     The Indivs of the secondary round of match_pair, who are given 
+     secondary partners other than their partners.
+   */
+
+  struct Secondary_members : public Indiv_members {
+    Secondary_members(const Indiv_members &members) : 
+      Indiv_members(members) {}
+
+    void match(MatchContext &, Member from, Member to) const {
+      if (from->secondary_partner) 
+        from->secondary_partner->secondary_partner = NULL;
+      from->secondary_partner = to;
+      if (to->secondary_partner) 
+        to->secondary_partner->secondary_partner = NULL;
+      to->secondary_partner = from;
+    }
+    template < class Cpas >
+    size_t hide(MatchContext &context, Cpas &cpas, size_t j, 
+                Member from) const {
+      Member partner = from->partner;
+      if (!partner || position(partner) >= context.slots.size())
+        return NO_ENTRY;
+      // The slot is out of date if the partner isn't in the CPAs now
+      const Cpa_slot &slot = context.slots[position(partner)];
+      if (slot.stratum != j || slot.entry >= cpas.size(j) ||
+          cpas.entry(j, slot.entry) != partner || 
+          cpas.is_found(j, slot.entry))
+        return NO_ENTRY;
+      cpas.remove(j, slot.entry);
+      return slot.entry;
+    }
+  };
+
+  /**
+     The CPAs that match_members matches from, in one of the storage 
+     modes of cpa.h or in CPA_INTEGER mode. The matching loop is the 
+     same for both.
+   */
+
+  template < class Members >
+  struct Double_cpas {
+    Cpa **cpa;
+    Cpa_iterator *iterator;
+    const Members *members;
+
+    size_t size(size_t j) const { return cpa[j]->size; }
+    size_t probes(size_t j) const { return cpa[j]->num_probes; }
+    bool all_found(size_t j) const { return cpa_all_found(cpa[j]); }
+    uint64_t cumulative_weight(size_t j) const { 
+      return (uint64_t) cpa[j]->cumulative_weight; 
+    }
+    typename Members::Member iterate(size_t j) { 
+      void *value = cpa_iterate(cpa[j], &iterator[j]);
+      assert(value);
+      return members->member(value);
+    }
+    typename Members::Member search(size_t j, uint64_t key) { 
+      void *value = cpa_search(cpa[j], (double) key);
+      assert(value);
+      return members->member(value);
+    }
+    typename Members::Member entry(size_t j, size_t i) const {
+      return members->member(cpa_data(cpa[j], i));
+    }
+    bool is_found(size_t j, size_t i) const { return cpa_is_found(cpa[j], i); }
+    void remove(size_t j, size_t i) { cpa_remove(cpa[j], i); }
+    void reinsert(size_t j, size_t i) { 
+      cpa_reinsert(cpa[j], i, cpa_weight(cpa[j], i)); 
+    }
+    void reset(size_t j) {
+      cpa_reset(cpa[j]);
+      iterator[j].stack_size = 0;
+      iterator[j].started = 0;
+    }
+  };
+
+  template < class Members >
+  struct Integer_cpas {
+    Integer_cpa *cpa;
+    Integer_cpa::Iterator *iterator;
+    const Members *members;
+
+    size_t size(size_t j) const { return cpa[j].size(); }
+    size_t probes(size_t j) const { return cpa[j].num_probes(); }
+    bool all_found(size_t j) const { return cpa[j].all_found(); }
+    uint64_t cumulative_weight(size_t j) const { 
+      return cpa[j].cumulative_weight(); 
+    }
+    typename Members::Member iterate(size_t j) { 
+      uint32_t i = cpa[j].iterate(iterator[j]);
+      assert(i != Integer_cpa::npos);
+      return members->at(cpa[j][i]);
+    }
+    typename Members::Member search(size_t j, uint64_t key) { 
+      uint32_t *position = cpa[j].search(key);
+      assert(position);
+      return members->at(*position);
+    }
+    typename Members::Member entry(size_t j, size_t i) const {
+      return members->at(cpa[j][(uint32_t) i]);
+    }
+    bool is_found(size_t j, size_t i) const { 
+      return cpa[j].is_found((uint32_t) i); 
+    }
+    void remove(size_t j, size_t i) { cpa[j].remove((uint32_t) i); }
+    void reinsert(size_t j, size_t i) { cpa[j].reinsert((uint32_t) i); }
+    void reset(size_t j) {
+      cpa[j].reset();
+      iterator[j] = Integer_cpa::Iterator();
+    }
+  };
+
 
   void print_partners(const vector<Indiv> &population)
   {
-    unsigned k = 0;
-    for (vector<Indiv>::const_iterator 
-           i = population.begin(); i != population.end(); ++i, ++k) {
-      printf("%d: ", k);
+    print_partners(population.empty() ? NULL : &population[0], 
+                   population.size());
+  }
+
+  void print_partners(const Indiv population[], size_t size)
+  {
+    for (size_t k = 0; k < size; ++k) {
+      const Indiv *i = &population[k];
+      printf("%zu: ", k);
       if (i->partner) {        
         printf("Person %p: sex %d age %d risk %d - ", 
-               &*i, i->sex, i->age, i->risk_group);
-        printf("Person %p: sex %d age %d risk %d\n", &*i->partner, i->partner->sex, 
+               i, i->sex, i->age, i->risk_group);
+        printf("Person %p: sex %d age %d risk %d\n", i->partner, i->partner->sex, 
                i->partner->age, i->partner->risk_group);
       } else {
         printf("Person %p: sex %d age %d risk %d no partner\n", 
-               &*i, i->sex, i->age, i->risk_group);
+               i, i->sex, i->age, i->risk_group);
       }
     }
   }
 
+  void print_partners(const CompactPopulation &population)
+  {
+    for (uint32_t i = 0; i < population.size(); ++i) {
+      uint32_t p = population.partner(i);
+      printf("%u: Person %u: sex %u age %u risk %u", i, i, population.sex(i),
+             population.age(i), population.risk_group(i));
+      if (p != CompactPopulation::NO_PARTNER)
+        printf(" - Person %u: sex %u age %u risk %u\n", p, population.sex(p),
+               population.age(p), population.risk_group(p));
+      else
+        printf(" no partner\n");
+    }
+  }
+
   void match_pair(vector<Indiv> &population, bool (can_pair)(const Indiv*),
                   unsigned (select_age_group) 
-                  (const vector< unsigned >, const Indiv*), 
-                  unsigned (generate_weight)(const Indiv*))
+                  (const Age_groups, const Indiv*), 
+                  unsigned (generate_weight)(const Indiv*),
+                  int cpa_mode)
   {
-    // Initialize cumulative probability arrays 
-    // Shuffle indices into population of individuals array
-    vector< size_t > indices;
-    indices.reserve(population.size());
-    for(size_t i = 0; i < population.size(); ++i) indices.push_back(i);
-    random_shuffle(indices.begin(), indices.end(), rand_int_to_open);
-
-    // Set the CPA sizes and initialize the CPAs
-    unsigned cpa_sizes[NUM_CPA] = {0};
-    for(vector<Indiv>::iterator 
-          i = population.begin(); i !=population.end(); ++i) {
-      if( can_pair(&*i) ) {
-        ++cpa_sizes[ index(i->sex, i->risk_group, i->age_group) ];
-        i->eligible = true;
-      } else {
-        i->eligible = false;
-      }
-    }
-    Cpa *cpa[NUM_CPA];
-    Cpa_iterator cpa_iterator[NUM_CPA];
-    for(size_t j = 0; j < NUM_CPA; ++j)  {
-      cpa[j] = cpa_new(cpa_sizes[j], NULL, NULL);
-      cpa_iterator[j].stack_size = 0; cpa_iterator[j].started = 0;
-    }
+    MatchContext context(cpa_mode);
+    match_pair(population, context, can_pair, select_age_group, 
+               generate_weight);
+  }
 
-    // Assign each eligible individual to one of the CPAs. 
-    for(size_t i = 0; i != indices.size(); ++i) {
-      Indiv *ind = &population[indices[i]];
-      if (ind->eligible) {
-        cpa_append(cpa[index(ind->sex, ind->risk_group, ind->age_group)], 
-                   (Indiv *) ind, generate_weight(ind));
-      }
-    }
+  /**
+     Matches the individuals of group in cpas, which have been filled in,
+     until there are no high risk individuals left in it.
+   */
 
-    // Make vectors of 4 non empty CPAs from which potential mates can be drawn
-    // Each element of these vectors is an index to a CPA age group
-    // Index of MALE, LOW = 0
+  template < class Members, class Cpas >
+  void match_group(MatchContext &context, const Members &members, 
+                   Cpas &cpas, const unsigned group)
+  {
+    // Make sets of the non empty CPAs of each sex and risk group from 
+    // which potential mates can be drawn. Bit i of a set is on if age
+    // group i has individuals who haven't been found.
+    // Index of sex, risk = sex * NUM_RISK_GROUPS + risk, e.g. with 2
+    // risk groups
+    //          MALE, LOW = 0
     //          MALE, HIGH = 1
     //          FEMALE, LOW = 2
     //          FEMALE, HIGH = 3
-    vector < unsigned > age_groups[4];
-    age_groups[MALE * 2 + HIGH] = non_empty_cpa(cpa, MALE, HIGH);
-    age_groups[FEMALE * 2 + HIGH] = non_empty_cpa(cpa, FEMALE, HIGH);
-    age_groups[MALE * 2 + LOW] = non_empty_cpa(cpa, MALE, LOW);
-    age_groups[FEMALE * 2 + LOW] = non_empty_cpa(cpa, FEMALE, LOW);
+    Age_groups age_groups[2 * NUM_RISK_GROUPS];
+    for (unsigned sex = MALE; sex <= FEMALE; ++sex)
+      for (unsigned risk = LOW; risk <= HIGH; ++risk)
+        age_groups[sex * NUM_RISK_GROUPS + risk] = 
+          non_empty_cpa(cpas, group, sex, risk);
+    Age_groups &male_high = age_groups[MALE * NUM_RISK_GROUPS + HIGH];
+    Age_groups &female_high = age_groups[FEMALE * NUM_RISK_GROUPS + HIGH];
 
     unsigned iterations = 0;
-    while( age_groups[ MALE * 2 + HIGH ].size() + 
-           age_groups[ FEMALE * 2 + HIGH ].size() ) {
+    while( male_high | female_high ) {
       ++iterations;
       // Choose a high risk cpa
       // randomly select sex
       unsigned from_sex;
-      if (age_groups[ MALE * 2 + HIGH ].size() && 
-          age_groups[ FEMALE * 2 + HIGH ].size()) {
+      if (male_high && female_high) {
         from_sex = rand_int_to(1);
       } else {
-        from_sex = age_groups[ MALE * 2 + HIGH ].size() ? MALE : FEMALE;
+        from_sex = male_high ? MALE : FEMALE;
       }
 
+      // Partners are found in the highest risk group of the other sex 
+      // with anyone left
+      unsigned to_sex = ~from_sex & 1;
+      unsigned to_risk_group = HIGH;
+      while (to_risk_group > LOW && 
+             !age_groups[to_sex * NUM_RISK_GROUPS + to_risk_group])
+        --to_risk_group;
+      Age_groups &to_age_groups = 
+        age_groups[to_sex * NUM_RISK_GROUPS + to_risk_group];
+      // Only possible if there is no one of the other sex left, e.g. in
+      // a partition where everyone is the same sex. The individual isn't
+      // taken out of its CPA, so it can still be matched later by an 
+      // IncrementalMatch.
+      if (!to_age_groups) break;
+
       // randomly select age group
-      unsigned from_age_group_index = 
-        rand_int_to(age_groups[from_sex * 2 + HIGH].size() - 1);
-      unsigned from_age_group = 
-        age_groups[from_sex * 2 + HIGH][from_age_group_index];
-      unsigned cpa_from = index(from_sex, HIGH, from_age_group);
-      Indiv *ind_from = 
-        (Indiv *) cpa_iterate(cpa[cpa_from], &cpa_iterator[cpa_from]);
+      Age_groups &from_age_groups = from_sex == MALE ? male_high : female_high;
+      unsigned from_age_group = nth_age_group(from_age_groups, 
+        rand_int_to(__builtin_popcount(from_age_groups) - 1));
+      unsigned cpa_from = index(group, from_sex, HIGH, from_age_group);
+      typename Members::Member ind_from = cpas.iterate(cpa_from);
       // Before finding partner, check if we have to update the non-empty CPAs
-      if (cpa_all_found(cpa[cpa_from])) { // No people left in this CPA
-        age_groups[from_sex * 2 + HIGH].
-          erase(age_groups[from_sex * 2 + HIGH].begin() 
-                + from_age_group_index);
+      if (cpas.all_found(cpa_from)) // No people left in this CPA
+        from_age_groups &= ~((Age_groups) 1 << from_age_group);
+      // Now find partner. If the only one left in the age group selected
+      // is the one that ind_from mustn't be matched with, another age 
+      // group is selected.
+      Age_groups candidates = to_age_groups;
+      unsigned to_age_group, cpa_to;
+      size_t hidden;
+      for (;;) {
+        to_age_group = members.select(candidates, ind_from);
+        assert(candidates >> to_age_group & 1);
+        cpa_to = index(group, to_sex, to_risk_group, to_age_group);
+        hidden = members.hide(context, cpas, cpa_to, ind_from);
+        if (hidden == NO_ENTRY || cpas.cumulative_weight(cpa_to)) break;
+        cpas.reinsert(cpa_to, hidden);
+        candidates &= ~((Age_groups) 1 << to_age_group);
+        if (!candidates) break;
       }
-      assert(ind_from);
-      // Now find partner
-      unsigned to_sex = ~from_sex & 1;
-      unsigned to_risk_group = 
-        age_groups[to_sex * 2 + HIGH].size() ? HIGH : LOW;
-      unsigned to_age_group_index = 
-        select_age_group(age_groups[to_sex * 2 + to_risk_group], ind_from);
-      unsigned to_age_group = 
-        age_groups[to_sex * 2 + to_risk_group][to_age_group_index];
-      unsigned cpa_to = index(to_sex, to_risk_group, to_age_group);
-      double weight = rand_int_to_open(cpa[cpa_to]->cumulative_weight);
-      Indiv* ind_to = (Indiv *) cpa_binary_search(cpa[cpa_to], weight);
-      assert(ind_to);
+      // No one left to match with but the one hidden, so ind_from is 
+      // left as it was
+      if (!candidates) continue;
+      uint64_t weight = rand_uint64_to_open(cpas.cumulative_weight(cpa_to));
+      typename Members::Member ind_to = cpas.search(cpa_to, weight);
+      MATCH_COUNT(context, searches, 1);
+      if (hidden != NO_ENTRY) cpas.reinsert(cpa_to, hidden);
       // Check if we have to update the non-empty CPAs
-      if (cpa_all_found(cpa[cpa_to])) { // No people left in this CPA
-        age_groups[to_sex * 2 + to_risk_group].
-          erase(age_groups[to_sex * 2 + to_risk_group].begin() + 
-                to_age_group_index);
-      }      
-      if(ind_from->partner) ind_from->partner->partner = NULL;
-      ind_from->partner = ind_to;
-      if(ind_to->partner) ind_to->partner->partner = NULL;
-      ind_to->partner = ind_from;
-    }
-    for(size_t i = 0; i < NUM_CPA; ++i) cpa_free(cpa[i]);
+      if (cpas.all_found(cpa_to)) // No people left in this CPA
+        to_age_groups &= ~((Age_groups) 1 << to_age_group);
+      members.match(context, ind_from, ind_to);
+    }
+    MATCH_COUNT(context, iterations, iterations);
+  }
+
+  /**
+     Matches the individuals in cpas, which have been filled in, one 
+     group at a time.
+   */
+
+  template < class Members, class Cpas >
+  void match_cpas(MatchContext &context, const Members &members, Cpas &cpas)
+  {
+    for (unsigned group = 0; group < Cpa_strata::NUM_GROUPS; ++group)
+      match_group(context, members, cpas, group);
+  }
+
+  /**
+     Adds the probes made by the searches of cpas to the statistics.
+   */
+
+  template < class Cpas >
+  void count_probes(MatchContext &context, const Cpas &cpas)
+  {
+#ifdef MATCH_STATS
+    for (size_t j = 0; j < NUM_CPA; ++j) 
+      MATCH_COUNT(context, probes, cpas.probes(j));
+#else
+    (void) context;
+    (void) cpas;
+#endif
+  }
+
+  /**
+     Matches the secondary round of match_pair, if context asks for one,
+     from cpas, in which the first round has been matched. The CPAs are
+     reset, and the individuals who can't have secondary partners are 
+     taken out of them, which costs O(n log n) in the worst case, instead
+     of building them again. Only Indivs have secondary partners.
+   */
+
+  template < class Cpas >
+  void match_secondary(MatchContext &, const Compact_members &, Cpas &)
+  {
+  }
+
+  template < class Cpas >
+  void match_secondary(MatchContext &context, const Indiv_members &members,
+                       Cpas &cpas)
+  {
+    if (!context.can_pair_secondary || context.partition) return;
+    MATCH_START(context, SECONDARY_PHASE);
+    Secondary_members secondary(members);
+    vector< Cpa_slot > &slots = context.slots;
+    for (size_t j = 0; j < NUM_CPA; ++j) {
+      cpas.reset(j);
+      for (size_t i = 0; i < cpas.size(j); ++i) {
+        Indiv *ind = cpas.entry(j, i);
+        size_t position = members.position(ind);
+        if (position >= slots.size()) slots.resize(position + 1);
+        slots[position].stratum = (uint32_t) j;
+        slots[position].entry = (uint32_t) i;
+        if (!context.can_pair_secondary(ind)) cpas.remove(j, i);
+      }
+    }
+    match_cpas(context, secondary, cpas);
+  }
+
+  /**
+     Shuffles the n entries with these values and weights together.
+   */
+
+  void shuffle_entries(void *values[], double weights[], const size_t n)
+  {
+    for (size_t i = 1; i < n; ++i) {
+      size_t j = (size_t) rand_uint64_to_open(i + 1);
+      swap(values[i], values[j]);
+      swap(weights[i], weights[j]);
+    }
+  }
+
+  /**
+     Counting sort of the eligible members of population whose indices
+     are in indices by CPA, into context.bucket_values and 
+     context.bucket_weights, where the members of CPA j start at
+     context.bucket_offsets[j]. The population is read twice in the 
+     order of indices, and the members of each CPA are then shuffled.
+     Sets cpa_sizes.
+   */
+
+  template < class Members, class Index >
+  void sort_members(const Members &members, const vector< Index > &indices,
+                    MatchContext &context, unsigned cpa_sizes[])
+  {
+    vector< uint16_t > &strata = context.strata;
+    strata.resize(indices.size());
+    for(size_t j = 0; j < indices.size(); ++j) {
+      typename Members::Member i = members.at(indices[j]);
+      if( members.set_eligible(i) ) {
+        strata[j] = (uint16_t) members.cpa_index(i);
+        ++cpa_sizes[ strata[j] ];
+        MATCH_COUNT(context, individuals, 1);
+      } else {
+        strata[j] = NUM_CPA;
+      }
+    }
+
+    size_t next[NUM_CPA], size = 0;
+    for(size_t j = 0; j < NUM_CPA; ++j) {
+      context.bucket_offsets[j] = next[j] = size;
+      size += cpa_sizes[j];
+    }
+    context.bucket_values.resize(size);
+    context.bucket_weights.resize(size);
+    void **values = size ? &context.bucket_values[0] : NULL;
+    double *weights = size ? &context.bucket_weights[0] : NULL;
+    for(size_t j = 0; j < indices.size(); ++j) {
+      if (strata[j] == NUM_CPA) continue;
+      typename Members::Member i = members.at(indices[j]);
+      size_t k = next[strata[j]]++;
+      values[k] = members.value(i);
+      weights[k] = members.weight(i);
+    }
+
+    MATCH_START(context, SHUFFLE_PHASE);
+    for(size_t j = 0; j < NUM_CPA; ++j)
+      shuffle_entries(values + context.bucket_offsets[j], 
+                      weights + context.bucket_offsets[j], cpa_sizes[j]);
+  }
+
+  /**
+     Matches the members of population whose indices are in indices, 
+     which is shuffled unless context.counting_sort is set.
+   */
+
+  template < class Members, class Index >
+  void match_members(const Members &members, vector< Index > &indices,
+                     MatchContext &context)
+  {
+    MATCH_COUNT(context, calls, 1);
+    unsigned cpa_sizes[NUM_CPA] = {0};
+    if (context.counting_sort) {
+      MATCH_START(context, BUCKET_PHASE);
+      sort_members(members, indices, context, cpa_sizes);
+    } else {
+      // Initialize cumulative probability arrays 
+      // Shuffle indices into population of individuals array
+      MATCH_START(context, SHUFFLE_PHASE);
+      random_shuffle(indices.begin(), indices.end(), rand_int_to_open);
+
+      // Set the CPA sizes and initialize the CPAs
+      MATCH_START(context, BUCKET_PHASE);
+      for(size_t j = 0; j < indices.size(); ++j) {
+        typename Members::Member i = members.at(indices[j]);
+        if( members.set_eligible(i) ) {
+          ++cpa_sizes[ members.cpa_index(i) ];
+          MATCH_COUNT(context, individuals, 1);
+        }
+      }
+    }
+
+    MATCH_START(context, BUILD_PHASE);
+
+    if (context.cpa_mode == CPA_INTEGER) {
+      Integer_cpas< Members > cpas = {context.integer_cpa, 
+                                      context.integer_cpa_iterator, &members};
+      for(size_t j = 0; j < NUM_CPA; ++j) {
+        cpas.cpa[j].clear();
+        cpas.cpa[j].reserve(cpa_sizes[j]);
+        cpas.iterator[j] = Integer_cpa::Iterator();
+      }
+      if (context.counting_sort) {
+        for(size_t j = 0; j < NUM_CPA; ++j)
+          for(size_t k = context.bucket_offsets[j]; 
+              k < context.bucket_offsets[j] + cpa_sizes[j]; ++k) {
+            size_t position = 
+              members.position(members.member(context.bucket_values[k]));
+            assert(position < Integer_cpa::npos);
+            cpas.cpa[j].append((uint32_t) position, 
+                               (uint64_t) context.bucket_weights[k]);
+          }
+      } else {
+        for(size_t i = 0; i != indices.size(); ++i) {
+          typename Members::Member ind = members.at(indices[i]);
+          if (members.eligible(ind)) {
+            assert(indices[i] < Integer_cpa::npos);
+            cpas.cpa[members.cpa_index(ind)].
+              append((uint32_t) indices[i], members.weight(ind));
+          }
+        }
+      }
+      MATCH_START(context, MATCH_PHASE);
+      match_cpas(context, members, cpas);
+      match_secondary(context, members, cpas);
+      MATCH_STOP(context);
+      count_probes(context, cpas);
+      return;
+    }
+
+    char *index_storage = init_cpas(context, cpa_sizes);
+    Cpa *cpa[NUM_CPA];
+    for(size_t j = 0; j < NUM_CPA; ++j) cpa[j] = &context.cpa[j];
+
+    // Assign each eligible individual to one of the CPAs. 
+    if (context.counting_sort) {
+      for(size_t j = 0; j < NUM_CPA; ++j)
+        if (cpa_sizes[j])
+          cpa_append_weights(cpa[j], 
+                             &context.bucket_values[context.bucket_offsets[j]],
+                             &context.bucket_weights[context.bucket_offsets[j]],
+                             cpa_sizes[j]);
+    } else {
+      for(size_t i = 0; i != indices.size(); ++i) {
+        typename Members::Member ind = members.at(indices[i]);
+        if (members.eligible(ind)) {
+          cpa_append(cpa[members.cpa_index(ind)], members.value(ind), 
+                     members.weight(ind));
+        }
+      }
+    }
+    // Without an index (e.g. in CPA_FENWICK mode) the CPA is searched as is
+    for(size_t j = 0; j < NUM_CPA; ++j)
+      if (cpa[j]->size >= INDEX_SIZE) {
+        cpa_build_index_at(cpa[j], index_storage);
+        index_storage += cpa_index_storage_size(cpa[j]->size);
+      }
+
+    Double_cpas< Members > cpas = {cpa, context.cpa_iterator, &members};
+    MATCH_START(context, MATCH_PHASE);
+    match_cpas(context, members, cpas);
+    match_secondary(context, members, cpas);
+    MATCH_STOP(context);
+    count_probes(context, cpas);
+  }
+
+  void match_pair(vector<Indiv> &population, MatchContext &context,
+                  bool (can_pair)(const Indiv*),
+                  unsigned (select_age_group) 
+                  (const Age_groups, const Indiv*), 
+                  unsigned (generate_weight)(const Indiv*))
+  {
+    match_pair(population.empty() ? NULL : &population[0], population.size(),
+               context, can_pair, select_age_group, generate_weight);
+  }
+
+  void match_pair(Indiv population[], size_t size, MatchContext &context,
+                  bool (can_pair)(const Indiv*),
+                  unsigned (select_age_group) 
+                  (const Age_groups, const Indiv*), 
+                  unsigned (generate_weight)(const Indiv*))
+  {
+    Indiv_members members = {population, can_pair, select_age_group,
+                             generate_weight, context.group};
+    vector< size_t > &indices = context.indices;
+    indices.resize(size);
+    for(size_t i = 0; i < size; ++i) indices[i] = i;
+    match_members(members, indices, context);
+  }
+
+  void match_pair(CompactPopulation &population, MatchContext &context,
+                  bool (can_pair)(const CompactPopulation&, uint32_t),
+                  unsigned (select_age_group) 
+                  (const Age_groups, const CompactPopulation&, uint32_t),
+                  unsigned (generate_weight)
+                  (const CompactPopulation&, uint32_t))
+  {
+    Compact_members members = {&population, can_pair, select_age_group,
+                               generate_weight, context.compact_group};
+    vector< uint32_t > &positions = context.positions;
+    positions.resize(population.size());
+    for(uint32_t i = 0; i < population.size(); ++i) positions[i] = i;
+    match_members(members, positions, context);
+  }
+
+  /**
+     Work shared by the threads of match_pair_partitioned. Each thread 
+     takes the next partition that no thread has taken until there are 
+     none left.
+   */
+
+  struct partition_work_s {
+    Indiv *population;
+    PartitionContext *context;
+    unsigned num_partitions;
+    unsigned next_partition;
+    uint32_t seed;
+    bool (*can_pair)(const Indiv*);
+    unsigned (*select_age_group)(const Age_groups, const Indiv*);
+    unsigned (*generate_weight)(const Indiv*);
+  };
+
+  typedef struct partition_work_s Partition_work;
+
+  struct partition_thread_s {
+    Partition_work *work;
+    MatchContext *context;
+  };
+
+  typedef struct partition_thread_s Partition_thread;
+
+  void *match_partitions(void *arg)
+  {
+    Partition_thread *thread = (Partition_thread *) arg;
+    Partition_work *work = thread->work;
+    unsigned p;
+    while ((p = __sync_fetch_and_add(&work->next_partition, 1)) < 
+           work->num_partitions) {
+      TRandomPhilox gen(work->seed, p);
+      ThreadRandStream use(gen);
+      Indiv_members members = {work->population, work->can_pair, 
+                               work->select_age_group, 
+                               work->generate_weight, 
+                               thread->context->group};
+      thread->context->partition_id = p;
+      match_members(members, work->context->members[p], *thread->context);
+    }
+    return NULL;
+  }
+
+  void match_pair_partitioned(vector<Indiv> &population, 
+                              PartitionContext &context,
+                              unsigned (partition)(const Indiv*),
+                              unsigned num_partitions, uint32_t seed,
+                              bool (can_pair)(const Indiv*),
+                              unsigned (select_age_group) 
+                              (const Age_groups, const Indiv*), 
+                              unsigned (generate_weight)(const Indiv*))
+  {
+    match_pair_partitioned(population.empty() ? NULL : &population[0], 
+                           population.size(), context, partition, 
+                           num_partitions, seed, can_pair, select_age_group,
+                           generate_weight);
+  }
+
+  void match_pair_partitioned(Indiv population[], size_t size,
+                              PartitionContext &context,
+                              unsigned (partition)(const Indiv*),
+                              unsigned num_partitions, uint32_t seed,
+                              bool (can_pair)(const Indiv*),
+                              unsigned (select_age_group) 
+                              (const Age_groups, const Indiv*), 
+                              unsigned (generate_weight)(const Indiv*))
+  {
+    vector< vector< size_t > > &members = context.members;
+    members.resize(num_partitions);
+    for (unsigned p = 0; p < num_partitions; ++p) members[p].clear();
+    for (size_t i = 0; i < size; ++i) {
+      assert(partition(&population[i]) < num_partitions);
+      members[partition(&population[i])].push_back(i);
+    }
+
+    Partition_work work = {population, &context, num_partitions, 0, seed,
+                           can_pair, select_age_group, generate_weight};
+    size_t num_threads = min(context.contexts.size(), (size_t) num_partitions);
+    vector< Partition_thread > threads(num_threads);
+    vector< pthread_t > ids(num_threads);
+    vector< bool > started(num_threads, false);
+    for (size_t t = 0; t < num_threads; ++t) {
+      threads[t].work = &work;
+      threads[t].context = context.contexts[t];
+      threads[t].context->partition = partition;
+      threads[t].context->unpartner_later.clear();
+    }
+    // The calling thread is the first one. If a thread can't be started
+    // the others take its share.
+    for (size_t t = 1; t < num_threads; ++t)
+      started[t] = 
+        pthread_create(&ids[t], NULL, match_partitions, &threads[t]) == 0;
+    if (num_threads) match_partitions(&threads[0]);
+    for (size_t t = 1; t < num_threads; ++t)
+      if (started[t]) pthread_join(ids[t], NULL);
+
+    for (size_t t = 0; t < num_threads; ++t) {
+      MatchContext *c = threads[t].context;
+      for (size_t k = 0; k < c->unpartner_later.size(); ++k)
+        if (c->unpartner_later[k].first->partner == 
+            c->unpartner_later[k].second)
+          c->unpartner_later[k].first->partner = NULL;
+      c->partition = NULL;
+    }
+  }
+
+  /**
+     The CPAs of an IncrementalMatch, whose values are the positions of 
+     the individuals plus 1. The size of a CPA is the number of entries 
+     that haven't been found, and cpa_iterate isn't used, because 
+     entries are appended after others have been found.
+   */
+
+  template < class Members >
+  struct Incremental_cpas {
+    Cpa **cpa;
+    size_t *next;
+    const Members *members;
+
+    size_t probes(size_t j) const { return cpa[j] ? cpa[j]->num_probes : 0; }
+    bool all_found(size_t j) const { return !cpa[j] || cpa_all_found(cpa[j]); }
+    uint64_t cumulative_weight(size_t j) const { 
+      return (uint64_t) cpa[j]->cumulative_weight; 
+    }
+    typename Members::Member iterate(size_t j) { 
+      while (cpa_is_found(cpa[j], next[j])) ++next[j];
+      cpa_remove(cpa[j], next[j]);
+      return members->at((uintptr_t) cpa_data(cpa[j], next[j]++) - 1);
+    }
+    typename Members::Member search(size_t j, uint64_t key) { 
+      void *value = cpa_search(cpa[j], (double) key);
+      assert(value);
+      return members->at((uintptr_t) value - 1);
+    }
+    void reinsert(size_t j, size_t i) { 
+      cpa_reinsert(cpa[j], i, cpa_weight(cpa[j], i)); 
+    }
+  };
+
+  IncrementalMatch::IncrementalMatch() : context(CPA_FENWICK)
+  {
+    for (size_t j = 0; j < NUM_CPA; ++j) {
+      cpa[j] = NULL;
+      next[j] = 0;
+    }
+  }
+
+  IncrementalMatch::~IncrementalMatch()
+  {
+    clear();
+  }
+
+  void IncrementalMatch::clear()
+  {
+    for (size_t j = 0; j < NUM_CPA; ++j) {
+      if (cpa[j]) cpa_free(cpa[j]);
+      cpa[j] = NULL;
+      next[j] = 0;
+    }
+    slots.clear();
+  }
+
+  size_t IncrementalMatch::size() const
+  {
+    size_t total = 0;
+    for (size_t j = 0; j < NUM_CPA; ++j)
+      if (cpa[j]) total += cpa[j]->size - cpa[j]->num_found;
+    return total;
+  }
+
+  bool IncrementalMatch::is_available(size_t position) const
+  {
+    if (position >= slots.size() || slots[position].stratum >= NUM_CPA)
+      return false;
+    const Cpa *c = cpa[slots[position].stratum];
+    size_t entry = slots[position].entry;
+    // The slot is out of date if the individual was found and its entry
+    // has since been given to another
+    return c && entry < c->size && !cpa_is_found(c, entry) &&
+      (uintptr_t) cpa_data(c, entry) == position + 1;
+  }
+
+  /**
+     Makes a new CPA of the entries of CPA j that haven't been found, once
+     more than half of them have been, so that the found entries take 
+     O(1) amortised time each to get rid of.
+   */
+
+  void IncrementalMatch::compact(size_t j)
+  {
+    Cpa *old = cpa[j];
+    vector< void* > values;
+    vector< double > weights;
+    if (!old || old->num_found * 2 <= old->size) return;
+    values.reserve(old->size - old->num_found);
+    weights.reserve(old->size - old->num_found);
+    for (size_t i = 0; i < old->size; ++i)
+      if (!cpa_is_found(old, i)) {
+        void *value = cpa_data(old, i);
+        slots[(uintptr_t) value - 1].entry = (uint32_t) values.size();
+        values.push_back(value);
+        weights.push_back(cpa_weight(old, i));
+      }
+    cpa_free(old);
+    cpa[j] = values.empty() ? NULL : 
+      cpa_new_weights(values.size(), &values[0], &weights[0], CPA_FENWICK);
+    next[j] = 0;
+  }
+
+  template < class Members >
+  void IncrementalMatch::add_members(const Members &members, 
+                                     const size_t positions[], size_t n)
+  {
+    Cpa_slot none = {(uint32_t) NUM_CPA, 0};
+    order.assign(positions, positions + n);
+    random_shuffle(order.begin(), order.end(), rand_int_to_open);
+    for (size_t k = 0; k < n; ++k) {
+      size_t position = order[k];
+      if (is_available(position)) continue;
+      typename Members::Member m = members.at(position);
+      size_t j = members.cpa_index(m);
+      void *value = (void *) ((uintptr_t) position + 1);
+      double weight = members.weight(m);
+      if (cpa[j]) {
+        cpa_append(cpa[j], value, weight);
+      } else {
+        cpa[j] = cpa_new_weights(1, &value, &weight, CPA_FENWICK);
+        next[j] = 0;
+      }
+      assert(!cpa[j]->error && cpa[j]->size <= 0xFFFFFFFFu);
+      if (position >= slots.size()) slots.resize(position + 1, none);
+      slots[position].stratum = (uint32_t) j;
+      slots[position].entry = (uint32_t) (cpa[j]->size - 1);
+    }
+  }
+
+  template < class Members >
+  void IncrementalMatch::match_members(const Members &members)
+  {
+    Incremental_cpas< Members > cpas = {cpa, next, &members};
+    MATCH_COUNT(context, calls, 1);
+    for (size_t j = 0; j < NUM_CPA; ++j) 
+      if (cpa[j]) cpa[j]->num_probes = 0;
+    MATCH_START(context, MATCH_PHASE);
+    match_cpas(context, members, cpas);
+    MATCH_STOP(context);
+    count_probes(context, cpas);
+    for (size_t j = 0; j < NUM_CPA; ++j) compact(j);
+  }
+
+  void IncrementalMatch::add(Indiv population[], const size_t positions[],
+                             size_t n, 
+                             unsigned (generate_weight)(const Indiv*))
+  {
+    Indiv_members members = {population, NULL, NULL, generate_weight,
+                             context.group};
+    add_members(members, positions, n);
+  }
+
+  void IncrementalMatch::add(CompactPopulation &population, 
+                             const size_t positions[], size_t n, 
+                             unsigned (generate_weight)
+                             (const CompactPopulation&, uint32_t))
+  {
+    Compact_members members = {&population, NULL, NULL, generate_weight,
+                               context.compact_group};
+    add_members(members, positions, n);
+  }
+
+  void IncrementalMatch::remove(const size_t positions[], size_t n)
+  {
+    for (size_t k = 0; k < n; ++k)
+      if (is_available(positions[k]))
+        cpa_remove(cpa[slots[positions[k]].stratum], 
+                   slots[positions[k]].entry);
+    for (size_t j = 0; j < NUM_CPA; ++j) compact(j);
+  }
+
+  void IncrementalMatch::match(Indiv population[],
+                               unsigned (select_age_group) 
+                               (const Age_groups, const Indiv*))
+  {
+    Indiv_members members = {population, NULL, select_age_group, NULL,
+                             context.group};
+    match_members(members);
+  }
+
+  void IncrementalMatch::match(CompactPopulation &population,
+                               unsigned (select_age_group) 
+                               (const Age_groups, const CompactPopulation&,
+                                uint32_t))
+  {
+    Compact_members members = {&population, NULL, select_age_group, NULL,
+                               context.compact_group};
+    match_members(members);
   }
 
 } // namespace
@@ -13,31 +13,146 @@
 #ifndef MATCH_PAIR_H
 #define MATCH_PAIR_H
 
+#include <assert.h>
 #include <stdlib.h>
+#include <utility>
 #include <vector>
 
-#include "randomc.h"
+#include "philox.h"
+#include "cpa.h"
+#include "cpa_sampler.h"
+#include "match_stats.h"
 
 using namespace std;
 
 namespace mp {
 
+  /** Dimensions of the strata, as a list: a dimension with N values 
+      followed by the dimensions Next, ending with No_dimensions. E.g. 
+      with 9 regions and 3 behaviour classes
+
+        Dimensions< 9, Dimensions< 3 > >
+
+      Their values are numbered with the first dimension the most 
+      significant, and index works out the number from the value of each
+      one, at compile time but for the values.
+   */
+
+  struct No_dimensions {
+    static const size_t SIZE = 1;
+    static const unsigned COUNT = 0;
+    static size_t index(const unsigned []) { return 0; }
+  };
+
+  template < size_t N, class Next = No_dimensions >
+  struct Dimensions {
+    static const size_t SIZE = N * Next::SIZE;
+    static const unsigned COUNT = 1 + Next::COUNT;
+
+    /** Number of values, which has COUNT values, one per dimension. */
+    static size_t index(const unsigned values[]) {
+      return values[0] * Next::SIZE + Next::index(values + 1);
+    }
+  };
+
+  /** Strata of the cumulative probability arrays, each of which holds 
+      the individuals of one group, sex, risk group and age group. The 
+      groups are the values of the dimensions Groups, e.g. regions, and
+      individuals are only matched with others in their group. The 
+      individuals in the highest risk group are the ones who are 
+      matched, with partners from the highest risk group of the other 
+      sex that has anyone left.
+
+      A stratum is indexed as follows: 
+      ((group * 2 + sex) * RISK_GROUPS + risk) * AGE_GROUPS + age_group.
+      The sizes are constants, so working this out only takes 
+      multiplications.
+   */
+
+  template < unsigned NUM_RISK_GROUPS, unsigned NUM_AGE_GROUPS, 
+             class Groups = No_dimensions >
+  struct Strata {
+    typedef Groups Group_dimensions;
+    static const unsigned RISK_GROUPS = NUM_RISK_GROUPS;
+    static const unsigned AGE_GROUPS = NUM_AGE_GROUPS;
+    static const size_t NUM_GROUPS = Groups::SIZE;
+    static const size_t GROUP_SIZE = 2 * RISK_GROUPS * AGE_GROUPS;
+    static const size_t SIZE = NUM_GROUPS * GROUP_SIZE;
+
+    static size_t index(const size_t group, const size_t sex, 
+                        const size_t risk, const size_t age) {
+      return ((group * 2 + sex) * RISK_GROUPS + risk) * AGE_GROUPS + age;
+    }
+  };
+
+  /** The strata that match_pair uses. There are 2 risk groups and at 
+      most 24 5-year age groups, and no groups. To add a dimension, e.g.
+      regions, change this to 
+
+        typedef Strata< 2, 24, Dimensions< 9 > > Cpa_strata;
+
+      or compile with -D'MATCH_STRATA=Strata< 2, 24, Dimensions< 9 > >',
+      and set the group function of the MatchContext.
+   */
+#ifdef MATCH_STRATA
+  typedef MATCH_STRATA Cpa_strata;
+#else
+  typedef Strata< 2, 24 > Cpa_strata;
+#endif
+
   /** Maximum number of cumulative probability arrays. 
 
-      There are 2 sexes and 2 risk groups. There are at most 24 5-year age 
-      groups. 
-      2 * 2 * 24 = 96, so we need no more than 96 cumulative probability arrays.
-      These are indexed as follows: sex * 96/2 + risk * 96/4 + age_group.
+      With 2 sexes, 2 risk groups and 24 age groups, there are 
+      2 * 2 * 24 = 96 cumulative probability arrays.
       E.g. If sex = female (1) and risk = high (1) and age_group = 4 (20-24), then
-      index = 0 * 48 + 1 * 24 + 4 = 28.
+      index = (1 * 2 + 1) * 24 + 4 = 76.
    */
-  static const size_t NUM_CPA = 96;
+  static const size_t NUM_CPA = Cpa_strata::SIZE;
+  // CPAs at least this big get an Eytzinger index, because their nodes 
+  // no longer fit in a 2MB L2 cache
+  static const size_t INDEX_SIZE = 65536;
 
   static const unsigned MALE = 0;
   static const unsigned FEMALE = 1;
-  static const unsigned HIGHEST_AGE_GROUP = 24;
+  static const unsigned HIGHEST_AGE_GROUP = Cpa_strata::AGE_GROUPS;
+  static const unsigned NUM_RISK_GROUPS = Cpa_strata::RISK_GROUPS;
   static const unsigned LOW = 0;
-  static const unsigned HIGH = 1;
+  static const unsigned HIGH = NUM_RISK_GROUPS - 1;
+
+  /** cpa_mode in which match_pair keeps the weights as exact integers,
+      with 64 bit cumulative weights, in an Integer_cpa instead of a Cpa.
+      The other modes are the storage modes of cpa.h, which keep them as
+      doubles.
+   */
+  static const int CPA_INTEGER = 3;
+
+  /** Returns whether cpa_mode is one that a MatchContext can have:
+      CPA_AOS, CPA_SOA, CPA_FENWICK or CPA_INTEGER. */
+  inline bool valid_cpa_mode(int cpa_mode)
+  {
+    return cpa_mode == CPA_AOS || cpa_mode == CPA_SOA || 
+      cpa_mode == CPA_FENWICK || cpa_mode == CPA_INTEGER;
+  }
+
+  /** Set of age groups, with bit i on if age group i is in the set. 
+      HIGHEST_AGE_GROUP must not be more than the number of bits.
+   */
+  typedef uint32_t Age_groups;
+  static const unsigned AGE_GROUPS_BITS = 32;
+  typedef char Age_groups_fit[HIGHEST_AGE_GROUP <= AGE_GROUPS_BITS ? 1 : -1];
+  // The strata of the individuals are kept as 16 bit numbers
+  typedef char Strata_fit[NUM_CPA < 0xFFFF ? 1 : -1];
+
+  /** Number of bits needed for the numbers up to N, at compile time */
+  template < unsigned N >
+  struct Bits {
+    static const unsigned VALUE = 1 + Bits< N / 2 >::VALUE;
+  };
+
+  template <>
+  struct Bits< 0 > {
+    static const unsigned VALUE = 0;
+  };
 
 
   /** This is a much simplified version of Leigh's Indiv. Integration 
@@ -57,27 +172,139 @@ namespace mp {
 
   typedef struct indiv_s Indiv;
 
-  // Seed to the Mersenne Twister is arbitrarily chosen.
-  static TRandomMersenne randGen(31279);
+  /** Population stored compactly, for populations too big for Indivs:
+      6 bytes an individual instead of the 40 of an Indiv. It is stored
+      by columns, so that bucketing reads only the byte of attributes of
+      each individual. An individual is referred to by its position, and
+      its partner is the position of the partner, or NO_PARTNER. There
+      must be fewer than NO_PARTNER individuals and ages must be less 
+      than 256. The widths of the risk and age groups in the byte of
+      attributes are those of Cpa_strata, which fails to compile if they
+      don't fit. The group of an individual isn't stored; it is worked
+      out by the compact_group function of the MatchContext.
+   */
+
+  class CompactPopulation {
+  public:
+    static const uint32_t NO_PARTNER = 0xFFFFFFFF;
+    static const unsigned RISK_BITS = 
+      Bits< Cpa_strata::RISK_GROUPS - 1 >::VALUE;
+    static const unsigned AGE_GROUP_BITS = 
+      Bits< Cpa_strata::AGE_GROUPS - 1 >::VALUE;
+    static const unsigned AGE_GROUP_SHIFT = 1 + RISK_BITS;
+    // The sex, risk and age groups must leave bit 7 for the eligible bit
+    typedef char Attributes_fit[AGE_GROUP_SHIFT + AGE_GROUP_BITS <= 7 ? 
+                                1 : -1];
+
+    CompactPopulation(size_t size = 0) { resize(size); }
+
+    /** Sets the size. New individuals have no partner, and their 
+        attributes are 0 until they are set.
+     */
+    void resize(size_t size);
+
+    /** Makes it a copy of the size individuals in population, with 
+        their partners, which must be in population.
+     */
+    void assign(const Indiv population[], size_t size);
+
+    size_t size() const { return partners.size(); }
+
+    void set(uint32_t i, unsigned sex, unsigned age, unsigned age_group,
+             unsigned risk_group) {
+      assert(sex <= 1 && risk_group < Cpa_strata::RISK_GROUPS && 
+             age <= 0xFF && age_group < Cpa_strata::AGE_GROUPS);
+      attributes[i] = (uint8_t) 
+        (sex | risk_group << 1 | age_group << AGE_GROUP_SHIFT);
+      ages[i] = (uint8_t) age;
+    }
+
+    unsigned sex(uint32_t i) const { return attributes[i] & 1; }
+    unsigned risk_group(uint32_t i) const { 
+      return attributes[i] >> 1 & ((1u << RISK_BITS) - 1); 
+    }
+    unsigned age_group(uint32_t i) const { 
+      return attributes[i] >> AGE_GROUP_SHIFT & ((1u << AGE_GROUP_BITS) - 1);
+    }
+    unsigned age(uint32_t i) const { return ages[i]; }
+    bool eligible(uint32_t i) const { return attributes[i] >> 7; }
+    uint32_t partner(uint32_t i) const { return partners[i]; }
+
+    // Bit 0 is the sex, the RISK_BITS from bit 1 the risk group, the 
+    // AGE_GROUP_BITS from AGE_GROUP_SHIFT the age group, and bit 7 is on
+    // if the individual was eligible the last time match_pair was 
+    // called. With the default Cpa_strata they are bit 1 and bits 2 to 6.
+    vector< uint8_t > attributes;
+    vector< uint8_t > ages;
+    vector< uint32_t > partners;
+  };
+
+  // Values are the positions of the individuals in the population
+  typedef cpa::Sampler< uint32_t, uint64_t > Integer_cpa;
+
+  /** Generator used by the random number functions below on threads 
+      that haven't been given their own with a ThreadRandStream. It is
+      stream 0 of seed 31279, which is arbitrarily chosen. There is one 
+      for the whole program.
+   */
+  extern TRandomPhilox rand_gen_default;
 
-  /** Random number convenience functions.
+  /** Generator used by the random number functions below on this 
+      thread, or NULL to use rand_gen_default.
+   */
+  extern __thread TRandomPhilox *thread_rand_gen;
+
+  inline TRandomPhilox &rand_gen() {
+    return thread_rand_gen ? *thread_rand_gen : rand_gen_default;
+  }
+
+  /** Makes the random number functions below draw from gen on the 
+      thread that makes it, until it is destroyed. E.g. a thread running
+      replicate r can use its own stream with
+
+        TRandomPhilox gen(seed, r);
+        ThreadRandStream use(gen);
+   */
+
+  class ThreadRandStream {
+  public:
+    ThreadRandStream(TRandomPhilox &gen) : previous(thread_rand_gen) {
+      thread_rand_gen = &gen;
+    }
+    ~ThreadRandStream() {
+      thread_rand_gen = previous;
+    }
+
+  private:
+    TRandomPhilox *previous;
+    ThreadRandStream(const ThreadRandStream &);
+    ThreadRandStream &operator=(const ThreadRandStream &);
+  };
+
+  /** Random number convenience functions. The integers are drawn with
+      TRandomPhilox::Bounded, so every one in the range is equally likely.
    */
 
   inline int rand_int_range(int from, int to)  { 
-    return randGen.IRandom(from, to);
+    if (to < from) return rand_gen().IRandom(from, to);
+    return from + (int) rand_gen().Bounded((uint32_t) (to - from) + 1);
   }
 
   inline int rand_int_range_open(int from, int to)
   {
-    return randGen.IRandom(from, to - 1);
+    return rand_int_range(from, to - 1);
   }
 
   inline int rand_int_to(int to) { 
-    return randGen.IRandom(0, to);
+    return rand_int_range(0, to);
   }
 
   inline int rand_int_to_open(int to) { 
-    return randGen.IRandom(0, to - 1);
+    return rand_int_range(0, to - 1);
+  }
+
+  inline uint64_t rand_uint64_to_open(uint64_t to) { 
+    return rand_gen().Bounded64(to);
   }
 
 
@@ -89,7 +316,14 @@ namespace mp {
   */
   inline size_t index(const size_t sex, const size_t risk, const size_t age) 
   {
-    return sex * (NUM_CPA / 2) + risk * (NUM_CPA / 4) + age;
+    return Cpa_strata::index(0, sex, risk, age);
+  }
+
+  /** Same as above, for an individual in group. */
+  inline size_t index(const size_t group, const size_t sex, 
+                      const size_t risk, const size_t age) 
+  {
+    return Cpa_strata::index(group, sex, risk, age);
   }
 
   /** Place holder function to determine if an individual can pair.
@@ -97,13 +331,24 @@ namespace mp {
       pass it as a parameter to pair_match.
    */
   bool can_pair_default(const Indiv *indiv);
+  bool can_pair_default(const CompactPopulation &population, uint32_t i);
+
+  /** Returns the age group in age_groups closest to key. If two are 
+      equally close, either is returned with equal probability. 
+      age_groups must not be empty. O(1).
+   */
+  unsigned search_age_groups(const Age_groups age_groups, const unsigned key);
 
   /** Place holder function to determine the age group to match to.
       Leigh will have to write a more sophisticated version and 
-      pass it as a parameter to pair_match.
+      pass it as a parameter to pair_match. It must return one of the
+      age groups in age_groups, which is never empty.
    */
-  unsigned select_age_group_default(const vector< unsigned > age_group, 
+  unsigned select_age_group_default(const Age_groups age_groups, 
                                     const Indiv *ind);
+  unsigned select_age_group_default(const Age_groups age_groups, 
+                                    const CompactPopulation &population,
+                                    uint32_t i);
 
   /** Place holder function to determine the weight of an Individual.
       Leigh will have to write a more sophisticated version and 
@@ -116,9 +361,194 @@ namespace mp {
       individuals in it that have not been matched.
    */
   unsigned generate_weight_default(const Indiv *ind);
+  unsigned generate_weight_default(const CompactPopulation &population,
+                                   uint32_t i);
+
+  /** Where an individual was put in the CPAs: entry entry of the CPA
+      with index stratum.
+   */
+
+  struct cpa_slot_s {
+    uint32_t stratum;
+    uint32_t entry;
+  };
+
+  typedef struct cpa_slot_s Cpa_slot;
+
+  /** Memory used by match_pair, kept between calls so that calling it 
+      again on a population that isn't bigger allocates nothing. The CPAs 
+      and their indices share one arena, which grows to the most that any
+      call has needed. The Integer_cpas of CPA_INTEGER mode keep their own
+      memory, which also only grows.
+   */
+
+  class MatchContext {
+  public:
+    MatchContext(int cpa_mode = CPA_AOS);
+
+    int cpa_mode;
+    Cpa cpa[NUM_CPA];
+    Cpa_iterator cpa_iterator[NUM_CPA];
+    Integer_cpa integer_cpa[NUM_CPA];    // CPA_INTEGER mode only
+    Integer_cpa::Iterator integer_cpa_iterator[NUM_CPA];
+    vector< char > arena;
+    vector< size_t > indices;
+    vector< uint32_t > positions;        // CompactPopulation only
+
+    // If set, match_pair doesn't shuffle the whole population and then
+    // bucket it by CPA. Instead it sorts the eligible individuals by CPA
+    // with a counting sort into the bucket vectors, which are laid out 
+    // like a CSR matrix, with the entries of CPA j from bucket_offsets[j]
+    // on, and shuffles each CPA's entries. The population is then read
+    // in order instead of in a random order, and the CPAs are filled 
+    // from contiguous runs by cpa_append_weights. The partners are drawn
+    // from the same distribution, but with different random numbers.
+    bool counting_sort;
+    vector< uint16_t > strata;
+    vector< void* > bucket_values;
+    vector< double > bucket_weights;
+    size_t bucket_offsets[NUM_CPA];
+
+    // Statistics that match_pair adds to if it is compiled with 
+    // MATCH_STATS defined (see match_stats.h), or NULL. Each thread of 
+    // match_pair_partitioned needs its own.
+    MatchStats *stats;
+
+    // If set, match_pair matches a secondary round after the first one,
+    // from the same CPAs, in which the eligible individuals for whom 
+    // can_pair_secondary returns true are given secondary partners. It
+    // is matched in the same way, but no one is matched with their 
+    // partner, and the secondary_partner fields are set, an old 
+    // secondary partner being unpartnered. NULL, the default, matches 
+    // only the first round. Only match_pair on Indivs does this, not 
+    // match_pair_partitioned.
+    bool (*can_pair_secondary)(const Indiv*);
+    vector< Cpa_slot > slots;           // Of each individual, in the 
+                                        // secondary round
+
+    // Returns the group of an individual in Cpa_strata, which must be 
+    // less than Cpa_strata::NUM_GROUPS, e.g. worked out with 
+    // Cpa_strata::Group_dimensions::index. NULL, the default, puts 
+    // everyone in group 0. compact_group is the same for the 
+    // individuals of a CompactPopulation.
+    unsigned (*group)(const Indiv*);
+    unsigned (*compact_group)(const CompactPopulation&, uint32_t);
+
+    // Set by match_pair_partitioned. An old partner in another partition
+    // is unpartnered once all the threads are done, if it is still 
+    // partnered with the individual, and the pair is kept here till then.
+    unsigned (*partition)(const Indiv*);
+    unsigned partition_id;
+    vector< pair< Indiv*, Indiv* > > unpartner_later;
+
+  private:
+    // The CPAs point into the arena, so a copy would share it
+    MatchContext(const MatchContext &);
+    MatchContext &operator=(const MatchContext &);
+  };
+
+  /** Memory used by match_pair_partitioned, kept between calls: a 
+      MatchContext for each thread and the members of each partition.
+   */
+
+  class PartitionContext {
+  public:
+    PartitionContext(unsigned num_threads, int cpa_mode = CPA_AOS);
+    ~PartitionContext();
+
+    vector< MatchContext* > contexts;
+    vector< vector< size_t > > members;
+
+  private:
+    PartitionContext(const PartitionContext &);
+    PartitionContext &operator=(const PartitionContext &);
+  };
+
+  /** Matches a population one timestep at a time, for models in which
+      only a few individuals start or end partnerships each step. The
+      individuals who are available for partners are kept in CPAs 
+      between steps, in CPA_FENWICK mode, which can be appended to after
+      entries have been found. Each step the individuals who have become
+      available are added, those who no longer are are removed, and 
+      match matches the available ones. A step takes time in proportion
+      to the number of individuals added, removed and matched, not to 
+      the size of the population.
+
+      Individuals are referred to by their positions in the population,
+      which may be moved between calls, e.g. by a vector growing, but 
+      they must keep their positions. The stratum and weight of an 
+      individual are worked out when it is added. Unlike match_pair, 
+      partnerships are never broken, because only the available 
+      individuals are matched.
+   */
+
+  class IncrementalMatch {
+  public:
+    IncrementalMatch();
+    ~IncrementalMatch();
+
+    /** Makes the n individuals at these positions in population 
+        available, in a random order. Those that already are available 
+        are left as they are.
+     */
+    void add(Indiv population[], const size_t positions[], size_t n,
+             unsigned (generate_weight)(const Indiv*) = 
+             generate_weight_default);
+    void add(CompactPopulation &population, const size_t positions[],
+             size_t n, 
+             unsigned (generate_weight)(const CompactPopulation&, uint32_t) =
+             generate_weight_default);
+
+    /** Makes the n individuals at these positions unavailable, e.g. 
+        because they have died or found partners some other way. Those 
+        that aren't available are ignored.
+     */
+    void remove(const size_t positions[], size_t n);
+
+    /** Matches the available individuals, as match_pair does, until 
+        there are no high risk ones left. Only the partners of the 
+        individuals matched are set, and they are no longer available.
+     */
+    void match(Indiv population[],
+               unsigned (select_age_group) 
+               (const Age_groups, const Indiv*) = 
+               select_age_group_default);
+    void match(CompactPopulation &population,
+               unsigned (select_age_group) 
+               (const Age_groups, const CompactPopulation&, uint32_t) = 
+               select_age_group_default);
+
+    /** Makes everyone unavailable. */
+    void clear();
+
+    /** Number of available individuals. */
+    size_t size() const;
+
+    // Only its group functions and stats are used, as by match_pair
+    MatchContext context;
+
+  private:
+    template < class Members >
+    void add_members(const Members &members, const size_t positions[], 
+                     size_t n);
+    template < class Members >
+    void match_members(const Members &members);
+    bool is_available(size_t position) const;
+    void compact(size_t j);
+
+    Cpa *cpa[NUM_CPA];          // NULL while a stratum has had no one
+    size_t next[NUM_CPA];       // Entries before it have been found
+    vector< Cpa_slot > slots;      // Of each position
+    vector< size_t > order;
+
+    IncrementalMatch(const IncrementalMatch &);
+    IncrementalMatch &operator=(const IncrementalMatch &);
+  };
 
   /** Used for debugging */
   void print_partners(const vector<Indiv> &population);
+  void print_partners(const Indiv population[], size_t size);
+  void print_partners(const CompactPopulation &population);
 
   /** This is the implementation of the main algorithm. 
       
@@ -132,15 +562,107 @@ namespace mp {
 
       generate_weight: function to determine weight of individual in 
       cumulative probability array. Defaults to generate_weight_default
+
+      cpa_mode: storage mode of the cumulative probability arrays
+      (CPA_AOS, CPA_SOA, CPA_FENWICK or CPA_INTEGER). Defaults to CPA_AOS.
    */
 
   void match_pair(vector<Indiv> &population, 
                   bool (can_pair)(const Indiv*) = can_pair_default, 
                   unsigned (select_age_group) 
-                  (const vector< unsigned >, const Indiv*) = 
+                  (const Age_groups, const Indiv*) = 
+                  select_age_group_default,
+                  unsigned (generate_weight)(const Indiv*) = 
+                  generate_weight_default,
+                  int cpa_mode = CPA_AOS);
+
+  /** Same as above, but uses the memory of context, in its cpa_mode,
+      instead of allocating it. Use this when calling match_pair many 
+      times.
+   */
+
+  void match_pair(vector<Indiv> &population, MatchContext &context,
+                  bool (can_pair)(const Indiv*) = can_pair_default, 
+                  unsigned (select_age_group) 
+                  (const Age_groups, const Indiv*) = 
                   select_age_group_default,
                   unsigned (generate_weight)(const Indiv*) = 
                   generate_weight_default);
+
+  /** Same as above, for the size individuals in population, which 
+      needn't be in a vector, e.g. those of a MappedPopulation.
+   */
+
+  void match_pair(Indiv population[], size_t size, MatchContext &context,
+                  bool (can_pair)(const Indiv*) = can_pair_default, 
+                  unsigned (select_age_group) 
+                  (const Age_groups, const Indiv*) = 
+                  select_age_group_default,
+                  unsigned (generate_weight)(const Indiv*) = 
+                  generate_weight_default);
+
+  /** Same as above, for a CompactPopulation. The functions are passed
+      the population and the position of an individual in it.
+   */
+
+  void match_pair(CompactPopulation &population, MatchContext &context,
+                  bool (can_pair)(const CompactPopulation&, uint32_t) = 
+                  can_pair_default, 
+                  unsigned (select_age_group) 
+                  (const Age_groups, const CompactPopulation&, uint32_t) = 
+                  select_age_group_default,
+                  unsigned (generate_weight)
+                  (const CompactPopulation&, uint32_t) = 
+                  generate_weight_default);
+
+  /** Same as match_pair, but individuals are only matched with others in
+      the same partition, and the partitions are matched in parallel, on
+      as many threads as context has contexts.
+
+      Input parameters:
+
+      context: memory used by the threads
+
+      partition: returns the partition of an individual, which must be 
+      less than num_partitions. Other threads may be changing the 
+      partner, secondary_partner and eligible fields, so it must not 
+      read them.
+
+      num_partitions: number of partitions
+
+      seed: each partition draws its random numbers from stream p of 
+      seed, where p is the number of the partition, so the matches don't
+      depend on the number of threads.
+
+      can_pair, select_age_group, generate_weight: as for match_pair. 
+      They are called from several threads at once.
+   */
+
+  void match_pair_partitioned(vector<Indiv> &population, 
+                              PartitionContext &context,
+                              unsigned (partition)(const Indiv*),
+                              unsigned num_partitions, uint32_t seed,
+                              bool (can_pair)(const Indiv*) = 
+                              can_pair_default, 
+                              unsigned (select_age_group) 
+                              (const Age_groups, const Indiv*) = 
+                              select_age_group_default,
+                              unsigned (generate_weight)(const Indiv*) = 
+                              generate_weight_default);
+
+  /** Same as above, for the size individuals in population. */
+
+  void match_pair_partitioned(Indiv population[], size_t size,
+                              PartitionContext &context,
+                              unsigned (partition)(const Indiv*),
+                              unsigned num_partitions, uint32_t seed,
+                              bool (can_pair)(const Indiv*) = 
+                              can_pair_default, 
+                              unsigned (select_age_group) 
+                              (const Age_groups, const Indiv*) = 
+                              select_age_group_default,
+                              unsigned (generate_weight)(const Indiv*) = 
+                              generate_weight_default);
 }
 #endif /* MATCH_PAIR_H */
 
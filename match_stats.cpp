@@ -0,0 +1,141 @@
+/*
+  (C) Nathan Geffen and Leigh Johnson 2013 under GPL version 3.0.
+  This is free software.
+  See the file called COPYING for the license.
+
+  # Definitions of the statistics of match_pair.
+
+  See match_stats.h for documentation of extern functions.
+*/
+
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__)
+#define MATCH_HAVE_PERF 1
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "match_stats.h"
+
+namespace mp {
+
+  const char *PHASE_NAMES[NUM_PHASES] = {"shuffle", "bucket", "build",
+                                         "match", "secondary"};
+
+  double stats_now_ns()
+  {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+  }
+
+#ifdef MATCH_HAVE_PERF
+  /**
+     Opens a counter of the user space events of this thread, in the
+     group led by group, or a new group if group is -1. Returns its file
+     descriptor, or -1 if it can't be opened.
+   */
+
+  int open_counter(const uint64_t config, const int group)
+  {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return (int) syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+  }
+#endif
+
+  MatchStats::MatchStats() : have_counters(false), opened(false), phase(-1)
+  {
+    fds[0] = fds[1] = fds[2] = -1;
+    clear();
+  }
+
+  MatchStats::~MatchStats()
+  {
+#ifdef MATCH_HAVE_PERF
+    for (int i = 2; i >= 0; --i) if (fds[i] >= 0) close(fds[i]);
+#endif
+  }
+
+  void MatchStats::clear()
+  {
+    memset(phases, 0, sizeof(phases));
+    calls = individuals = iterations = searches = probes = 0;
+  }
+
+  bool MatchStats::read_counters(uint64_t counts[3])
+  {
+#ifdef MATCH_HAVE_PERF
+    uint64_t group[4];  // Number of counters, then their values
+    if (have_counters &&
+        read(fds[0], group, sizeof(group)) == (ssize_t) sizeof(group)) {
+      memcpy(counts, group + 1, 3 * sizeof(uint64_t));
+      return true;
+    }
+#endif
+    counts[0] = counts[1] = counts[2] = 0;
+    return false;
+  }
+
+  void MatchStats::start(const unsigned phase)
+  {
+    stop();
+    if (!opened) {
+      opened = true;
+#ifdef MATCH_HAVE_PERF
+      fds[0] = open_counter(PERF_COUNT_HW_CPU_CYCLES, -1);
+      if (fds[0] >= 0) {
+        fds[1] = open_counter(PERF_COUNT_HW_CACHE_MISSES, fds[0]);
+        fds[2] = open_counter(PERF_COUNT_HW_BRANCH_MISSES, fds[0]);
+      }
+      have_counters = fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0;
+#endif
+    }
+    this->phase = phase;
+    read_counters(start_counts);
+    start_ns = stats_now_ns();
+  }
+
+  void MatchStats::stop()
+  {
+    uint64_t counts[3];
+    if (phase < 0) return;
+    phases[phase].ns += stats_now_ns() - start_ns;
+    if (read_counters(counts)) {
+      phases[phase].cycles += counts[0] - start_counts[0];
+      phases[phase].cache_misses += counts[1] - start_counts[1];
+      phases[phase].branch_misses += counts[2] - start_counts[2];
+    }
+    phase = -1;
+  }
+
+  void print_match_stats(const MatchStats &stats, FILE *f)
+  {
+    fprintf(f, "phase\tms\tcycles\tcache misses\tbranch misses\n");
+    for (unsigned p = 0; p < NUM_PHASES; ++p) {
+      const Phase_stats &s = stats.phases[p];
+      if (stats.have_counters)
+        fprintf(f, "%s\t%.3f\t%llu\t%llu\t%llu\n", PHASE_NAMES[p], s.ns / 1e6,
+                (unsigned long long) s.cycles,
+                (unsigned long long) s.cache_misses,
+                (unsigned long long) s.branch_misses);
+      else
+        fprintf(f, "%s\t%.3f\t-\t-\t-\n", PHASE_NAMES[p], s.ns / 1e6);
+    }
+    fprintf(f, "calls %llu individuals %llu iterations %llu searches %llu "
+            "probes/search %.2f\n", (unsigned long long) stats.calls,
+            (unsigned long long) stats.individuals,
+            (unsigned long long) stats.iterations,
+            (unsigned long long) stats.searches,
+            stats.searches ? (double) stats.probes / stats.searches : 0.0);
+  }
+}
@@ -0,0 +1,87 @@
+/**
+  (C) Nathan Geffen and Leigh Johnson 2013 under GPL version 3.0.
+  This is free software. See the file called COPYING for the license.
+
+  # Statistics of where match_pair spends its time
+
+  If match_pair.cpp is compiled with MATCH_STATS defined, match_pair
+  fills in the MatchStats that its MatchContext's stats points to, if
+  any. Otherwise the instrumentation is compiled out and stats is never
+  read. Compile cpa.c with CPA_STATS defined too to count the probes of
+  the searches. The stats target of the Makefile defines both.
+
+  Each phase records its wall time, and on Linux, where
+  perf_event_open is allowed, the CPU cycles, cache misses and branch
+  misses of the thread that ran it.
+*/
+
+#ifndef MATCH_STATS_H
+#define MATCH_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+namespace mp {
+
+  /** Phases of match_pair */
+  static const unsigned SHUFFLE_PHASE = 0;  // Shuffling the population
+  static const unsigned BUCKET_PHASE = 1;   // Counting the CPA sizes
+  static const unsigned BUILD_PHASE = 2;    // Filling the CPAs
+  static const unsigned MATCH_PHASE = 3;    // The matching loop
+  static const unsigned SECONDARY_PHASE = 4; // The secondary round
+  static const unsigned NUM_PHASES = 5;
+
+  extern const char *PHASE_NAMES[NUM_PHASES];
+
+  struct phase_stats_s {
+    double ns;
+    uint64_t cycles;          // The counters are 0 if have_counters
+    uint64_t cache_misses;    // is false
+    uint64_t branch_misses;
+  };
+
+  typedef struct phase_stats_s Phase_stats;
+
+  class MatchStats {
+  public:
+    MatchStats();
+    ~MatchStats();
+
+    /** Sets the statistics to 0 */
+    void clear();
+
+    /** Ends the phase that is running, if any, and starts phase. The
+        counters are opened the first time, on the thread that calls it,
+        which is the thread that they count.
+     */
+    void start(const unsigned phase);
+
+    /** Ends the phase that is running, if any */
+    void stop();
+
+    Phase_stats phases[NUM_PHASES];
+    uint64_t calls;          // Calls of match_pair
+    uint64_t individuals;    // Individuals that could pair
+    uint64_t iterations;     // Of the matching loop
+    uint64_t searches;       // Of the CPAs, one per match
+    uint64_t probes;         // Entries read by the searches
+    bool have_counters;      // Whether perf_event_open could be used
+
+  private:
+    bool read_counters(uint64_t counts[3]);
+
+    int fds[3];
+    bool opened;
+    int phase;               // Running phase, or -1
+    double start_ns;
+    uint64_t start_counts[3];
+
+    MatchStats(const MatchStats &);
+    MatchStats &operator=(const MatchStats &);
+  };
+
+  /** Prints stats to f, with the totals per phase and per search. */
+  void print_match_stats(const MatchStats &stats, FILE *f = stdout);
+}
+
+#endif /* MATCH_STATS_H */
@@ -0,0 +1,245 @@
+/*
+  (C) Nathan Geffen and Leigh Johnson 2013 under GPL version 3.0.
+  This is free software.
+  See the file called COPYING for the license.
+
+  # Definitions of functions for writing partnerships.
+
+  See partner_writer.h for documentation of extern functions.
+*/
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "partner_writer.h"
+
+namespace mp {
+
+  /** Most bytes that one pair takes: two 10 digit numbers, a comma and
+      a new line */
+  static const size_t MAX_PAIR_SIZE = 22;
+
+  PartnerWriter::PartnerWriter(int format, bool background,
+                               size_t buffer_size, unsigned num_buffers) :
+    format(format), background(background),
+    buffer_size(buffer_size < MAX_PAIR_SIZE ? MAX_PAIR_SIZE : buffer_size),
+    buffers(num_buffers ? num_buffers : 1),
+    lengths(num_buffers ? num_buffers : 1, 0), fill(0), used(0),
+    head(0), taken(0), queued(0), fd(-1), own_fd(false), error(0),
+    started(false), stopping(false)
+  {
+    for (size_t i = 0; i < buffers.size(); ++i)
+      buffers[i].resize(this->buffer_size);
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init(&ready, NULL);
+    pthread_cond_init(&done, NULL);
+  }
+
+  PartnerWriter::~PartnerWriter()
+  {
+    close();
+    pthread_cond_destroy(&done);
+    pthread_cond_destroy(&ready);
+    pthread_mutex_destroy(&mutex);
+  }
+
+  int PartnerWriter::open(const char *path)
+  {
+    int new_fd;
+    close();
+    new_fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (new_fd < 0) return IO_ERROR;
+    open(new_fd);
+    own_fd = true;
+    return 0;
+  }
+
+  int PartnerWriter::open(int fd)
+  {
+    close();
+    this->fd = fd;
+    own_fd = false;
+    error = 0;
+    fill = used = head = taken = queued = 0;
+    stopping = false;
+    started = background && buffers.size() > 1 &&
+      pthread_create(&thread, NULL, run, this) == 0;
+    return 0;
+  }
+
+  /**
+     Writes the buffers from first on to the file, n of them, with as
+     few calls of writev as it takes.
+   */
+
+  void PartnerWriter::write_buffers(size_t first, size_t n)
+  {
+    vector< struct iovec > iov(n);
+    size_t k = 0;
+    ssize_t written;
+    for (size_t i = 0; i < n; ++i) {
+      size_t b = (first + i) % buffers.size();
+      iov[i].iov_base = &buffers[b][0];
+      iov[i].iov_len = lengths[b];
+    }
+    while (k < n) {
+      written = writev(fd, &iov[k], (int) (n - k));
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        error = IO_ERROR;
+        return;
+      }
+      while (k < n && (size_t) written >= iov[k].iov_len) {
+        written -= iov[k].iov_len;
+        ++k;
+      }
+      if (k < n) {
+        iov[k].iov_base = (char *) iov[k].iov_base + written;
+        iov[k].iov_len -= written;
+      }
+    }
+  }
+
+  /**
+     Body of the background thread, which writes the queued buffers
+     until it is stopped.
+   */
+
+  void *PartnerWriter::run(void *arg)
+  {
+    PartnerWriter *w = (PartnerWriter *) arg;
+    size_t first;
+    pthread_mutex_lock(&w->mutex);
+    for (;;) {
+      while (!w->queued && !w->stopping)
+        pthread_cond_wait(&w->ready, &w->mutex);
+      if (!w->queued) break;
+      w->taken = w->queued;
+      w->queued = 0;
+      first = w->head;
+      pthread_mutex_unlock(&w->mutex);
+      w->write_buffers(first, w->taken);
+      pthread_mutex_lock(&w->mutex);
+      w->head = (w->head + w->taken) % w->buffers.size();
+      w->taken = 0;
+      pthread_cond_broadcast(&w->done);
+    }
+    pthread_mutex_unlock(&w->mutex);
+    return NULL;
+  }
+
+  /**
+     Passes the buffer being filled on to be written, and waits for a
+     free one if there isn't one.
+   */
+
+  void PartnerWriter::submit()
+  {
+    if (!used) return;
+    lengths[fill] = used;
+    used = 0;
+    if (!started) {
+      write_buffers(fill, 1);
+      return;
+    }
+    pthread_mutex_lock(&mutex);
+    ++queued;
+    pthread_cond_signal(&ready);
+    while (taken + queued == buffers.size())
+      pthread_cond_wait(&done, &mutex);
+    pthread_mutex_unlock(&mutex);
+    fill = (fill + 1) % buffers.size();
+  }
+
+  void PartnerWriter::wait_written()
+  {
+    if (!started) return;
+    pthread_mutex_lock(&mutex);
+    while (taken || queued) pthread_cond_wait(&done, &mutex);
+    pthread_mutex_unlock(&mutex);
+  }
+
+  inline void PartnerWriter::put_pair(uint32_t id, uint32_t partner_id)
+  {
+    char *out;
+    if (used + MAX_PAIR_SIZE > buffer_size) submit();
+    out = &buffers[fill][used];
+    if (format == PARTNERS_BINARY) {
+      memcpy(out, &id, sizeof(id));
+      memcpy(out + sizeof(id), &partner_id, sizeof(partner_id));
+      used += 2 * sizeof(uint32_t);
+      return;
+    }
+    // The digits are made backwards and then copied
+    char digits[10];
+    uint32_t values[2] = {id, partner_id};
+    for (int v = 0; v < 2; ++v) {
+      int n = 0;
+      do {
+        digits[n++] = (char) ('0' + values[v] % 10);
+        values[v] /= 10;
+      } while (values[v]);
+      while (n) *out++ = digits[--n];
+      *out++ = v ? '\n' : ',';
+    }
+    used = out - &buffers[fill][0];
+  }
+
+  void PartnerWriter::write(const Indiv population[], size_t size)
+  {
+    assert(fd >= 0);
+    assert(size <= 0xFFFFFFFFu);
+    for (size_t i = 0; i < size; ++i) {
+      const Indiv *partner = population[i].partner;
+      // Each partnership once, from the partner that comes first
+      if (partner > &population[i])
+        put_pair((uint32_t) i, (uint32_t) (partner - population));
+    }
+  }
+
+  void PartnerWriter::write(const vector<Indiv> &population)
+  {
+    if (!population.empty()) write(&population[0], population.size());
+  }
+
+  void PartnerWriter::write(const CompactPopulation &population)
+  {
+    assert(fd >= 0);
+    for (uint32_t i = 0; i < population.size(); ++i) {
+      uint32_t partner = population.partner(i);
+      if (partner != CompactPopulation::NO_PARTNER && partner > i)
+        put_pair(i, partner);
+    }
+  }
+
+  int PartnerWriter::flush()
+  {
+    if (fd < 0) return error;
+    submit();
+    wait_written();
+    return error;
+  }
+
+  int PartnerWriter::close()
+  {
+    int result;
+    if (fd < 0) return 0;
+    result = flush();
+    if (started) {
+      pthread_mutex_lock(&mutex);
+      stopping = true;
+      pthread_cond_signal(&ready);
+      pthread_mutex_unlock(&mutex);
+      pthread_join(thread, NULL);
+      started = false;
+    }
+    if (own_fd && ::close(fd) && !result) result = IO_ERROR;
+    fd = -1;
+    return result;
+  }
+}
@@ -0,0 +1,115 @@
+/**
+  (C) Nathan Geffen and Leigh Johnson 2013 under GPL version 3.0.
+  This is free software. See the file called COPYING for the license.
+
+  # Output of the partnerships made by match_pair
+
+  A PartnerWriter writes each partnership in a population once, as the
+  pair (id, partner id), where an individual's id is its index in the
+  population. The pairs are written as a binary edge list of two 32 bit
+  unsigned integers each, in the byte order of the machine, or as CSV
+  lines "id,partner_id".
+
+  The pairs are put in large buffers, which are written with writev, so
+  there is one system call for several megabytes. With a background
+  thread the buffers are written by that thread while the caller goes on
+  filling the next one, and the caller only waits if all the buffers are
+  waiting to be written.
+*/
+
+#ifndef PARTNER_WRITER_H
+#define PARTNER_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <pthread.h>
+
+#include "population.h"
+
+namespace mp {
+
+  /** Formats of PartnerWriter */
+  static const int PARTNERS_BINARY = 0;
+  static const int PARTNERS_CSV = 1;
+
+  class PartnerWriter {
+  public:
+    /** Input parameters:
+
+        format: PARTNERS_BINARY or PARTNERS_CSV
+
+        background: whether to write on a background thread. If the
+        thread can't be started the caller's thread writes.
+
+        buffer_size, num_buffers: size and number of the buffers. There
+        must be at least 2 buffers for a background thread to help.
+     */
+    PartnerWriter(int format = PARTNERS_BINARY, bool background = true,
+                  size_t buffer_size = 4 << 20, unsigned num_buffers = 4);
+
+    /** Closes the file, if any. */
+    ~PartnerWriter();
+
+    /** Writes to a new file called path, closing the one that was
+        being written, if any. Returns 0 or IO_ERROR.
+     */
+    int open(const char *path);
+
+    /** Same as above, but writes to the file descriptor fd, e.g. 1 for
+        stdout, which isn't closed.
+     */
+    int open(int fd);
+
+    /** Adds the partnerships of the size individuals in population.
+        Partners must be in population, and size must be less than
+        2^32.
+     */
+    void write(const Indiv population[], size_t size);
+    void write(const vector<Indiv> &population);
+    void write(const CompactPopulation &population);
+
+    /** Waits until everything added has been written. Returns 0, or
+        IO_ERROR if anything couldn't be written.
+     */
+    int flush();
+
+    /** Flushes and closes the file. Returns the same as flush. */
+    int close();
+
+  private:
+    void put_pair(uint32_t id, uint32_t partner_id);
+    void submit();
+    void wait_written();
+    void write_buffers(size_t first, size_t n);
+    static void *run(void *arg);
+
+    int format;
+    bool background;
+    size_t buffer_size;
+    vector< vector< char > > buffers;
+    vector< size_t > lengths; // Of the buffers waiting to be written
+    size_t fill;              // Buffer being filled
+    size_t used;              // Bytes of it that have been filled
+
+    // The buffers are used in turn. The writer has taken the first 
+    // "taken" of them from head on, the "queued" after those are 
+    // waiting for it, and the next one, fill, is being filled.
+    size_t head, taken, queued;
+
+    int fd;
+    bool own_fd;
+    int error;
+    bool started;             // Whether the thread is running
+    bool stopping;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t ready;     // Signalled when buffers are queued
+    pthread_cond_t done;      // Signalled when buffers have been written
+
+    PartnerWriter(const PartnerWriter &);
+    PartnerWriter &operator=(const PartnerWriter &);
+  };
+}
+
+#endif /* PARTNER_WRITER_H */
@@ -0,0 +1,163 @@
+/*
+  (C) Nathan Geffen 2013 under GPL version 3.0. This is free software.
+  See the file called COPYING for the license.
+
+  # Definitions of the block functions of the Philox generator.
+
+  See philox.h for documentation of the generator.
+*/
+
+#include <string.h>
+
+#include "philox.h"
+
+/* Multipliers and key increments of Philox4x32 */
+
+static const uint32_t PHILOX_M0 = 0xD2511F53;
+static const uint32_t PHILOX_M1 = 0xCD9E8D57;
+static const uint32_t PHILOX_W0 = 0x9E3779B9;
+static const uint32_t PHILOX_W1 = 0xBB67AE85;
+static const int PHILOX_ROUNDS = 10;
+
+void philox_blocks_scalar(const uint32_t key[2], uint64_t counter, size_t n,
+                          uint32_t out[])
+{
+  size_t j;
+  uint32_t c0, c1, c2, c3, k0, k1;
+  uint64_t p0, p1;
+  int round;
+  for (j = 0; j < n; ++j, ++counter, out += 4) {
+    c0 = (uint32_t) counter;
+    c1 = (uint32_t) (counter >> 32);
+    c2 = c3 = 0;
+    k0 = key[0];
+    k1 = key[1];
+    for (round = 0; round < PHILOX_ROUNDS; ++round) {
+      p0 = (uint64_t) PHILOX_M0 * c0;
+      p1 = (uint64_t) PHILOX_M1 * c2;
+      c0 = (uint32_t) (p1 >> 32) ^ c1 ^ k0;
+      c1 = (uint32_t) p1;
+      c2 = (uint32_t) (p0 >> 32) ^ c3 ^ k1;
+      c3 = (uint32_t) p0;
+      k0 += PHILOX_W0;
+      k1 += PHILOX_W1;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+  }
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+#define PHILOX_HAVE_SIMD 1
+
+#include <immintrin.h>
+
+/* Makes 4 blocks at a time, one in each 64 bit lane, whose low 32 bits
+   hold the word of the block. _mm256_mul_epu32 multiplies the low 32 
+   bits of each lane to a 64 bit product, which is the 32 by 32 bit 
+   multiply that each round needs. It ignores the high 32 bits, so they
+   are only cleared at the end. */
+
+__attribute__((target("avx2")))
+void philox_blocks_avx2(const uint32_t key[2], uint64_t counter, size_t n,
+                        uint32_t out[])
+{
+  const __m256i low = _mm256_set1_epi64x(0xFFFFFFFF);
+  const __m256i m0 = _mm256_set1_epi64x(PHILOX_M0);
+  const __m256i m1 = _mm256_set1_epi64x(PHILOX_M1);
+  __m256i k0[PHILOX_ROUNDS], k1[PHILOX_ROUNDS];
+  __m256i counters = _mm256_set_epi64x(counter + 3, counter + 2, 
+                                       counter + 1, counter);
+  __m256i c0, c1, c2, c3, p0, p1, lo, hi;
+  size_t j;
+  int round;
+  for (round = 0; round < PHILOX_ROUNDS; ++round) {
+    k0[round] = _mm256_set1_epi64x(key[0] + round * PHILOX_W0);
+    k1[round] = _mm256_set1_epi64x(key[1] + round * PHILOX_W1);
+  }
+  for (j = 0; j + 4 <= n; j += 4, out += 16) {
+    c0 = counters;
+    c1 = _mm256_srli_epi64(counters, 32);
+    c2 = c3 = _mm256_setzero_si256();
+    for (round = 0; round < PHILOX_ROUNDS; ++round) {
+      p0 = _mm256_mul_epu32(c0, m0);
+      p1 = _mm256_mul_epu32(c2, m1);
+      c0 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p1, 32), c1),
+                            k0[round]);
+      c1 = p1;
+      c2 = _mm256_xor_si256(_mm256_xor_si256(_mm256_srli_epi64(p0, 32), c3),
+                            k1[round]);
+      c3 = p0;
+    }
+    /* Words 0 and 1, and 2 and 3, of each block are paired in 64 bit 
+       lanes, and then the halves of each block are put together */
+    c0 = _mm256_or_si256(_mm256_and_si256(c0, low), 
+                         _mm256_slli_epi64(c1, 32));
+    c2 = _mm256_or_si256(_mm256_and_si256(c2, low), 
+                         _mm256_slli_epi64(c3, 32));
+    lo = _mm256_unpacklo_epi64(c0, c2);
+    hi = _mm256_unpackhi_epi64(c0, c2);
+    _mm256_storeu_si256((__m256i *) out, 
+                        _mm256_permute2x128_si256(lo, hi, 0x20));
+    _mm256_storeu_si256((__m256i *) (out + 8), 
+                        _mm256_permute2x128_si256(lo, hi, 0x31));
+    counters = _mm256_add_epi64(counters, _mm256_set1_epi64x(4));
+  }
+  philox_blocks_scalar(key, counter + j, n - j, out);
+}
+
+#endif
+
+typedef void (*Philox_blocks)(const uint32_t [2], uint64_t, size_t, 
+                              uint32_t []);
+
+/*
+  Returns the fastest block function that the CPU supports.
+*/
+
+Philox_blocks philox_kernel()
+{
+#ifdef PHILOX_HAVE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) return philox_blocks_avx2;
+#endif
+  return philox_blocks_scalar;
+}
+
+void philox_blocks(const uint32_t key[2], uint64_t counter, size_t n, 
+                   uint32_t out[])
+{
+  static const Philox_blocks kernel = philox_kernel();
+  kernel(key, counter, n, out);
+}
+
+void TRandomPhilox::Fill(uint32_t out[], size_t n)
+{
+  size_t k = BUFFER_SIZE - used < n ? BUFFER_SIZE - used : n;
+  memcpy(out, output + used, k * sizeof(uint32_t));
+  used += k;
+  out += k;
+  n -= k;
+  /* Whole blocks go straight to out */
+  philox_blocks(key, counter, n / 4, out);
+  counter += n / 4;
+  out += n / 4 * 4;
+  n %= 4;
+  while (n--) *out++ = BRandom();
+}
+
+void TRandomPhilox::Fill(double out[], size_t n)
+{
+  uint32_t bits[BUFFER_SIZE];
+  size_t i, k;
+  while (n) {
+    k = n < BUFFER_SIZE ? n : BUFFER_SIZE;
+    Fill(bits, k);
+    for (i = 0; i < k; ++i) out[i] = bits[i] * (1.0 / 4294967296.0);
+    out += k;
+    n -= k;
+  }
+}
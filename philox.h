@@ -0,0 +1,150 @@
+/**
+  (C) Nathan Geffen 2013 under GPL version 3.0. This is free software.
+  See the file called COPYING for the license.
+
+  # Counter based random number generator with independent streams.
+
+  This is the Philox4x32-10 generator of Salmon, Moraes, Dror and Shaw
+  (Parallel random numbers: as easy as 1, 2, 3, 2011). Each block of four
+  numbers is a function of a key and the block's number, the counter, so
+  there is no state to carry from one number to the next. The key is
+  made of a seed and a stream number. Streams with different numbers are
+  independent, so each thread or replicate can draw from its own stream
+  and get the same numbers however the work is spread over threads.
+  Skipping ahead in a stream is O(1). It passes the BigCrush tests.
+
+  Blocks are made several at a time, with SIMD instructions where the CPU
+  has them (see philox.cpp), and kept in a buffer that BRandom reads, so
+  most calls only read the buffer. Fill gets many numbers at once.
+
+  The member functions are the same as those of TRandomMersenne in
+  randomc.h, so either can be used.
+*/
+
+#ifndef PHILOX_H
+#define PHILOX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Number of blocks of 4 numbers that TRandomPhilox makes at a time */
+
+static const size_t PHILOX_BLOCKS = 8;
+
+/* Sets out to the n blocks of 4 numbers of the Philox4x32-10 generator
+   with the given key, starting at block counter. */
+
+void philox_blocks(const uint32_t key[2], uint64_t counter, size_t n, 
+                   uint32_t out[]);
+
+class TRandomPhilox {
+public:
+  TRandomPhilox(uint32_t seed, uint32_t stream = 0) {
+    RandomInit(seed, stream);
+  }
+
+  // Starts stream number stream of seed from the beginning
+  void RandomInit(uint32_t seed, uint32_t stream = 0) {
+    key[0] = seed;
+    key[1] = stream;
+    counter = 0;
+    used = BUFFER_SIZE;
+  }
+
+  // Skips the next n numbers of the stream
+  void Skip(uint64_t n) {
+    uint64_t position = counter * 4 - (BUFFER_SIZE - used) + n;
+    counter = position / 4;
+    used = BUFFER_SIZE;
+    if (position % 4) {
+      Generate();
+      used = (size_t) (position % 4);
+    }
+  }
+
+  // Returns 32 random bits
+  uint32_t BRandom() {
+    if (used == BUFFER_SIZE) Generate();
+    return output[used++];
+  }
+
+  // Sets out to the next n numbers, which are the same as n calls to 
+  // BRandom would return
+  void Fill(uint32_t out[], size_t n);
+
+  // Sets out to the next n numbers in [0, 1), the same as n calls to 
+  // Random would return
+  void Fill(double out[], size_t n);
+
+  // Returns a random integer in [0, range), for range > 0. Every value is
+  // equally likely. Lemire's method (Fast random integer generation in
+  // an interval, 2019) multiplies 32 random bits by range and takes the
+  // top 32 bits of the product. The low bits show whether this is one of
+  // the few results that would make it biased, which are rare, and then
+  // it draws again.
+  uint32_t Bounded(uint32_t range) {
+    uint64_t m = (uint64_t) BRandom() * range;
+    uint32_t low = (uint32_t) m, threshold;
+    if (low < range) {
+      threshold = (uint32_t) -range % range;
+      while (low < threshold) {
+        m = (uint64_t) BRandom() * range;
+        low = (uint32_t) m;
+      }
+    }
+    return (uint32_t) (m >> 32);
+  }
+
+  // Returns 64 random bits, made of the next two numbers
+  uint64_t BRandom64() {
+    uint64_t high = BRandom();
+    return high << 32 | BRandom();
+  }
+
+  // Same as Bounded, for 64 bit ranges. A range that fits in 32 bits
+  // uses Bounded, and so draws the same numbers.
+  uint64_t Bounded64(uint64_t range) {
+    if (range <= 0xFFFFFFFFu) return Bounded((uint32_t) range);
+    unsigned __int128 m = (unsigned __int128) BRandom64() * range;
+    uint64_t low = (uint64_t) m, threshold;
+    if (low < range) {
+      threshold = -range % range;
+      while (low < threshold) {
+        m = (unsigned __int128) BRandom64() * range;
+        low = (uint64_t) m;
+      }
+    }
+    return (uint64_t) (m >> 64);
+  }
+
+  // Returns a random number in [0, 1), with 32 bits of resolution
+  double Random() {
+    return BRandom() * (1.0 / 4294967296.0);
+  }
+
+  // Returns a random integer in [min, max], as TRandomMersenne does
+  int IRandom(int min, int max) {
+    int r;
+    if (max < min) return 0x80000000;
+    r = int((max - min + 1) * Random()) + min;
+    return r > max ? max : r;
+  }
+
+private:
+  static const size_t BUFFER_SIZE = 4 * PHILOX_BLOCKS;
+
+  // Fills output with the blocks from counter on, and moves the counter
+  // past them
+  void Generate() {
+    philox_blocks(key, counter, PHILOX_BLOCKS, output);
+    counter += PHILOX_BLOCKS;
+    used = 0;
+  }
+
+  uint32_t key[2];
+  uint64_t counter;                // Number of the next block to make
+  uint32_t output[BUFFER_SIZE];    // Blocks before the counter
+  size_t used;                     // Numbers of output already returned
+};
+
+#endif /* PHILOX_H */
@@ -0,0 +1,194 @@
+/*
+  (C) Nathan Geffen and Leigh Johnson 2013 under GPL version 3.0.
+  This is free software.
+  See the file called COPYING for the license.
+
+  # Definitions of functions for binary population files.
+
+  See population.h for documentation of extern functions.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "population.h"
+
+namespace mp {
+
+  /** Number of records that write_population writes at a time */
+  static const size_t WRITE_RECORDS = 4096;
+
+  int write_population(const char *path, const Indiv population[],
+                       size_t size)
+  {
+    Population_header header;
+    Indiv buffer[WRITE_RECORDS];
+    FILE *f = fopen(path, "wb");
+    int error = 0;
+
+    if (!f) return IO_ERROR;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, POPULATION_MAGIC, sizeof(header.magic));
+    header.version = POPULATION_VERSION;
+    header.record_size = sizeof(Indiv);
+    header.size = size;
+    header.offset = sizeof(header);
+    if (fwrite(&header, sizeof(header), 1, f) != 1) error = IO_ERROR;
+    for (size_t i = 0; i < size && !error; i += WRITE_RECORDS) {
+      size_t n = size - i < WRITE_RECORDS ? size - i : WRITE_RECORDS;
+      // Only the attributes are copied, so the padding stays 0
+      memset(buffer, 0, n * sizeof(Indiv));
+      for (size_t j = 0; j < n; ++j) {
+        buffer[j].sex = population[i + j].sex;
+        buffer[j].age = population[i + j].age;
+        buffer[j].age_group = population[i + j].age_group;
+        buffer[j].risk_group = population[i + j].risk_group;
+        buffer[j].eligible = false;
+        buffer[j].partner = NULL;
+        buffer[j].secondary_partner = NULL;
+      }
+      if (fwrite(buffer, sizeof(Indiv), n, f) != n) error = IO_ERROR;
+    }
+    if (fclose(f) && !error) error = IO_ERROR;
+    return error;
+  }
+
+  int write_population(const char *path, const CompactPopulation &population)
+  {
+    Population_header header;
+    uint8_t buffer[WRITE_RECORDS];
+    const size_t size = population.size();
+    FILE *f = fopen(path, "wb");
+    int error = 0;
+
+    if (!f) return IO_ERROR;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, COMPACT_POPULATION_MAGIC, sizeof(header.magic));
+    header.version = POPULATION_VERSION;
+    header.record_size = COMPACT_RECORD_SIZE;
+    header.size = size;
+    header.offset = sizeof(header);
+    if (fwrite(&header, sizeof(header), 1, f) != 1) error = IO_ERROR;
+    // Without the eligible bits, which belong to the last match
+    for (size_t i = 0; i < size && !error; i += WRITE_RECORDS) {
+      size_t n = size - i < WRITE_RECORDS ? size - i : WRITE_RECORDS;
+      for (size_t j = 0; j < n; ++j)
+        buffer[j] = population.attributes[i + j] & 0x7F;
+      if (fwrite(buffer, 1, n, f) != n) error = IO_ERROR;
+    }
+    if (size && !error && 
+        fwrite(&population.ages[0], 1, size, f) != size) 
+      error = IO_ERROR;
+    if (fclose(f) && !error) error = IO_ERROR;
+    return error;
+  }
+
+  int read_population(const char *path, CompactPopulation &population)
+  {
+    struct stat st;
+    const Population_header *header;
+    const uint8_t *columns;
+    void *map;
+    int fd, error = 0;
+
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0) return IO_ERROR;
+    if (fstat(fd, &st)) {
+      ::close(fd);
+      return IO_ERROR;
+    }
+    if ((size_t) st.st_size < sizeof(Population_header)) {
+      ::close(fd);
+      return BAD_FORMAT;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) return IO_ERROR;
+    header = (const Population_header *) map;
+    if (memcmp(header->magic, COMPACT_POPULATION_MAGIC, 
+               sizeof(header->magic)) ||
+        header->version != POPULATION_VERSION ||
+        header->record_size != COMPACT_RECORD_SIZE ||
+        header->offset > (size_t) st.st_size ||
+        header->size > ((size_t) st.st_size - header->offset) / 
+        COMPACT_RECORD_SIZE ||
+        header->size >= CompactPopulation::NO_PARTNER) {
+      error = BAD_FORMAT;
+    } else {
+      const size_t size = header->size;
+      columns = (const uint8_t *) map + header->offset;
+      population.resize(0);
+      population.resize(size);
+      for (size_t i = 0; i < size; ++i) 
+        population.attributes[i] = columns[i] & 0x7F;
+      if (size) memcpy(&population.ages[0], columns + size, size);
+    }
+    munmap(map, st.st_size);
+    return error;
+  }
+
+  MappedPopulation::MappedPopulation() :
+    map(NULL), map_size(0), records(NULL), num_records(0)
+  {
+  }
+
+  MappedPopulation::~MappedPopulation()
+  {
+    close();
+  }
+
+  int MappedPopulation::open(const char *path)
+  {
+    struct stat st;
+    const Population_header *header;
+    int fd;
+
+    close();
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0) return IO_ERROR;
+    if (fstat(fd, &st)) {
+      ::close(fd);
+      return IO_ERROR;
+    }
+    if ((size_t) st.st_size < sizeof(Population_header)) {
+      ::close(fd);
+      return BAD_FORMAT;
+    }
+    // Private and writable, so match_pair can set the partners without
+    // changing the file
+    map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+      map = NULL;
+      return IO_ERROR;
+    }
+    map_size = st.st_size;
+    header = (const Population_header *) map;
+    if (memcmp(header->magic, POPULATION_MAGIC, sizeof(header->magic)) ||
+        header->version != POPULATION_VERSION ||
+        header->record_size != sizeof(Indiv) ||
+        header->offset % __alignof__(Indiv) ||
+        header->offset > map_size ||
+        header->size > (map_size - header->offset) / sizeof(Indiv)) {
+      close();
+      return BAD_FORMAT;
+    }
+    records = (Indiv *) ((char *) map + header->offset);
+    num_records = header->size;
+    return 0;
+  }
+
+  void MappedPopulation::close()
+  {
+    if (map) munmap(map, map_size);
+    map = NULL;
+    map_size = 0;
+    records = NULL;
+    num_records = 0;
+  }
+}
@@ -0,0 +1,116 @@
+/**
+  (C) Nathan Geffen and Leigh Johnson 2013 under GPL version 3.0.
+  This is free software. See the file called COPYING for the license.
+
+  # Binary population files
+
+  A population file is a Population_header followed by the individuals,
+  as fixed width Indiv records, with no partners. MappedPopulation maps
+  a file into memory instead of reading it, so the records are the
+  population that match_pair matches, and loading it costs only the page
+  faults of the records that are used. The mapping is private, so the
+  partners that match_pair sets are never written to the file.
+
+  Because the records are the Indiv structure itself, a file can only be
+  read by programs built with the same Indiv on the same kind of machine.
+  The header records the size of an Indiv so that others are refused.
+  The padding of the records is written as zeros, so a file depends only
+  on the individuals. The price of mapping is the size: an Indiv takes
+  40 bytes on a 64 bit machine, most of them the partner pointers that
+  are always NULL in the file, so 1e8 individuals take 4 GB.
+
+  A compact population file holds a CompactPopulation instead: the same
+  header with COMPACT_POPULATION_MAGIC, followed by the column of
+  attribute bytes and then the column of ages, 2 bytes an individual, so
+  1e8 individuals take 200 MB. read_population loads it by mapping it
+  and copying the columns, which is about as fast as the disk. The 
+  attribute bytes are packed as in CompactPopulation, whose widths 
+  depend on Cpa_strata, so programs built with other strata mustn't 
+  share them.
+*/
+
+#ifndef POPULATION_H
+#define POPULATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "match_pair.h"
+
+namespace mp {
+
+  /** Error codes */
+  static const int IO_ERROR = 1;       // See errno
+  static const int BAD_FORMAT = 2;     // Not a population file of this
+                                       // program
+
+  static const char POPULATION_MAGIC[8] =
+    {'M', 'P', 'I', 'N', 'D', 'I', 'V', '\0'};
+  static const char COMPACT_POPULATION_MAGIC[8] =
+    {'M', 'P', 'C', 'O', 'M', 'P', 'C', '\0'};
+  static const uint32_t POPULATION_VERSION = 1;
+
+  /** Bytes of an individual in a compact population file */
+  static const uint32_t COMPACT_RECORD_SIZE = 2;
+
+  struct population_header_s {
+    char magic[8];           // POPULATION_MAGIC or COMPACT_POPULATION_MAGIC
+    uint32_t version;        // POPULATION_VERSION
+    uint32_t record_size;    // sizeof(Indiv) or COMPACT_RECORD_SIZE
+    uint64_t size;           // Number of records
+    uint64_t offset;         // Of the first record, or the attribute 
+                             // column, from the start
+  };
+
+  typedef struct population_header_s Population_header;
+
+  /** Writes the size individuals in population to a population file
+      called path. Their partners aren't written. Returns 0 or
+      IO_ERROR.
+   */
+  int write_population(const char *path, const Indiv population[],
+                       size_t size);
+
+  /** Writes population to a compact population file called path. The
+      partners and the eligible bits aren't written. Returns 0 or 
+      IO_ERROR.
+   */
+  int write_population(const char *path, const CompactPopulation &population);
+
+  /** Sets population to the individuals of the compact population file
+      called path, with no partners. Returns 0, IO_ERROR or BAD_FORMAT,
+      in which case population is left as it was.
+   */
+  int read_population(const char *path, CompactPopulation &population);
+
+  /** Population file mapped into memory. */
+
+  class MappedPopulation {
+  public:
+    MappedPopulation();
+    ~MappedPopulation();
+
+    /** Maps the population file called path, unmapping the one that
+        was mapped, if any. O(1): the records are read when they are
+        first used. Returns 0, IO_ERROR or BAD_FORMAT.
+     */
+    int open(const char *path);
+
+    /** Unmaps the population, if any. */
+    void close();
+
+    Indiv *population() { return records; }
+    size_t size() const { return num_records; }
+
+  private:
+    void *map;
+    size_t map_size;
+    Indiv *records;
+    size_t num_records;
+
+    MappedPopulation(const MappedPopulation &);
+    MappedPopulation &operator=(const MappedPopulation &);
+  };
+}
+
+#endif /* POPULATION_H */
@@ -97,10 +97,11 @@
 #include <string>
 using namespace std;
 
-// Define 32 bit signed and unsigned integers.
-// Change these definitions, if necessary, on 64 bit computers
-typedef   signed long int32;     
-typedef unsigned long uint32;     
+// Define 32 bit signed and unsigned integers. A long is 64 bits on 64
+// bit Unix, which breaks the generator and the conversions in Random, so
+// these are ints, which are 32 bits on all the computers this runs on.
+typedef   signed int int32;     
+typedef unsigned int uint32;     
 
 class TRandomMersenne {                // encapsulate random number generator
   #if 0
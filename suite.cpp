@@ -0,0 +1,441 @@
+/*
+  (C) Nathan Geffen 2013 under GPL version 3.0.
+
+  See COPYING for license.
+
+  # Benchmark suite for the searches and match_pair.
+
+  Usage: cpa_suite [-json] [-reps n] [max_size]
+
+  Times these benchmarks, the rows of the output, at sizes from 100 up
+  to max_size (default 1e6) in powers of 10:
+
+    binary, linear, iterate, traverse: the cpa.h functions, in each
+      storage mode and with each weight distribution below
+    match_pair, match_pair_compact: match_pair on Indivs and on a
+      CompactPopulation, in each cpa_mode including integer
+    match_pair_sorted, match_pair_compact_sorted: the same with
+      counting_sort
+    match_pair_secondary: with a secondary round for everyone, a draw
+      being an individual of either round
+    match_incremental: a step of an IncrementalMatch
+    write_csv, write_binary: writing the partnerships with a 
+      PartnerWriter, inline and in the background
+
+  Pass 100000000 for 1e8 if the machine has the memory; sizes that 
+  can't be allocated are reported on stderr and skipped.
+
+  The CPAs are searched with each of three weight distributions: every
+  weight 1 (equal), integers from 1 to 10 (uniform) and a Pareto
+  distribution with shape 1.16, which gives 80% of the weight to 20% of
+  the entries (pareto). match_pair uses generate_weight_default.
+
+  Each measurement is made once to warm up the caches and then reps
+  times (default 5). Before each time the CPA is reset, or the
+  population unpartnered, which isn't timed. The searches take up to
+  half the entries, and at most 1e6, and the linear search at most
+  1e8 / size, so that it finishes. cpa_iterate and cpa_traverse take
+  every entry, and match_pair matches the whole population, for which a
+  draw is an individual. For an IncrementalMatch a draw is an individual
+  whose partnership ended.
+
+  The results are written to stdout as CSV, or with -json as a JSON
+  array, with one record per measurement: the median and minimum ns per
+  draw over the repetitions and the draws per second at the median.
+*/
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include "cpa.h"
+#include "match_pair.h"
+#include "partner_writer.h"
+#include "philox.h"
+
+using namespace mp;
+
+static const size_t MIN_SIZE = 100;
+static const size_t DEFAULT_MAX_SIZE = 1000000;
+static const size_t MAX_DRAWS = 1000000;
+static const size_t MAX_LINEAR_WORK = 100000000;
+static const unsigned DEFAULT_REPS = 5;
+static const uint32_t SEED = 31279;
+
+static const int NUM_DISTRIBUTIONS = 3;
+static const char *DISTRIBUTION_NAMES[] = {"equal", "uniform", "pareto"};
+static const double PARETO_SHAPE = 1.16;
+
+/* Names of the cpa_modes of match_pair. The first NUM_CPA_MODES are the
+   storage modes of cpa.h. */
+
+static const char *MODE_NAMES[] = {"aos", "soa", "fenwick", "integer"};
+static const int NUM_MODES = sizeof(MODE_NAMES) / sizeof(MODE_NAMES[0]);
+static const int NUM_CPA_MODES = CPA_FENWICK + 1;
+
+static bool json = false;
+static unsigned reps = DEFAULT_REPS;
+static size_t num_reported = 0;
+
+double now_ns(void)
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+double draw_weight(TRandomPhilox &rng, const int distribution)
+{
+  if (distribution == 0) return 1.0;
+  if (distribution == 1) return rng.IRandom(1, 10);
+  return pow(1.0 - rng.Random(), -1.0 / PARETO_SHAPE);
+}
+
+/*
+  Writes one record. ns holds the time of each repetition.
+*/
+
+void report(const char *benchmark, const char *mode, const char *weights,
+            const size_t size, const size_t draws, vector< double > &ns)
+{
+  double median, fastest;
+  sort(ns.begin(), ns.end());
+  median = (ns[(ns.size() - 1) / 2] + ns[ns.size() / 2]) / 2 / draws;
+  fastest = ns[0] / draws;
+  if (json) {
+    printf("%s\n  {\"benchmark\": \"%s\", \"mode\": \"%s\", "
+           "\"weights\": \"%s\", \"size\": %zu, \"draws\": %zu, "
+           "\"reps\": %zu, \"median_ns_per_draw\": %.2f, "
+           "\"min_ns_per_draw\": %.2f, \"draws_per_s\": %.0f}",
+           num_reported ? "," : "[", benchmark, mode, weights, size, draws,
+           ns.size(), median, fastest, 1e9 / median);
+  } else {
+    if (!num_reported)
+      printf("benchmark,mode,weights,size,draws,reps,median_ns_per_draw,"
+             "min_ns_per_draw,draws_per_s\n");
+    printf("%s,%s,%s,%zu,%zu,%zu,%.2f,%.2f,%.0f\n", benchmark, mode,
+           weights, size, draws, ns.size(), median, fastest, 1e9 / median);
+  }
+  fflush(stdout);
+  ++num_reported;
+}
+
+/*
+  Functions timed by bench_cpa. Each makes draws draws from cpa, with
+  u the uniform random numbers to use, and returns how many found
+  nothing.
+*/
+
+size_t run_binary(Cpa *cpa, const double u[], const size_t draws)
+{
+  size_t k, not_found = 0;
+  for (k = 0; k < draws; ++k)
+    if (!cpa_binary_search(cpa, u[k] * cpa->cumulative_weight)) ++not_found;
+  return not_found;
+}
+
+size_t run_linear(Cpa *cpa, const double u[], const size_t draws)
+{
+  size_t k, not_found = 0;
+  for (k = 0; k < draws; ++k)
+    if (!cpa_linear_search(cpa, u[k] * cpa->cumulative_weight)) ++not_found;
+  return not_found;
+}
+
+size_t run_iterate(Cpa *cpa, const double u[], const size_t draws)
+{
+  size_t k, not_found = 0;
+  Cpa_iterator iterator;
+  (void) u;
+  iterator.started = 0;
+  iterator.stack_size = 0;
+  for (k = 0; k < draws; ++k)
+    if (!cpa_iterate(cpa, &iterator)) ++not_found;
+  return not_found;
+}
+
+size_t run_traverse(Cpa *cpa, const double u[], const size_t draws)
+{
+  (void) u;
+  (void) draws;
+  cpa_traverse(cpa, NULL);
+  return cpa->num_found != cpa->size;
+}
+
+typedef size_t (*Run)(Cpa *, const double [], const size_t);
+
+/*
+  Times run on a CPA of the given size, storage mode and weight
+  distribution.
+*/
+
+void bench_cpa(const char *benchmark, Run run, const size_t size,
+               const size_t draws, const int mode, const int distribution)
+{
+  TRandomPhilox rng(SEED);
+  size_t i, not_found = 0;
+  unsigned r;
+  double start;
+  vector< double > ns;
+  /* Only the searches use u, and they make at most MAX_DRAWS draws */
+  const size_t num_u = draws < MAX_DRAWS ? draws : MAX_DRAWS;
+  Cpa *cpa = cpa_new_mode(size, NULL, NULL, mode);
+  double *u = (double *) malloc(sizeof(double) * num_u);
+
+  if (cpa->error || !u) {
+    fprintf(stderr, "%s %s %zu: could not allocate\n", benchmark,
+            MODE_NAMES[mode], size);
+  } else {
+    for (i = 0; i < size; ++i)
+      cpa_append(cpa, (void *) (i + 1), draw_weight(rng, distribution));
+    rng.Fill(u, num_u);
+    for (r = 0; r <= reps; ++r) {
+      cpa_reset(cpa);
+      start = now_ns();
+      not_found += run(cpa, u, draws);
+      if (r) ns.push_back(now_ns() - start);  /* The first is a warm up */
+    }
+    if (not_found)
+      fprintf(stderr, "%s %s %zu: %zu draws found nothing\n", benchmark,
+              MODE_NAMES[mode], size, not_found);
+    report(benchmark, MODE_NAMES[mode], DISTRIBUTION_NAMES[distribution],
+           size, draws, ns);
+  }
+  cpa_free(cpa);
+  free(u);
+}
+
+bool can_pair_secondary_always(const Indiv *)
+{
+  return true;
+}
+
+/*
+  Times match_pair on a population of the given size, made the same way
+  as main.cpp makes it, with one MatchContext that is used for every
+  call, and with a secondary round if secondary is set.
+*/
+
+void bench_match_pair(const size_t size, const int cpa_mode,
+                      const bool counting_sort, const bool secondary)
+{
+  TRandomPhilox rng(SEED);
+  ThreadRandStream use(rng);
+  unsigned r;
+  double start;
+  vector< double > ns;
+
+  try {
+    vector< Indiv > population(size);
+    MatchContext context(cpa_mode);
+    context.counting_sort = counting_sort;
+    if (secondary) context.can_pair_secondary = can_pair_secondary_always;
+    for (size_t i = 0; i < size; ++i) {
+      population[i].sex = (unsigned) i % 2;
+      population[i].age = (unsigned) rand_int_range(17, 65);
+      population[i].age_group = population[i].age / 5;
+      population[i].risk_group = (unsigned) rand_int_range(0, 1);
+    }
+    for (r = 0; r <= reps; ++r) {
+      for (size_t i = 0; i < size; ++i) 
+        population[i].partner = population[i].secondary_partner = NULL;
+      start = now_ns();
+      match_pair(population, context);
+      if (r) ns.push_back(now_ns() - start);
+    }
+  } catch (std::bad_alloc &) {
+    fprintf(stderr, "match_pair %s %zu: could not allocate\n",
+            MODE_NAMES[cpa_mode], size);
+    return;
+  }
+  report(secondary ? "match_pair_secondary" : 
+         counting_sort ? "match_pair_sorted" : "match_pair",
+         MODE_NAMES[cpa_mode], "default", size, secondary ? 2 * size : size,
+         ns);
+}
+
+/*
+  Same as bench_match_pair, for the same population as a 
+  CompactPopulation.
+*/
+
+void bench_match_pair_compact(const size_t size, const int cpa_mode,
+                              const bool counting_sort)
+{
+  TRandomPhilox rng(SEED);
+  ThreadRandStream use(rng);
+  unsigned r;
+  double start;
+  vector< double > ns;
+
+  try {
+    CompactPopulation population(size);
+    MatchContext context(cpa_mode);
+    context.counting_sort = counting_sort;
+    for (uint32_t i = 0; i < size; ++i) {
+      unsigned age = (unsigned) rand_int_range(17, 65);
+      population.set(i, i % 2, age, age / 5, 
+                     (unsigned) rand_int_range(0, 1));
+    }
+    for (r = 0; r <= reps; ++r) {
+      fill(population.partners.begin(), population.partners.end(),
+           CompactPopulation::NO_PARTNER);
+      start = now_ns();
+      match_pair(population, context);
+      if (r) ns.push_back(now_ns() - start);
+    }
+  } catch (std::bad_alloc &) {
+    fprintf(stderr, "match_pair compact %s %zu: could not allocate\n",
+            MODE_NAMES[cpa_mode], size);
+    return;
+  }
+  report(counting_sort ? "match_pair_compact_sorted" : "match_pair_compact",
+         MODE_NAMES[cpa_mode], "default", size, size, ns);
+}
+
+/*
+  Times a step of an IncrementalMatch in which the partnerships of
+  CHURN_PERCENT of the population end and the individuals are matched
+  again. The population is made as for bench_match_pair, and first 
+  matched by the IncrementalMatch.
+*/
+
+static const unsigned CHURN_PERCENT = 2;
+
+void bench_incremental(const size_t size)
+{
+  TRandomPhilox rng(SEED);
+  ThreadRandStream use(rng);
+  unsigned r;
+  double start;
+  vector< double > ns;
+  size_t draws = 0;
+
+  try {
+    vector< Indiv > population(size);
+    vector< size_t > positions(size);
+    IncrementalMatch incremental;
+    for (size_t i = 0; i < size; ++i) {
+      population[i].sex = (unsigned) i % 2;
+      population[i].age = (unsigned) rand_int_range(17, 65);
+      population[i].age_group = population[i].age / 5;
+      population[i].risk_group = (unsigned) rand_int_range(0, 1);
+      positions[i] = i;
+    }
+    incremental.add(&population[0], &positions[0], size);
+    incremental.match(&population[0]);
+    for (r = 0; r <= reps; ++r) {
+      positions.clear();
+      for (size_t i = 0; i < size; ++i) {
+        Indiv *partner = population[i].partner;
+        if (partner > &population[i] && 
+            rand_int_to_open(100) < (int) CHURN_PERCENT) {
+          partner->partner = population[i].partner = NULL;
+          positions.push_back(i);
+          positions.push_back(partner - &population[0]);
+        }
+      }
+      start = now_ns();
+      incremental.add(&population[0], 
+                      positions.empty() ? NULL : &positions[0], 
+                      positions.size());
+      incremental.match(&population[0]);
+      if (r) ns.push_back(now_ns() - start);
+      draws = positions.size() ? positions.size() : 1;
+    }
+  } catch (std::bad_alloc &) {
+    fprintf(stderr, "incremental %zu: could not allocate\n", size);
+    return;
+  }
+  report("match_incremental", "fenwick", "default", size, draws, ns);
+}
+
+/*
+  Times writing the partnerships made by match_pair in a population of 
+  the given size to /dev/null with a PartnerWriter, which measures what 
+  the caller pays for the output.
+*/
+
+void bench_partner_writer(const size_t size, const int format,
+                          const bool background)
+{
+  TRandomPhilox rng(SEED);
+  ThreadRandStream use(rng);
+  unsigned r;
+  double start;
+  vector< double > ns;
+  PartnerWriter writer(format, background);
+
+  try {
+    vector< Indiv > population(size);
+    for (size_t i = 0; i < size; ++i) {
+      population[i].sex = (unsigned) i % 2;
+      population[i].age = (unsigned) rand_int_range(17, 65);
+      population[i].age_group = population[i].age / 5;
+      population[i].risk_group = (unsigned) rand_int_range(0, 1);
+    }
+    match_pair(population);
+    for (r = 0; r <= reps; ++r) {
+      if (writer.open("/dev/null")) {
+        fprintf(stderr, "could not open /dev/null\n");
+        return;
+      }
+      start = now_ns();
+      writer.write(population);
+      writer.flush();
+      if (r) ns.push_back(now_ns() - start);
+      writer.close();
+    }
+  } catch (std::bad_alloc &) {
+    fprintf(stderr, "partner writer %zu: could not allocate\n", size);
+    return;
+  }
+  report(format == PARTNERS_CSV ? "write_csv" : "write_binary",
+         background ? "background" : "inline", "default", size, size, ns);
+}
+
+int main(int argc, char *argv[])
+{
+  size_t size, draws, max_size = DEFAULT_MAX_SIZE;
+  int i, mode, distribution;
+
+  for (i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-json") == 0) json = true;
+    else if (strcmp(argv[i], "-reps") == 0 && i + 1 < argc)
+      reps = (unsigned) strtoul(argv[++i], NULL, 10);
+    else max_size = (size_t) strtod(argv[i], NULL);
+  }
+  if (!reps) reps = 1;
+
+  for (size = MIN_SIZE; size <= max_size; size *= 10) {
+    draws = size / 2 < MAX_DRAWS ? size / 2 : MAX_DRAWS;
+    for (distribution = 0; distribution < NUM_DISTRIBUTIONS; ++distribution)
+      for (mode = 0; mode < NUM_CPA_MODES; ++mode) {
+        bench_cpa("binary", run_binary, size, draws, mode, distribution);
+        bench_cpa("linear", run_linear, size,
+                  min(draws, MAX_LINEAR_WORK / size), mode, distribution);
+        bench_cpa("iterate", run_iterate, size, size, mode, distribution);
+        bench_cpa("traverse", run_traverse, size, size, mode, distribution);
+      }
+    for (mode = 0; mode < NUM_MODES; ++mode)
+      for (i = 0; i < 2; ++i) {
+        bench_match_pair(size, mode, i, false);
+        bench_match_pair_compact(size, mode, i);
+      }
+    for (mode = 0; mode < NUM_MODES; ++mode)
+      bench_match_pair(size, mode, false, true);
+    bench_incremental(size);
+    for (mode = 0; mode < 2; ++mode) {
+      bench_partner_writer(size, PARTNERS_BINARY, mode);
+      bench_partner_writer(size, PARTNERS_CSV, mode);
+    }
+  }
+  if (json) printf("%s]\n", num_reported ? "\n" : "[");
+  return 0;
+}